@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include "adapt.h"
+
+#define LOSS_CUT 0.05 /* fraction lost which cuts the bitrate */
+#define LOSS_CLEAN 0.01 /* ... and below which it may be raised */
+#define JITTER_RISE 0.010 /* seconds above the least seen, as queueing */
+#define CUT 0.8 /* of the bitrate */
+#define RAISE 0.05 /* of the maximum bitrate */
+#define HOLD 1.0 /* seconds between cuts, for their effect to show */
+#define SETTLE 5.0 /* seconds clean before raising */
+#define LOSS_DECAY 8 /* reports */
+#define MAX_LOSS 50 /* percent */
+
+void adapt_init(struct adapt *a, unsigned int min, unsigned int max,
+		unsigned int loss)
+{
+	a->min = min < max ? min : max;
+	a->max = max;
+	a->floor = loss;
+	a->kbps = max;
+	a->loss = loss;
+	a->reported = false;
+}
+
+void adapt_report(struct adapt *a, const struct report *r, double now)
+{
+	double pct;
+
+	if (!a->reported) {
+		a->reported = true;
+		a->base_jitter = r->jitter;
+		a->last_cut = now - HOLD;
+		a->clean_since = now;
+	}
+
+	/* The least jitter seen is the path without queues; follow
+	 * it slowly upwards, in case the path itself has changed */
+
+	if (r->jitter < a->base_jitter)
+		a->base_jitter = r->jitter;
+	else
+		a->base_jitter += (r->jitter - a->base_jitter) / 64;
+
+	/* The loss hint, which sets the strength of the FEC, rises at
+	 * once and falls over a few reports */
+
+	pct = r->loss * 100.0;
+	if (pct > a->loss)
+		a->loss = pct;
+	else
+		a->loss += (pct - a->loss) / LOSS_DECAY;
+
+	if (r->loss >= LOSS_CUT) {
+		if (now - a->last_cut >= HOLD) {
+			a->kbps *= CUT;
+			if (a->kbps < a->min)
+				a->kbps = a->min;
+			a->last_cut = now;
+		}
+		a->clean_since = now;
+		return;
+	}
+
+	if (r->loss >= LOSS_CLEAN || r->jitter > a->base_jitter + JITTER_RISE) {
+		a->clean_since = now;
+		return;
+	}
+
+	if (now - a->clean_since >= SETTLE) {
+		a->kbps += a->max * RAISE;
+		if (a->kbps > a->max)
+			a->kbps = a->max;
+		a->clean_since = now - SETTLE + REPORT_INTERVAL;
+	}
+}
+
+unsigned int adapt_kbps(const struct adapt *a)
+{
+	return a->kbps + 0.5;
+}
+
+/*
+ * Expected packet loss in percent, for OPUS_SET_PACKET_LOSS_PERC;
+ * never less than was given at the start
+ */
+
+unsigned int adapt_loss(const struct adapt *a)
+{
+	unsigned int pct;
+
+	pct = a->loss + 0.5;
+	if (pct < a->floor)
+		pct = a->floor;
+	if (pct > MAX_LOSS)
+		pct = MAX_LOSS;
+
+	return pct;
+}
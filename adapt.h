@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef ADAPT_H
+#define ADAPT_H
+
+#include <stdbool.h>
+
+#include "report.h"
+
+/*
+ * Steer a sender's bitrate and in-band FEC from its receivers'
+ * reports. Loss cuts the bitrate at once; it is only raised again,
+ * a step at a time, after a spell in which no receiver has seen loss
+ * or a rise in jitter. With several receivers (multicast) the worst
+ * of them decides
+ */
+
+struct adapt {
+	unsigned int min, max, floor; /* kbps, kbps, percent */
+	double kbps, loss; /* loss in percent */
+	double base_jitter; /* seconds */
+	double last_cut, clean_since;
+	bool reported;
+};
+
+void adapt_init(struct adapt *a, unsigned int min, unsigned int max,
+		unsigned int loss);
+void adapt_report(struct adapt *a, const struct report *r, double now);
+
+unsigned int adapt_kbps(const struct adapt *a);
+unsigned int adapt_loss(const struct adapt *a);
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+
+#include "batch.h"
+
+#define MULTICAST_TTL 16
+#define DSCP 40
+
+/*
+ * Open the socket for a family, with the same multicast reach and
+ * traffic class for every destination
+ */
+
+static int open_socket(int family)
+{
+	int fd, ttl = MULTICAST_TTL, tos = DSCP << 2;
+
+	fd = socket(family, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+	if (fd == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	if (family == AF_INET6) {
+		if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+				&ttl, sizeof ttl) == -1
+			|| setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS,
+				&tos, sizeof tos) == -1)
+		{
+			perror("setsockopt");
+			close(fd);
+			return -1;
+		}
+	} else {
+		if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL,
+				&ttl, sizeof ttl) == -1
+			|| setsockopt(fd, IPPROTO_IP, IP_TOS,
+				&tos, sizeof tos) == -1)
+		{
+			perror("setsockopt");
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
+/*
+ * Prepare a batch of up to max datagrams of the given size each
+ */
+
+int batch_init(struct batch *b, int family, size_t max, size_t size)
+{
+	b->fd = open_socket(family);
+	if (b->fd == -1)
+		return -1;
+
+	b->family = family;
+	b->n = 0;
+	b->max = max;
+	b->size = size;
+	b->tee = NULL;
+	b->bound = false;
+
+	b->buf = calloc(max, size);
+	b->msg = calloc(max, sizeof *b->msg);
+	b->iov = calloc(max, sizeof *b->iov);
+	if (b->buf == NULL || b->msg == NULL || b->iov == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	atomic_init(&b->packets, 0);
+	atomic_init(&b->calls, 0);
+	atomic_init(&b->dropped, 0);
+
+	return 0;
+}
+
+void batch_clear(struct batch *b)
+{
+	close(b->fd);
+	free(b->buf);
+	free(b->msg);
+	free(b->iov);
+}
+
+/*
+ * Return the buffer for the next datagram, sending what is queued if
+ * the batch is full
+ */
+
+unsigned char* batch_next(struct batch *b)
+{
+	if (b->n == b->max)
+		batch_flush(b);
+
+	return b->buf + b->n * b->size;
+}
+
+/*
+ * Queue the datagram most recently returned by batch_next(); the
+ * destination must remain valid until the batch is flushed
+ */
+
+void batch_commit(struct batch *b, const struct sockaddr_storage *dest,
+		socklen_t dest_len, size_t len)
+{
+	struct mmsghdr *m;
+	struct iovec *iov;
+
+	iov = &b->iov[b->n];
+	iov->iov_base = b->buf + b->n * b->size;
+	iov->iov_len = len;
+
+	m = &b->msg[b->n];
+	memset(m, 0, sizeof *m);
+	m->msg_hdr.msg_name = (void*)dest;
+	m->msg_hdr.msg_namelen = dest_len;
+	m->msg_hdr.msg_iov = iov;
+	m->msg_hdr.msg_iovlen = 1;
+
+	b->n++;
+}
+
+/*
+ * Copy datagrams just sent to the tee. The socket is given its port
+ * by the first send, so it is asked for once it has one; being
+ * unconnected, its address stays unspecified
+ */
+
+static void tee(struct batch *b, const struct mmsghdr *m, size_t count)
+{
+	struct timespec now;
+	socklen_t len;
+	size_t n;
+
+	if (!b->bound) {
+		len = sizeof b->local;
+		if (getsockname(b->fd, (struct sockaddr*)&b->local, &len) == 0)
+			b->bound = ((struct sockaddr_in*)&b->local)->sin_port != 0;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	for (n = 0; n < count; n++) {
+		pcap_tee_add(b->tee, b->producer, &now,
+			b->bound ? (struct sockaddr*)&b->local : NULL,
+			m[n].msg_hdr.msg_name,
+			m[n].msg_hdr.msg_iov->iov_base, m[n].msg_len);
+	}
+}
+
+/*
+ * Send everything queued. A full socket buffer drops the remainder
+ * rather than block a real-time thread
+ */
+
+int batch_flush(struct batch *b)
+{
+	size_t done = 0;
+
+	while (done < b->n) {
+		int r;
+
+		r = sendmmsg(b->fd, b->msg + done, b->n - done, 0);
+		atomic_fetch_add_explicit(&b->calls, 1, memory_order_relaxed);
+
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("sendmmsg");
+
+			/* Skip the datagram which failed */
+
+			atomic_fetch_add_explicit(&b->dropped, 1,
+					memory_order_relaxed);
+			done++;
+			continue;
+		}
+
+		atomic_fetch_add_explicit(&b->packets, r, memory_order_relaxed);
+		if (b->tee != NULL)
+			tee(b, b->msg + done, r);
+		done += r;
+	}
+
+	b->n = 0;
+	return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "pcap.h"
+
+/*
+ * Outgoing datagrams are built in place in preallocated buffers and
+ * sent together with a single sendmmsg() call, to any number of
+ * destinations of one address family
+ */
+
+struct batch {
+	int fd, family;
+	size_t n, max, size;
+	unsigned char *buf;
+	struct mmsghdr *msg;
+	struct iovec *iov;
+
+	/* Optional copy of what is sent, as one of its producers */
+
+	struct pcap_tee *tee;
+	size_t producer;
+	struct sockaddr_storage local;
+	bool bound;
+
+	atomic_ulong packets, calls, dropped;
+};
+
+int batch_init(struct batch *b, int family, size_t max, size_t size);
+void batch_clear(struct batch *b);
+
+unsigned char* batch_next(struct batch *b);
+void batch_commit(struct batch *b, const struct sockaddr_storage *dest,
+		socklen_t dest_len, size_t len);
+int batch_flush(struct batch *b);
+
+#endif
@@ -0,0 +1,401 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Time the codec as tx and rx drive it, faster than real time, for a
+ * range of frame sizes, bitrates and complexities
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <opus/opus.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#include "../codec.h"
+
+#define MAX_FRAME 1920 /* as rx */
+#define MAX_PACKET 1500
+#define SECONDS 10 /* of generated material */
+
+/*
+ * Count calls to the allocator by interposing on glibc's, to show
+ * that nothing on the hot path allocates
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+static unsigned long allocations;
+
+void* malloc(size_t size)
+{
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+	allocations++;
+	return __libc_calloc(n, size);
+}
+
+void* realloc(void *p, size_t size)
+{
+	allocations++;
+	return __libc_realloc(p, size);
+}
+
+struct timing {
+	uint64_t ns, cycles;
+	unsigned long allocations;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void start(struct timing *t)
+{
+	t->allocations = allocations;
+	t->cycles = cycles();
+	t->ns = now_ns();
+}
+
+static void stop(struct timing *t)
+{
+	t->ns = now_ns() - t->ns;
+	t->cycles = cycles() - t->cycles;
+	t->allocations = allocations - t->allocations;
+}
+
+/*
+ * Something with the spectrum of music or speech when no recording
+ * is given: harmonics with a slow envelope, and some noise
+ */
+
+static void generate(float *pcm, size_t samples, unsigned int channels,
+		unsigned int rate)
+{
+	size_t n;
+	unsigned int c, h;
+
+	srand(1);
+
+	for (n = 0; n < samples; n++) {
+		double t = (double)n / rate, x = 0.0, env;
+
+		env = 0.5 + 0.5 * sin(2.0 * M_PI * 3.0 * t);
+		for (h = 1; h <= 8; h++)
+			x += sin(2.0 * M_PI * 220.0 * h * t) / h;
+		x = x * env * 0.2 + (rand() / (double)RAND_MAX - 0.5) * 0.02;
+
+		for (c = 0; c < channels; c++)
+			pcm[n * channels + c] = x;
+	}
+}
+
+static float* load(const char *path, size_t *samples,
+		unsigned int channels)
+{
+	FILE *f;
+	long len;
+	size_t n;
+	int16_t *raw;
+	float *pcm;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		perror(path);
+		return NULL;
+	}
+
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+
+	*samples = len / sizeof(*raw) / channels;
+	raw = malloc(*samples * channels * sizeof *raw);
+	pcm = malloc(*samples * channels * sizeof *pcm);
+	if (raw == NULL || pcm == NULL) {
+		perror("malloc");
+		fclose(f);
+		return NULL;
+	}
+
+	if (fread(raw, sizeof *raw * channels, *samples, f) != *samples) {
+		perror("fread");
+		fclose(f);
+		free(raw);
+		free(pcm);
+		return NULL;
+	}
+
+	for (n = 0; n < *samples * channels; n++)
+		pcm[n] = raw[n] / 32768.0f;
+
+	fclose(f);
+	free(raw);
+	return pcm;
+}
+
+/*
+ * Run one configuration over the material and print a line of
+ * results; the loops are those of send_one_frame() and produce()
+ */
+
+static int run(const float *pcm, size_t samples, unsigned int rate,
+		unsigned int channels, unsigned int frame, unsigned int kbps,
+		unsigned int complexity)
+{
+	OpusEncoder *e;
+	OpusDecoder *d;
+	size_t nframes, n, bytes_per_frame, total = 0;
+	unsigned char *packets;
+	size_t *len;
+	float *out;
+	struct timing enc, dec, plc;
+	double audio, rt_enc, rt_dec;
+	int r;
+
+	nframes = samples / frame;
+	bytes_per_frame = codec_bytes_per_frame(kbps, frame, rate);
+	if (bytes_per_frame > MAX_PACKET)
+		bytes_per_frame = MAX_PACKET;
+
+	e = codec_encoder(rate, channels, 0, complexity);
+	d = codec_decoder(rate, channels);
+	packets = malloc(nframes * bytes_per_frame);
+	len = malloc(nframes * sizeof *len);
+	out = malloc(MAX_FRAME * channels * sizeof *out);
+	if (e == NULL || d == NULL || packets == NULL || len == NULL
+		|| out == NULL)
+	{
+		return -1;
+	}
+
+	start(&enc);
+	for (n = 0; n < nframes; n++) {
+		r = opus_encode_float(e, pcm + n * frame * channels, frame,
+				packets + n * bytes_per_frame, bytes_per_frame);
+		if (r < 0) {
+			fprintf(stderr, "opus_encode_float: %s\n",
+				opus_strerror(r));
+			return -1;
+		}
+		len[n] = r;
+		total += r;
+	}
+	stop(&enc);
+
+	start(&dec);
+	for (n = 0; n < nframes; n++) {
+		r = opus_decode_float(d, packets + n * bytes_per_frame, len[n],
+				out, MAX_FRAME, 0);
+		if (r < 0) {
+			fprintf(stderr, "opus_decode: %s\n", opus_strerror(r));
+			return -1;
+		}
+	}
+	stop(&dec);
+
+	/* Conceal every other frame, alternating with real ones to
+	 * keep the decoder in a realistic state */
+
+	start(&plc);
+	for (n = 0; n < nframes; n += 2) {
+		opus_decode_float(d, NULL, 0, out, frame, 1);
+		if (n + 1 < nframes) {
+			opus_decode_float(d, packets + (n + 1) * bytes_per_frame,
+				len[n + 1], out, MAX_FRAME, 0);
+		}
+	}
+	stop(&plc);
+
+	audio = (double)nframes * frame / rate;
+	rt_enc = audio * 1e9 / enc.ns;
+	rt_dec = audio * 1e9 / dec.ns;
+
+	printf("%5u %4u %4u %7.1f | %8.0f %7.1f %7.1f %4lu | "
+		"%8.0f %7.1f %7.1f %4lu | %8.0f | %6.0f %6.0f\n",
+		frame, kbps, complexity,
+		total * 8.0 / audio / 1000.0,
+		(double)enc.ns / nframes, rt_enc,
+		(double)enc.cycles / (nframes * frame), enc.allocations,
+		(double)dec.ns / nframes, rt_dec,
+		(double)dec.cycles / (nframes * frame), dec.allocations,
+		(double)plc.ns / ((nframes + 1) / 2),
+		rt_enc, rt_dec);
+
+	opus_encoder_destroy(e);
+	opus_decoder_destroy(d);
+	free(packets);
+	free(len);
+	free(out);
+
+	return 0;
+}
+
+static int parse_list(const char *s, unsigned int *v, size_t max)
+{
+	size_t n = 0;
+	char *end;
+
+	while (n < max) {
+		v[n++] = strtoul(s, &end, 10);
+		if (end == s)
+			return -1;
+		if (*end == '\0')
+			return n;
+		if (*end != ',')
+			return -1;
+		s = end + 1;
+	}
+
+	return -1;
+}
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: codec [<parameters>]\n"
+		"Benchmark the Opus codec as used by tx and rx\n");
+
+	fprintf(fd, "\nParameters:\n");
+	fprintf(fd, "  -i <file>   Raw signed 16-bit interleaved audio (default generated)\n");
+	fprintf(fd, "  -r <rate>   Sample rate (default 48000Hz)\n");
+	fprintf(fd, "  -c <n>      Number of channels (default 2)\n");
+	fprintf(fd, "  -f <n>,...  Frame sizes (default 120,240,480,960)\n");
+	fprintf(fd, "  -b <n>,...  Bitrates (default 32,64,128)\n");
+	fprintf(fd, "  -x <n>,...  Complexities (default 0,5,10)\n");
+
+	fprintf(fd, "\nStreams per core are the real-time factors of encode and decode.\n");
+}
+
+#define MAX_LIST 16
+
+int main(int argc, char *argv[])
+{
+	float *pcm;
+	size_t samples;
+	int nframes = 4, nkbps = 3, ncomplexity = 3, f, b, x;
+
+	/* command-line options */
+	const char *input = NULL;
+	unsigned int rate = 48000,
+		channels = 2,
+		frames[MAX_LIST] = { 120, 240, 480, 960 },
+		kbps[MAX_LIST] = { 32, 64, 128 },
+		complexity[MAX_LIST] = { 0, 5, 10 };
+
+	for (;;) {
+		int c;
+
+		c = getopt(argc, argv, "b:c:f:i:r:x:");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'b':
+			nkbps = parse_list(optarg, kbps, MAX_LIST);
+			break;
+		case 'c':
+			channels = atoi(optarg);
+			break;
+		case 'f':
+			nframes = parse_list(optarg, frames, MAX_LIST);
+			break;
+		case 'i':
+			input = optarg;
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 'x':
+			ncomplexity = parse_list(optarg, complexity, MAX_LIST);
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (nframes == -1 || nkbps == -1 || ncomplexity == -1) {
+		usage(stderr);
+		return -1;
+	}
+
+	if (input) {
+		pcm = load(input, &samples, channels);
+		if (pcm == NULL)
+			return -1;
+	} else {
+		samples = SECONDS * rate;
+		pcm = malloc(samples * channels * sizeof *pcm);
+		if (pcm == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		generate(pcm, samples, channels, rate);
+	}
+
+	printf("%5s %4s %4s %7s | %8s %7s %7s %4s | "
+		"%8s %7s %7s %4s | %8s | %13s\n",
+		"frame", "kbps", "cplx", "actual",
+		"enc ns", "rtf", "cyc/smp", "allc",
+		"dec ns", "rtf", "cyc/smp", "allc",
+		"plc ns", "streams/core");
+
+	for (f = 0; f < nframes; f++) {
+		for (b = 0; b < nkbps; b++) {
+			for (x = 0; x < ncomplexity; x++) {
+				if (run(pcm, samples, rate, channels, frames[f],
+						kbps[b], complexity[x]) == -1)
+				{
+					return -1;
+				}
+			}
+		}
+	}
+
+	free(pcm);
+
+	return 0;
+}
@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Measure mouth-to-ear latency of a transmitter and receiver joined
+ * by a pair of sound devices (eg. snd-aloop): play a train of chirps
+ * into one and find each again in what is recorded from the other
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <alsa/asoundlib.h>
+
+#include "../device.h"
+
+#define CHIRP 0.010 /* seconds */
+#define CHIRP_LOW 500.0 /* Hz */
+#define CHIRP_HIGH 8000.0
+#define PREFILL 2 /* periods */
+
+static unsigned int verbose = 0;
+
+static void make_chirp(float *out, size_t len, unsigned int rate)
+{
+	size_t n;
+	double t, f, k;
+
+	k = (CHIRP_HIGH - CHIRP_LOW) / CHIRP;
+
+	for (n = 0; n < len; n++) {
+		t = (double)n / rate;
+		f = 2.0 * M_PI * (CHIRP_LOW * t + k * t * t / 2.0);
+		out[n] = sin(f) * 0.5 * (1.0 - cos(2.0 * M_PI * n / len)) / 2.0;
+	}
+}
+
+static snd_pcm_t* open_device(const char *name, snd_pcm_stream_t stream,
+		unsigned int rate, unsigned int channels)
+{
+	int r;
+	snd_pcm_t *pcm;
+	struct alsa_config ac;
+
+	r = snd_pcm_open(&pcm, name, stream, 0);
+	if (r < 0) {
+		aerror("snd_pcm_open", r);
+		return NULL;
+	}
+	ac.rate = rate;
+	ac.channels = channels;
+	ac.buffer = 50000;
+	ac.period = 0;
+	ac.format = SND_PCM_FORMAT_S16_LE;
+	ac.mmap = false;
+
+	if (set_alsa_hw(pcm, &ac) == -1)
+		return NULL;
+	if (set_alsa_sw(pcm) == -1)
+		return NULL;
+
+	return pcm;
+}
+
+/*
+ * Play the signal and record the same number of samples, with both
+ * devices started together; the signal reaches the player after
+ * a lead of silence, returned as a number of samples
+ */
+
+static int play_and_record(snd_pcm_t *play, snd_pcm_t *rec,
+		unsigned int channels, const int16_t *out, int16_t *in,
+		size_t len, size_t *lead)
+{
+	int r;
+	size_t pos;
+	snd_pcm_uframes_t buffer, period;
+	snd_pcm_sframes_t f;
+	snd_pcm_sw_params_t *sw;
+	int16_t *silence;
+
+	r = snd_pcm_get_params(play, &buffer, &period);
+	if (r < 0) {
+		aerror("snd_pcm_get_params", r);
+		return -1;
+	}
+
+	/* Playback must not start itself on the prefill, it is started
+	 * explicitly and together with the recording */
+
+	snd_pcm_sw_params_alloca(&sw);
+
+	r = snd_pcm_sw_params_current(play, sw);
+	if (r >= 0)
+		r = snd_pcm_sw_params_set_start_threshold(play, sw, buffer);
+	if (r >= 0)
+		r = snd_pcm_sw_params(play, sw);
+	if (r < 0) {
+		aerror("snd_pcm_sw_params", r);
+		return -1;
+	}
+
+	r = snd_pcm_link(play, rec);
+	if (r < 0) {
+		aerror("snd_pcm_link", r);
+		return -1;
+	}
+
+	/* The prefill keeps playback fed while the signal is written
+	 * a period at a time; it is played first, so it delays the
+	 * signal against the recording by its own length */
+
+	silence = calloc(period * PREFILL, sizeof(*silence) * channels);
+	if (silence == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	r = snd_pcm_prepare(play);
+	if (r >= 0)
+		r = snd_pcm_writei(play, silence, period * PREFILL);
+	free(silence);
+	if (r < 0) {
+		aerror("snd_pcm_writei", r);
+		return -1;
+	}
+
+	r = snd_pcm_start(play);
+	if (r < 0) {
+		aerror("snd_pcm_start", r);
+		return -1;
+	}
+
+	for (pos = 0; pos < len; pos += period) {
+		size_t n;
+
+		n = len - pos < period ? len - pos : period;
+
+		f = snd_pcm_readi(rec, in + pos * channels, n);
+		if (f < 0 || (size_t)f < n) {
+			fprintf(stderr, "Capture xrun at %zu\n", pos);
+			return -1;
+		}
+
+		f = snd_pcm_writei(play, out + pos * channels, n);
+		if (f < 0 || (size_t)f < n) {
+			fprintf(stderr, "Playback xrun at %zu\n", pos);
+			return -1;
+		}
+	}
+
+	snd_pcm_drop(play);
+	snd_pcm_unlink(play);
+
+	*lead = period * PREFILL;
+
+	return 0;
+}
+
+/*
+ * Normalised cross-correlation of the chirp with the first channel of
+ * the recording, searching from the given position; return the best
+ * offset and its score (1.0 is a perfect match)
+ */
+
+static size_t find_chirp(const int16_t *in, unsigned int channels,
+		size_t from, size_t to, const float *chirp, size_t len,
+		double *score)
+{
+	size_t n, i, best = from;
+	double e_chirp = 0.0;
+
+	*score = 0.0;
+
+	for (i = 0; i < len; i++)
+		e_chirp += chirp[i] * chirp[i];
+
+	for (n = from; n + len <= to; n++) {
+		double sum = 0.0, e_in = 0.0, s;
+
+		for (i = 0; i < len; i++) {
+			double x = in[(n + i) * channels] / 32768.0;
+
+			sum += x * chirp[i];
+			e_in += x * x;
+		}
+
+		if (e_in == 0.0)
+			continue;
+
+		s = sum / sqrt(e_chirp * e_in);
+		if (s > *score) {
+			*score = s;
+			best = n;
+		}
+	}
+
+	return best;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: latency [<parameters>]\n"
+		"Measure audio latency between two sound devices\n");
+
+	fprintf(fd, "\nParameters:\n");
+	fprintf(fd, "  -p <dev>    Device to play into (default 'hw:Loopback,0,0')\n");
+	fprintf(fd, "  -c <dev>    Device to record from (default 'hw:Loopback,1,1')\n");
+	fprintf(fd, "  -r <rate>   Sample rate (default 48000Hz)\n");
+	fprintf(fd, "  -C <n>      Number of channels (default 2)\n");
+	fprintf(fd, "  -n <n>      Number of chirps (default 50)\n");
+	fprintf(fd, "  -i <ms>     Interval between chirps (default 500 milliseconds)\n");
+	fprintf(fd, "  -t <score>  Correlation needed to detect a chirp (default 0.5)\n");
+	fprintf(fd, "  -v <n>      Verbosity level (default 0)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	size_t len, clen, interval, lead, n, found = 0;
+	int16_t *out, *in;
+	float *chirp;
+	double *latency, threshold = 0.5;
+	snd_pcm_t *play, *rec;
+
+	/* command-line options */
+	const char *play_device = "hw:Loopback,0,0",
+		*rec_device = "hw:Loopback,1,1";
+	unsigned int rate = 48000,
+		channels = 2,
+		count = 50,
+		interval_ms = 500;
+
+	for (;;) {
+		int c;
+
+		c = getopt(argc, argv, "c:i:n:p:r:t:v:C:");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'c':
+			rec_device = optarg;
+			break;
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'p':
+			play_device = optarg;
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 't':
+			threshold = atof(optarg);
+			break;
+		case 'v':
+			verbose = atoi(optarg);
+			break;
+		case 'C':
+			channels = atoi(optarg);
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (count < 1 || channels < 1) {
+		usage(stderr);
+		return -1;
+	}
+
+	/* Each chirp must be found within its own interval, which
+	 * bounds the latency that can be measured */
+
+	clen = CHIRP * rate;
+	interval = (size_t)interval_ms * rate / 1000;
+	len = interval * (count + 1);
+	if (interval < clen * 2) {
+		fprintf(stderr, "Interval is too short\n");
+		return -1;
+	}
+
+	chirp = malloc(sizeof(*chirp) * clen);
+	out = calloc(len * channels, sizeof *out);
+	in = calloc(len * channels, sizeof *in);
+	latency = malloc(sizeof(*latency) * count);
+	if (chirp == NULL || out == NULL || in == NULL || latency == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	make_chirp(chirp, clen, rate);
+
+	for (n = 0; n < count; n++) {
+		size_t i;
+		unsigned int c;
+
+		for (i = 0; i < clen; i++) {
+			for (c = 0; c < channels; c++) {
+				out[((n * interval) + i) * channels + c] =
+					chirp[i] * 32767.0f;
+			}
+		}
+	}
+
+	play = open_device(play_device, SND_PCM_STREAM_PLAYBACK, rate, channels);
+	rec = open_device(rec_device, SND_PCM_STREAM_CAPTURE, rate, channels);
+	if (play == NULL || rec == NULL)
+		return -1;
+
+	if (play_and_record(play, rec, channels, out, in, len, &lead) == -1)
+		return -1;
+
+	for (n = 0; n < count; n++) {
+		size_t from, to, at;
+		double score, t;
+
+		from = n * interval + lead;
+		to = from + interval + clen;
+		if (to > len)
+			to = len;
+		at = find_chirp(in, channels, from, to, chirp, clen, &score);
+
+		t = (double)(at - from) / rate;
+		if (verbose > 0) {
+			printf("chirp %zu: %.2fms, score %.2f%s\n", n, t * 1e3,
+				score, score < threshold ? " (missing)" : "");
+		}
+
+		if (score >= threshold)
+			latency[found++] = t;
+	}
+
+	/* One line of results, for the benchmark script */
+
+	if (found == 0) {
+		printf("latency - - - - dropouts %zu/%u\n", count - found, count);
+	} else {
+		qsort(latency, found, sizeof *latency, cmp_double);
+		printf("latency %.2f %.2f %.2f %.2f dropouts %zu/%u\n",
+			latency[0] * 1e3,
+			latency[found / 2] * 1e3,
+			latency[(found * 99) / 100] * 1e3,
+			latency[found - 1] * 1e3,
+			count - found, count);
+	}
+
+	snd_pcm_close(play);
+	snd_pcm_close(rec);
+	free(chirp);
+	free(out);
+	free(in);
+	free(latency);
+
+	return found == count ? 0 : 1;
+}
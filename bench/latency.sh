@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# End-to-end latency of tx and rx over the loopback network, through
+# the snd-aloop driver (modprobe snd-aloop), for a matrix of settings.
+# Run from the build directory, usually as 'make bench'
+#
+# Loopback,0,0 -> Loopback,1,0 -> tx -> 127.0.0.1 -> rx ->
+#   Loopback,0,1 -> Loopback,1,1
+#
+
+set -e
+
+FRAMES=${FRAMES:-"240 480 960"}
+BUFFERS=${BUFFERS:-"10 20"}
+JITTERS=${JITTERS:-"10 20 40"}
+CHIRPS=${CHIRPS:-20}
+PORT=${PORT:-13500}
+SETTLE=${SETTLE:-2}
+
+if ! grep -q Loopback /proc/asound/cards 2>/dev/null; then
+	echo "snd-aloop is not loaded; skipping" >&2
+	exit 77
+fi
+
+cleanup() {
+	[ -n "$TX" ] && kill $TX 2>/dev/null || true
+	[ -n "$RX" ] && kill $RX 2>/dev/null || true
+	wait 2>/dev/null || true
+	TX= RX=
+}
+trap cleanup EXIT INT TERM
+
+printf "%-6s %-6s %-6s %8s %8s %8s %8s %s\n" \
+	frame buffer jitter min p50 p99 max dropouts
+
+FAIL=0
+
+for F in $FRAMES; do
+	for B in $BUFFERS; do
+		for J in $JITTERS; do
+			./rx -h 127.0.0.1 -p $PORT -d hw:Loopback,0,1 \
+				-m $B -j $J 2>/dev/null &
+			RX=$!
+			./tx -h 127.0.0.1 -p $PORT -d hw:Loopback,1,0 \
+				-m $B -f $F 2>/dev/null &
+			TX=$!
+			sleep $SETTLE
+
+			R=$(./latency -p hw:Loopback,0,0 -c hw:Loopback,1,1 \
+				-n $CHIRPS) || FAIL=1
+
+			set -- $R
+			printf "%-6s %-6s %-6s %8s %8s %8s %8s %s\n" \
+				$F $B $J $2 $3 $4 $5 $7
+
+			cleanup
+		done
+	done
+done
+
+exit $FAIL
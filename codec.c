@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+
+OpusEncoder* codec_encoder(unsigned int rate, unsigned int channels,
+		unsigned int loss, unsigned int complexity)
+{
+	int error;
+	OpusEncoder *e;
+
+	e = opus_encoder_create(rate, channels, OPUS_APPLICATION_AUDIO, &error);
+	if (e == NULL) {
+		fprintf(stderr, "opus_encoder_create: %s\n",
+			opus_strerror(error));
+		return NULL;
+	}
+
+	error = opus_encoder_ctl(e, OPUS_SET_COMPLEXITY(complexity));
+	if (error != OPUS_OK) {
+		fprintf(stderr, "OPUS_SET_COMPLEXITY: %s\n",
+			opus_strerror(error));
+		opus_encoder_destroy(e);
+		return NULL;
+	}
+
+	/* In-band FEC is only produced by the SILK layer, so it is
+	 * most effective at speech bitrates; see -R otherwise */
+
+	if (loss > 0) {
+		opus_encoder_ctl(e, OPUS_SET_INBAND_FEC(1));
+		opus_encoder_ctl(e, OPUS_SET_PACKET_LOSS_PERC(loss));
+	}
+
+	return e;
+}
+
+OpusDecoder* codec_decoder(unsigned int rate, unsigned int channels)
+{
+	int error;
+	OpusDecoder *d;
+
+	d = opus_decoder_create(rate, channels, &error);
+	if (d == NULL) {
+		fprintf(stderr, "opus_decoder_create: %s\n",
+			opus_strerror(error));
+		return NULL;
+	}
+
+	return d;
+}
+
+/*
+ * The bitrate is set by limiting the size of each packet
+ */
+
+size_t codec_bytes_per_frame(unsigned int kbps, unsigned int frame,
+		unsigned int rate)
+{
+	return (size_t)kbps * 1024 * frame / rate / 8;
+}
+
+/*
+ * Describe a layout of the given number of channels, from "pairs"
+ * (the default), "mono" or "<coupled>:<map>,<map>,..." with a stream
+ * channel (or 255 for none) for each channel
+ */
+
+int codec_layout(struct codec_layout *l, unsigned int channels,
+		const char *spec)
+{
+	unsigned int n, max = 0;
+	unsigned long v;
+	char *end;
+
+	if (channels < 1 || channels > CODEC_MAX_CHANNELS) {
+		fprintf(stderr, "Channels must be 1 to %d\n",
+			CODEC_MAX_CHANNELS);
+		return -1;
+	}
+
+	l->channels = channels;
+
+	if (spec == NULL || !strcmp(spec, "pairs")) {
+		l->coupled = channels / 2;
+		l->streams = l->coupled + channels % 2;
+		for (n = 0; n < channels; n++)
+			l->mapping[n] = n;
+		return 0;
+	}
+
+	if (!strcmp(spec, "mono")) {
+		l->coupled = 0;
+		l->streams = channels;
+		for (n = 0; n < channels; n++)
+			l->mapping[n] = n;
+		return 0;
+	}
+
+	l->coupled = strtoul(spec, &end, 10);
+	if (end == spec || *end != ':')
+		goto invalid;
+
+	for (n = 0; n < channels; n++) {
+		spec = end + 1;
+		v = strtoul(spec, &end, 10);
+		if (end == spec || v > 255)
+			goto invalid;
+		if (*end != (n + 1 < channels ? ',' : '\0'))
+			goto invalid;
+
+		l->mapping[n] = v;
+		if (v != 255 && v + 1 > max)
+			max = v + 1;
+	}
+
+	/* Enough streams to reach the highest channel mapped */
+
+	if (max <= 2 * l->coupled)
+		l->streams = l->coupled;
+	else
+		l->streams = max - l->coupled;
+
+	if (l->streams < 1 || l->streams + l->coupled > 255)
+		goto invalid;
+
+	return 0;
+
+invalid:
+	fprintf(stderr, "Invalid channel layout\n");
+	return -1;
+}
+
+OpusMSDecoder* codec_ms_decoder(unsigned int rate,
+		const struct codec_layout *l)
+{
+	int error;
+	OpusMSDecoder *d;
+
+	d = opus_multistream_decoder_create(rate, l->channels, l->streams,
+			l->coupled, l->mapping, &error);
+	if (d == NULL) {
+		fprintf(stderr, "opus_multistream_decoder_create: %s\n",
+			opus_strerror(error));
+		return NULL;
+	}
+
+	return d;
+}
+
+/*
+ * Largest packet which is DTX in every stream; all but the last are
+ * self-delimiting, which costs a byte each
+ */
+
+size_t codec_dtx_len(const struct codec_layout *l)
+{
+	return (l->streams - 1) * (CODEC_DTX_LEN + 1) + CODEC_DTX_LEN;
+}
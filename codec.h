@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <opus/opus.h>
+#include <opus/opus_multistream.h>
+
+/*
+ * Opus set up as the transmitter and receiver use it, shared with
+ * the benchmarks so that they measure the same thing
+ */
+
+#define CODEC_DTX_LEN 2 /* bytes; a packet this small is DTX */
+#define CODEC_MAX_CHANNELS 16
+
+/*
+ * How the channels of a link are carried as the Opus streams of a
+ * multistream packet: the first streams are coupled (stereo) pairs
+ * and the rest mono, and each channel is mapped onto a channel of
+ * one of them, as RFC 7845. One or two channels are a single stream,
+ * which is a plain Opus packet
+ */
+
+struct codec_layout {
+	unsigned int channels, streams, coupled;
+	unsigned char mapping[CODEC_MAX_CHANNELS];
+};
+
+OpusEncoder* codec_encoder(unsigned int rate, unsigned int channels,
+		unsigned int loss, unsigned int complexity);
+OpusDecoder* codec_decoder(unsigned int rate, unsigned int channels);
+
+int codec_layout(struct codec_layout *l, unsigned int channels,
+		const char *spec);
+OpusMSDecoder* codec_ms_decoder(unsigned int rate,
+		const struct codec_layout *l);
+size_t codec_dtx_len(const struct codec_layout *l);
+
+size_t codec_bytes_per_frame(unsigned int kbps, unsigned int frame,
+		unsigned int rate);
+
+#endif
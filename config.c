@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+/*
+ * The file has one stream per line, as whitespace-separated
+ * key=value pairs; anything not given is taken from the defaults:
+ *
+ *   device=hw:1 channels=2-3 addr=239.0.0.1 port=1350 bitrate=96
+ *
+ * Keys are device, channels, addr, port, bitrate, frame, loss,
+ * redundancy, complexity, dtx, adapt (the least bitrate to adapt
+ * down to), layout and threads (to encode the Opus streams of the
+ * layout). Blank lines and those starting with '#' are ignored
+ */
+
+static int parse_uint(const char *s, unsigned int *v)
+{
+	char *end;
+	unsigned long n;
+
+	errno = 0;
+	n = strtoul(s, &end, 10);
+	if (errno || end == s || *end != '\0')
+		return -1;
+
+	*v = n;
+	return 0;
+}
+
+static int parse_channels(const char *s, struct stream_config *c)
+{
+	char *end;
+	unsigned long first, last;
+
+	first = strtoul(s, &end, 10);
+	if (end == s)
+		return -1;
+
+	if (*end == '\0') {
+		last = first;
+	} else if (*end == '-') {
+		s = end + 1;
+		last = strtoul(s, &end, 10);
+		if (end == s || *end != '\0' || last < first)
+			return -1;
+	} else {
+		return -1;
+	}
+
+	c->first = first;
+	c->channels = last - first + 1;
+	return 0;
+}
+
+static int set(struct stream_config *c, const char *key, const char *value)
+{
+	char **str = NULL;
+
+	if (!strcmp(key, "device"))
+		str = &c->device;
+	else if (!strcmp(key, "addr"))
+		str = &c->addr;
+	else if (!strcmp(key, "channels"))
+		return parse_channels(value, c);
+	else if (!strcmp(key, "port"))
+		return parse_uint(value, &c->port);
+	else if (!strcmp(key, "bitrate"))
+		return parse_uint(value, &c->kbps);
+	else if (!strcmp(key, "frame"))
+		return parse_uint(value, &c->frame);
+	else if (!strcmp(key, "loss"))
+		return parse_uint(value, &c->loss);
+	else if (!strcmp(key, "redundancy"))
+		return parse_uint(value, &c->redundancy);
+	else if (!strcmp(key, "complexity"))
+		return parse_uint(value, &c->complexity);
+	else if (!strcmp(key, "dtx"))
+		return parse_uint(value, &c->dtx);
+	else if (!strcmp(key, "adapt"))
+		return parse_uint(value, &c->adapt);
+	else if (!strcmp(key, "layout"))
+		str = &c->layout;
+	else if (!strcmp(key, "threads"))
+		return parse_uint(value, &c->threads);
+	else
+		return -1;
+
+	free(*str);
+	*str = strdup(value);
+	if (*str == NULL)
+		return -1;
+
+	return 0;
+}
+
+static int parse_line(char *line, const struct stream_config *defaults,
+		struct stream_config *c)
+{
+	char *tok, *save;
+
+	/* Nothing is left pointing at the defaults, which are not ours
+	 * to free if a copy fails */
+
+	*c = *defaults;
+	c->device = NULL;
+	c->addr = NULL;
+	c->layout = NULL;
+
+	c->device = strdup(defaults->device);
+	c->addr = strdup(defaults->addr);
+	if (c->device == NULL || c->addr == NULL)
+		return -1;
+
+	if (defaults->layout != NULL) {
+		c->layout = strdup(defaults->layout);
+		if (c->layout == NULL)
+			return -1;
+	}
+
+	for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL;
+			tok = strtok_r(NULL, " \t\r\n", &save))
+	{
+		char *eq;
+
+		eq = strchr(tok, '=');
+		if (eq == NULL)
+			return -1;
+		*eq = '\0';
+
+		if (set(c, tok, eq + 1) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int is_blank(const char *s)
+{
+	while (isspace((unsigned char)*s))
+		s++;
+
+	return *s == '\0' || *s == '#';
+}
+
+int config_read(const char *path, const struct stream_config *defaults,
+		struct stream_config **streams, size_t *n)
+{
+	FILE *f;
+	char line[1024];
+	unsigned int lineno = 0;
+	struct stream_config *list = NULL;
+	size_t count = 0;
+
+	f = fopen(path, "r");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof line, f) != NULL) {
+		struct stream_config *grow;
+
+		lineno++;
+		if (is_blank(line))
+			continue;
+
+		grow = realloc(list, (count + 1) * sizeof *list);
+		if (grow == NULL) {
+			perror("realloc");
+			goto fail;
+		}
+		list = grow;
+
+		if (parse_line(line, defaults, &list[count]) == -1) {
+			fprintf(stderr, "%s:%u: Invalid stream definition\n",
+				path, lineno);
+			count++;
+			goto fail;
+		}
+		count++;
+	}
+
+	if (count == 0) {
+		fprintf(stderr, "%s: No streams defined\n", path);
+		goto fail;
+	}
+
+	fclose(f);
+	*streams = list;
+	*n = count;
+	return 0;
+
+fail:
+	fclose(f);
+	config_free(list, count);
+	return -1;
+}
+
+void config_free(struct stream_config *streams, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		free(streams[i].device);
+		free(streams[i].addr);
+		free(streams[i].layout);
+	}
+	free(streams);
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+/*
+ * One outgoing stream: a group of channels from a capture device,
+ * sent to a destination with its own encoder settings
+ */
+
+struct stream_config {
+	char *device;
+	unsigned int first, channels;
+	char *addr;
+	unsigned int port, kbps, frame, loss, redundancy, complexity, dtx,
+		adapt, threads;
+	char *layout; /* of channels as Opus streams, or NULL */
+};
+
+int config_read(const char *path, const struct stream_config *defaults,
+		struct stream_config **streams, size_t *n);
+void config_free(struct stream_config *streams, size_t n);
+
+#endif
@@ -8,10 +8,25 @@
 #define DEFAULT_PORT 1350
 #define DEFAULT_FRAME 960
 #define DEFAULT_JITTER 16
+#define DEFAULT_JITTER_PERCENTILE 95
+#define DEFAULT_JITTER_MARGIN 1
+#define DEFAULT_SOURCES 4
 
 #define DEFAULT_RATE 48000
 #define DEFAULT_CHANNELS 2
 #define DEFAULT_BITRATE 128
+#define DEFAULT_LOSS 0
+#define DEFAULT_COMPLEXITY 10
+#define DEFAULT_REDUNDANCY 0
+#define DEFAULT_PREROLL 100
+
+#define DEFAULT_QUEUE 8
+#define DEFAULT_CAPTURE_PRIORITY 80
+#define DEFAULT_ENCODE_PRIORITY 75
+#define DEFAULT_PLAYBACK_PRIORITY 80
+#define DEFAULT_RECEIVE_PRIORITY 85
+#define DEFAULT_TRX_PRIORITY 80
+#define DEFAULT_PROBE 250
 
 #define DEFAULT_VERBOSE 0
 
@@ -20,6 +20,8 @@
 #include <stdio.h>
 #include <alsa/asoundlib.h>
 
+#include "device.h"
+
 #define CHK(call, r) { \
 	if (r < 0) { \
 		aerror(call, r); \
@@ -35,11 +37,84 @@ void aerror(const char *msg, int r)
 	fputc('\n', stderr);
 }
 
-int set_alsa_hw(snd_pcm_t *pcm,
-		unsigned int rate, unsigned int channels,
-		unsigned int buffer)
+/*
+ * Formats we can convert, best first
+ */
+
+static const snd_pcm_format_t formats[] = {
+	SND_PCM_FORMAT_S32_LE,
+	SND_PCM_FORMAT_S24_3LE,
+	SND_PCM_FORMAT_FLOAT_LE,
+	SND_PCM_FORMAT_S16_LE,
+};
+
+static int set_format(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw,
+		snd_pcm_format_t *format)
+{
+	int r;
+	size_t n;
+
+	if (*format == SND_PCM_FORMAT_UNKNOWN) {
+		for (n = 0; n < sizeof formats / sizeof *formats; n++) {
+			if (snd_pcm_hw_params_test_format(pcm, hw,
+					formats[n]) == 0)
+			{
+				*format = formats[n];
+				break;
+			}
+		}
+
+		if (*format == SND_PCM_FORMAT_UNKNOWN) {
+			fprintf(stderr, "Device has no usable sample format\n");
+			return -1;
+		}
+	}
+
+	r = snd_pcm_hw_params_set_format(pcm, hw, *format);
+	CHK("snd_pcm_hw_params_set_format", r);
+
+	return 0;
+}
+
+/*
+ * Set the period to the given frame size, or the largest fraction of
+ * it the device can do, so that each wakeup is whole frames
+ */
+
+static int set_period(snd_pcm_t *pcm, snd_pcm_hw_params_t *hw,
+		snd_pcm_uframes_t frame)
+{
+	int r, dir;
+	snd_pcm_uframes_t n;
+
+	for (n = frame; n > 0 && frame % n == 0; n /= 2) {
+		if (snd_pcm_hw_params_test_period_size(pcm, hw, n, 0) == 0) {
+			r = snd_pcm_hw_params_set_period_size(pcm, hw, n, 0);
+			CHK("snd_pcm_hw_params_set_period_size", r);
+			return 0;
+		}
+	}
+
+	fprintf(stderr, "Device cannot use a period of %lu frames, "
+		"or a fraction of it\n", frame);
+
+	dir = 0;
+	r = snd_pcm_hw_params_set_period_size_near(pcm, hw, &frame, &dir);
+	CHK("snd_pcm_hw_params_set_period_size_near", r);
+
+	return 0;
+}
+
+/*
+ * Configure the device, in its native format unless one is given.
+ * If mmap is set, ask for direct access to the device's buffer, and
+ * clear it if that is not possible
+ */
+
+int set_alsa_hw(snd_pcm_t *pcm, struct alsa_config *c)
 {
 	int r, dir;
+	unsigned int buffer, periods;
 	snd_pcm_hw_params_t *hw;
 
 	snd_pcm_hw_params_alloca(&hw);
@@ -50,44 +125,112 @@ int set_alsa_hw(snd_pcm_t *pcm,
 	r = snd_pcm_hw_params_set_rate_resample(pcm, hw, 1);
 	CHK("snd_pcm_hw_params_set_rate_resample", r);
 
-	r = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_RW_INTERLEAVED);
-	CHK("snd_pcm_hw_params_set_access", r);
-
-	r = snd_pcm_hw_params_set_format(pcm, hw, SND_PCM_FORMAT_S16);
-	CHK("snd_pcm_hw_params_set_format", r);
-
-	r = snd_pcm_hw_params_set_rate(pcm, hw, rate, 0);
+	if (c->mmap) {
+		r = snd_pcm_hw_params_set_access(pcm, hw,
+				SND_PCM_ACCESS_MMAP_INTERLEAVED);
+		if (r < 0) {
+			fprintf(stderr, "Device does not support mmap access, "
+				"using read/write\n");
+			c->mmap = false;
+		}
+	}
+
+	if (!c->mmap) {
+		r = snd_pcm_hw_params_set_access(pcm, hw,
+				SND_PCM_ACCESS_RW_INTERLEAVED);
+		CHK("snd_pcm_hw_params_set_access", r);
+	}
+
+	if (set_format(pcm, hw, &c->format) == -1)
+		return -1;
+
+	r = snd_pcm_hw_params_set_rate(pcm, hw, c->rate, 0);
 	CHK("snd_pcm_hw_params_set_rate", r);
 
-	r = snd_pcm_hw_params_set_channels(pcm, hw, channels);
+	r = snd_pcm_hw_params_set_channels(pcm, hw, c->channels);
 	CHK("snd_pcm_hw_params_set_channels", r);
 
-	dir = -1;
-	r = snd_pcm_hw_params_set_buffer_time_near(pcm, hw, &buffer, &dir);
-	CHK("snd_pcm_hw_params_set_buffer_time_near", r);
+	if (c->period == 0) {
+		buffer = c->buffer;
+		dir = -1;
+		r = snd_pcm_hw_params_set_buffer_time_near(pcm, hw,
+				&buffer, &dir);
+		CHK("snd_pcm_hw_params_set_buffer_time_near", r);
+
+	} else {
+		snd_pcm_uframes_t period;
+
+		if (set_period(pcm, hw, c->period) == -1)
+			return -1;
+
+		r = snd_pcm_hw_params_get_period_size(hw, &period, &dir);
+		CHK("snd_pcm_hw_params_get_period_size", r);
+
+		/* Enough whole periods for the buffer time, and at
+		 * least two */
+
+		periods = ((unsigned long long)c->buffer * c->rate / 1000000
+			+ period - 1) / period;
+		if (periods < 2)
+			periods = 2;
+
+		dir = 0;
+		r = snd_pcm_hw_params_set_periods_near(pcm, hw, &periods, &dir);
+		CHK("snd_pcm_hw_params_set_periods_near", r);
+	}
 
 	r = snd_pcm_hw_params(pcm, hw);
 	CHK("hw_params", r);
 
+	/* Report what the device is really doing */
+
+	r = snd_pcm_hw_params_get_rate(hw, &c->rate, &dir);
+	CHK("snd_pcm_hw_params_get_rate", r);
+	r = snd_pcm_hw_params_get_period_size(hw, &c->period, &dir);
+	CHK("snd_pcm_hw_params_get_period_size", r);
+	r = snd_pcm_hw_params_get_periods(hw, &c->periods, &dir);
+	CHK("snd_pcm_hw_params_get_periods", r);
+	r = snd_pcm_hw_params_get_buffer_size(hw, &c->buffer_size);
+	CHK("snd_pcm_hw_params_get_buffer_size", r);
+
+	c->buffer = (unsigned long long)c->buffer_size * 1000000 / c->rate;
+
 	return 0;
 }
 
+void print_alsa_config(const char *device, const struct alsa_config *c)
+{
+	fprintf(stderr, "%s: %s, %uHz, %u channels, %s access, "
+		"period %lu frames (%.2fms) x %u = buffer %lu frames "
+		"(%.2fms)\n",
+		device, snd_pcm_format_name(c->format), c->rate, c->channels,
+		c->mmap ? "mmap" : "read/write",
+		c->period, c->period * 1000.0 / c->rate, c->periods,
+		c->buffer_size, c->buffer / 1000.0);
+}
+
 int set_alsa_sw(snd_pcm_t *pcm)
 {
 	int r;
 	snd_pcm_sw_params_t *sw;
-	snd_pcm_uframes_t boundary;
 
 	snd_pcm_sw_params_alloca(&sw);
 
 	r = snd_pcm_sw_params_current(pcm, sw);
 	CHK("snd_pcm_sw_params_current", r);
 
-	r = snd_pcm_sw_params_get_boundary(sw, &boundary);
-	CHK("snd_pcm_sw_params_get_boundary", r);
+	/* The stop threshold is left at the buffer size, so that an xrun
+	 * stops the device and is reported, rather than being played
+	 * or recorded over unnoticed */
+
+	/* Monotonic timestamps, to find when audio was captured */
+
+	r = snd_pcm_sw_params_set_tstamp_mode(pcm, sw, SND_PCM_TSTAMP_ENABLE);
+	CHK("snd_pcm_sw_params_set_tstamp_mode", r);
 
-	r = snd_pcm_sw_params_set_stop_threshold(pcm, sw, boundary);
-	CHK("snd_pcm_sw_params_set_stop_threshold", r);
+	r = snd_pcm_sw_params_set_tstamp_type(pcm, sw,
+			SND_PCM_TSTAMP_TYPE_MONOTONIC);
+	CHK("snd_pcm_sw_params_set_tstamp_type", r);
 
 	r = snd_pcm_sw_params(pcm, sw);
 	CHK("snd_pcm_sw_params", r);
@@ -20,10 +20,27 @@
 #ifndef DEVICE_H
 #define DEVICE_H
 
+#include <stdbool.h>
+
+/*
+ * What is asked of a device; format, mmap and the sizes are updated
+ * with what it actually does
+ */
+
+struct alsa_config {
+	unsigned int rate, channels;
+	unsigned int buffer; /* microseconds */
+	snd_pcm_uframes_t period; /* frames, or 0 for any */
+	snd_pcm_format_t format; /* or SND_PCM_FORMAT_UNKNOWN for native */
+	bool mmap;
+
+	unsigned int periods;
+	snd_pcm_uframes_t buffer_size;
+};
+
 void aerror(const char *msg, int r);
-int set_alsa_hw(snd_pcm_t *pcm,
-		unsigned int rate, unsigned int channels,
-		unsigned int buffer);
+int set_alsa_hw(snd_pcm_t *pcm, struct alsa_config *c);
 int set_alsa_sw(snd_pcm_t *pcm);
+void print_alsa_config(const char *device, const struct alsa_config *c);
 
 #endif
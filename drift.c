@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include "drift.h"
+
+#define SMOOTHING 1.0 /* seconds */
+#define DEVICE_SMOOTHING 60.0
+#define KP 0.02 /* per second of error */
+#define KI 0.0002
+#define LIMIT 0.001 /* largest correction, 1000ppm */
+
+void drift_init(struct drift *d)
+{
+	d->latency = 0.0;
+	d->device = 0.0;
+	d->integral = 0.0;
+	d->ratio = 1.0;
+	d->primed = 0;
+}
+
+static double clamp(double x, double limit)
+{
+	if (x > limit)
+		return limit;
+	if (x < -limit)
+		return -limit;
+	return x;
+}
+
+/*
+ * Feed the audio buffered ahead of the decoder (from RTP timestamps)
+ * and the sound card delay after playing a frame of the given
+ * duration. Return the ratio of input to output samples.
+ *
+ * The sound card delay is held near full by blocking writes, so only
+ * its short-term deviation counts towards the error; any long-term
+ * drift shows up in the buffered audio
+ */
+
+double drift_update(struct drift *d, double buffered, double device,
+		double target, double elapsed)
+{
+	double latency, error;
+
+	latency = buffered + device;
+
+	if (!d->primed) {
+		d->latency = latency;
+		d->device = device;
+		d->primed = 1;
+	}
+
+	d->latency += (latency - d->latency) * elapsed / SMOOTHING;
+	d->device += (device - d->device) * elapsed / DEVICE_SMOOTHING;
+	error = d->latency - (target + d->device);
+
+	/* The integral term tracks the clock ratio itself; the
+	 * proportional term pulls the latency back to the target */
+
+	d->integral = clamp(d->integral + KI * error * elapsed, LIMIT);
+	d->ratio = 1.0 + clamp(KP * error + d->integral, LIMIT);
+
+	return d->ratio;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef DRIFT_H
+#define DRIFT_H
+
+/*
+ * Estimate the ratio between the sender's clock and our sound card
+ * from the end-to-end buffering, and steer a resampler to hold the
+ * latency at its target
+ */
+
+struct drift {
+	double latency, device; /* smoothed, seconds */
+	double integral, ratio;
+	int primed;
+};
+
+void drift_init(struct drift *d);
+double drift_update(struct drift *d, double buffered, double device,
+		double target, double elapsed);
+
+#endif
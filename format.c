@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "format.h"
+
+#define S16_SCALE 32768.0f
+#define S32_SCALE 2147483648.0f
+#define S32_MAX 2147483520.0f /* largest float below 2^31 */
+
+/*
+ * Format by name, if it is one which can be converted
+ */
+
+snd_pcm_format_t format_parse(const char *name)
+{
+	snd_pcm_format_t f;
+
+	f = snd_pcm_format_value(name);
+	switch (f) {
+	case SND_PCM_FORMAT_S16_LE:
+	case SND_PCM_FORMAT_S24_3LE:
+	case SND_PCM_FORMAT_S32_LE:
+	case SND_PCM_FORMAT_FLOAT_LE:
+		return f;
+	default:
+		fprintf(stderr, "Unsupported sample format '%s'\n", name);
+		return SND_PCM_FORMAT_UNKNOWN;
+	}
+}
+
+size_t format_bytes(snd_pcm_format_t format)
+{
+	return snd_pcm_format_physical_width(format) / 8;
+}
+
+/*
+ * Kernels over contiguous samples
+ */
+
+static void s16_to_float(float *out, const int16_t *in, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	__m128 k = _mm_set1_ps(1.0f / S16_SCALE);
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i x, lo, hi;
+
+		x = _mm_loadu_si128((const __m128i*)(in + i));
+		lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+		hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), k));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), k));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 8 <= n; i += 8) {
+		int16x8_t x;
+
+		x = vld1q_s16(in + i);
+		vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(
+			vmovl_s16(vget_low_s16(x))), 1.0f / S16_SCALE));
+		vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_s32(
+			vmovl_s16(vget_high_s16(x))), 1.0f / S16_SCALE));
+	}
+#endif
+
+	for (; i < n; i++)
+		out[i] = in[i] / S16_SCALE;
+}
+
+static void s32_to_float(float *out, const int32_t *in, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	__m128 k = _mm_set1_ps(1.0f / S32_SCALE);
+
+	for (; i + 4 <= n; i += 4) {
+		__m128i x;
+
+		x = _mm_loadu_si128((const __m128i*)(in + i));
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(x), k));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 4 <= n; i += 4) {
+		vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(in + i)),
+			1.0f / S32_SCALE));
+	}
+#endif
+
+	for (; i < n; i++)
+		out[i] = in[i] / S32_SCALE;
+}
+
+static float s24_3_to_float(const uint8_t *in)
+{
+	int32_t x;
+
+	x = (int32_t)((uint32_t)in[0] << 8 | (uint32_t)in[1] << 16
+		| (uint32_t)in[2] << 24);
+
+	return x / S32_SCALE;
+}
+
+static void float_to_s16(int16_t *out, const float *in, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	__m128 k = _mm_set1_ps(S16_SCALE),
+		lo = _mm_set1_ps(-1.0f), hi = _mm_set1_ps(1.0f);
+
+	/* Saturation happens in the pack; the clamp only keeps the
+	 * conversion to int32 in range */
+
+	for (; i + 8 <= n; i += 8) {
+		__m128 a, b;
+
+		a = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i), lo), hi);
+		b = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i + 4), lo), hi);
+		_mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(
+			_mm_cvttps_epi32(_mm_mul_ps(a, k)),
+			_mm_cvttps_epi32(_mm_mul_ps(b, k))));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 8 <= n; i += 8) {
+		int32x4_t a, b;
+
+		a = vcvtq_s32_f32(vmulq_n_f32(vld1q_f32(in + i), S16_SCALE));
+		b = vcvtq_s32_f32(vmulq_n_f32(vld1q_f32(in + i + 4), S16_SCALE));
+		vst1q_s16(out + i, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+	}
+#endif
+
+	for (; i < n; i++) {
+		float x;
+
+		x = in[i] * S16_SCALE;
+		if (x > 32767.0f)
+			x = 32767.0f;
+		if (x < -32768.0f)
+			x = -32768.0f;
+		out[i] = (int16_t)x;
+	}
+}
+
+static void float_to_s32(int32_t *out, const float *in, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	__m128 k = _mm_set1_ps(S32_SCALE),
+		lo = _mm_set1_ps(-S32_SCALE), hi = _mm_set1_ps(S32_MAX);
+
+	for (; i + 4 <= n; i += 4) {
+		__m128 x;
+
+		x = _mm_mul_ps(_mm_loadu_ps(in + i), k);
+		x = _mm_min_ps(_mm_max_ps(x, lo), hi);
+		_mm_storeu_si128((__m128i*)(out + i), _mm_cvttps_epi32(x));
+	}
+#elif defined(__ARM_NEON)
+	/* Conversion saturates */
+
+	for (; i + 4 <= n; i += 4) {
+		vst1q_s32(out + i, vcvtq_s32_f32(vmulq_n_f32(vld1q_f32(in + i),
+			S32_SCALE)));
+	}
+#endif
+
+	for (; i < n; i++) {
+		float x;
+
+		x = in[i] * S32_SCALE;
+		if (x > S32_MAX)
+			x = S32_MAX;
+		if (x < -S32_SCALE)
+			x = -S32_SCALE;
+		out[i] = (int32_t)x;
+	}
+}
+
+static void float_to_s24_3(uint8_t *out, float x)
+{
+	int32_t v;
+
+	x *= 8388608.0f;
+	if (x > 8388607.0f)
+		x = 8388607.0f;
+	if (x < -8388608.0f)
+		x = -8388608.0f;
+	v = (int32_t)x;
+
+	out[0] = v;
+	out[1] = v >> 8;
+	out[2] = v >> 16;
+}
+
+/*
+ * Convert a group of channels from interleaved device samples; when
+ * all the channels are taken this is a straight vector conversion
+ */
+
+void format_extract(float *out, const void *in, snd_pcm_format_t format,
+		unsigned int in_channels, unsigned int first,
+		unsigned int channels, size_t frames)
+{
+	size_t n, width;
+	unsigned int c;
+	const uint8_t *p;
+
+	if (channels == in_channels) {
+		switch (format) {
+		case SND_PCM_FORMAT_S16_LE:
+			s16_to_float(out, in, frames * channels);
+			return;
+		case SND_PCM_FORMAT_S32_LE:
+			s32_to_float(out, in, frames * channels);
+			return;
+		case SND_PCM_FORMAT_FLOAT_LE:
+			memcpy(out, in, sizeof(*out) * frames * channels);
+			return;
+		default:
+			break;
+		}
+	}
+
+	width = format_bytes(format);
+	p = (const uint8_t*)in + first * width;
+
+	for (n = 0; n < frames; n++) {
+		switch (format) {
+		case SND_PCM_FORMAT_S16_LE:
+			s16_to_float(out, (const int16_t*)p, channels);
+			break;
+		case SND_PCM_FORMAT_S32_LE:
+			s32_to_float(out, (const int32_t*)p, channels);
+			break;
+		case SND_PCM_FORMAT_FLOAT_LE:
+			memcpy(out, p, sizeof(*out) * channels);
+			break;
+		default: /* S24_3LE */
+			for (c = 0; c < channels; c++)
+				out[c] = s24_3_to_float(p + c * 3);
+			break;
+		}
+
+		out += channels;
+		p += in_channels * width;
+	}
+}
+
+/*
+ * Convert samples for the device, clipping at full scale
+ */
+
+void format_store(void *out, snd_pcm_format_t format, const float *in,
+		size_t n)
+{
+	size_t i;
+
+	switch (format) {
+	case SND_PCM_FORMAT_S16_LE:
+		float_to_s16(out, in, n);
+		break;
+	case SND_PCM_FORMAT_S32_LE:
+		float_to_s32(out, in, n);
+		break;
+	case SND_PCM_FORMAT_FLOAT_LE:
+		memcpy(out, in, sizeof(*in) * n);
+		break;
+	default: /* S24_3LE */
+		for (i = 0; i < n; i++)
+			float_to_s24_3((uint8_t*)out + i * 3, in[i]);
+		break;
+	}
+}
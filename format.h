@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include <stddef.h>
+#include <alsa/asoundlib.h>
+
+/*
+ * Conversion between the sound device's native sample format and the
+ * floating point used by the codec and mixer
+ */
+
+snd_pcm_format_t format_parse(const char *name);
+size_t format_bytes(snd_pcm_format_t format);
+
+void format_extract(float *out, const void *in, snd_pcm_format_t format,
+		unsigned int in_channels, unsigned int first,
+		unsigned int channels, size_t frames);
+void format_store(void *out, snd_pcm_format_t format, const float *in,
+		size_t n);
+
+#endif
@@ -0,0 +1,359 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "impair.h"
+
+#define DEFAULT_HOLD 0.03 /* seconds a reordered packet is held back */
+
+/*
+ * The spec is comma-separated key=value pairs, eg.
+ *
+ *   loss=2,burst=4,delay=20,jitter=5,dist=pareto,reorder=1,dup=1
+ *
+ * loss is the mean percentage lost, in bad spells of burst packets
+ * on average; good and bad are the percentage lost in and out of a
+ * spell (default 0 and 100). delay is added to every packet, and
+ * jitter (a mean) to each one in order; dist is uniform, exponential
+ * (the default) or pareto. reorder is the percentage held back by
+ * hold, for others to overtake; dup the percentage sent twice. Times
+ * are in milliseconds. seed picks another run
+ */
+
+static int set(struct impair_config *c, const char *key, const char *value)
+{
+	char *end;
+	double v;
+
+	if (!strcmp(key, "dist")) {
+		if (!strcmp(value, "uniform"))
+			c->dist = IMPAIR_UNIFORM;
+		else if (!strcmp(value, "exponential"))
+			c->dist = IMPAIR_EXPONENTIAL;
+		else if (!strcmp(value, "pareto"))
+			c->dist = IMPAIR_PARETO;
+		else
+			return -1;
+		return 0;
+	}
+
+	v = strtod(value, &end);
+	if (end == value || *end != '\0' || v < 0.0)
+		return -1;
+
+	if (!strcmp(key, "loss"))
+		c->loss = v / 100;
+	else if (!strcmp(key, "burst"))
+		c->burst = v;
+	else if (!strcmp(key, "good"))
+		c->good = v / 100;
+	else if (!strcmp(key, "bad"))
+		c->bad = v / 100;
+	else if (!strcmp(key, "delay"))
+		c->delay = v / 1000;
+	else if (!strcmp(key, "jitter"))
+		c->jitter = v / 1000;
+	else if (!strcmp(key, "hold"))
+		c->hold = v / 1000;
+	else if (!strcmp(key, "reorder"))
+		c->reorder = v / 100;
+	else if (!strcmp(key, "dup"))
+		c->duplicate = v / 100;
+	else if (!strcmp(key, "seed"))
+		c->seed = v;
+	else
+		return -1;
+
+	return 0;
+}
+
+int impair_parse(struct impair_config *c, const char *spec)
+{
+	char *copy, *tok, *save, *eq;
+
+	c->loss = 0.0;
+	c->burst = 1.0;
+	c->good = 0.0;
+	c->bad = 1.0;
+	c->delay = 0.0;
+	c->jitter = 0.0;
+	c->hold = DEFAULT_HOLD;
+	c->dist = IMPAIR_EXPONENTIAL;
+	c->reorder = 0.0;
+	c->duplicate = 0.0;
+	c->seed = 1;
+
+	copy = strdup(spec);
+	if (copy == NULL) {
+		perror("strdup");
+		return -1;
+	}
+
+	for (tok = strtok_r(copy, ",", &save); tok != NULL;
+			tok = strtok_r(NULL, ",", &save))
+	{
+		eq = strchr(tok, '=');
+		if (eq == NULL)
+			goto fail;
+		*eq = '\0';
+
+		if (set(c, tok, eq + 1) == -1)
+			goto fail;
+	}
+
+	free(copy);
+
+	if (c->burst < 1.0 || c->bad > 1.0 || c->loss < c->good
+		|| c->loss > c->bad || c->reorder > 1.0 || c->duplicate > 1.0)
+	{
+		fprintf(stderr, "Impairment '%s' is not possible\n", spec);
+		return -1;
+	}
+
+	return 0;
+
+fail:
+	fprintf(stderr, "Invalid impairment '%s'\n", spec);
+	free(copy);
+	return -1;
+}
+
+/*
+ * Prepare to hold up to the given number of items of slot_size
+ * bytes each
+ */
+
+int impair_init(struct impair *m, const struct impair_config *c,
+		size_t slots, size_t slot_size)
+{
+	double bad;
+
+	m->c = *c;
+
+	/* Spells last burst packets on average, and are as common as
+	 * they need to be to lose the given share overall */
+
+	bad = c->bad > c->good ? (c->loss - c->good) / (c->bad - c->good) : 0.0;
+	m->r = 1.0 / c->burst;
+	m->p = bad < 1.0 ? bad * m->r / (1.0 - bad) : 1.0;
+	if (m->p > 1.0)
+		m->p = 1.0;
+
+	m->spell = false;
+	m->rand = c->seed;
+	m->seq = 0;
+	m->last = 0.0;
+
+	m->slots = slots;
+	m->slot_size = slot_size;
+	m->held = 0;
+	m->slot = calloc(slots, sizeof *m->slot);
+	m->buf = calloc(slots, slot_size);
+	if (m->slot == NULL || m->buf == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	atomic_init(&m->lost, 0);
+	atomic_init(&m->duplicated, 0);
+	atomic_init(&m->reordered, 0);
+	atomic_init(&m->overflows, 0);
+
+	return 0;
+}
+
+void impair_clear(struct impair *m)
+{
+	free(m->slot);
+	free(m->buf);
+}
+
+/*
+ * SplitMix64, which is good enough and has no state beyond a counter
+ */
+
+static double uniform(struct impair *m)
+{
+	uint64_t z;
+
+	z = (m->rand += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	z ^= z >> 31;
+
+	return (z >> 11) * 0x1p-53; /* [0, 1) */
+}
+
+static bool lose(struct impair *m)
+{
+	if (m->spell) {
+		if (uniform(m) < m->r)
+			m->spell = false;
+	} else {
+		if (uniform(m) < m->p)
+			m->spell = true;
+	}
+
+	return uniform(m) < (m->spell ? m->c.bad : m->c.good);
+}
+
+/*
+ * Delay on top of the fixed one, with a mean of the jitter
+ */
+
+static double jitter(struct impair *m)
+{
+	double j = m->c.jitter;
+
+	if (j == 0.0)
+		return 0.0;
+
+	switch (m->c.dist) {
+	case IMPAIR_UNIFORM:
+		return 2.0 * j * uniform(m);
+	case IMPAIR_PARETO:
+		/* Lomax, of shape 3: a long tail, but a finite variance */
+		return 2.0 * j * (pow(1.0 - uniform(m), -1.0 / 3) - 1.0);
+	default:
+		return -j * log(1.0 - uniform(m));
+	}
+}
+
+static void hold(struct impair *m, const void *item, double due)
+{
+	size_t n;
+
+	for (n = 0; n < m->slots; n++) {
+		if (!m->slot[n].busy)
+			break;
+	}
+
+	if (n == m->slots) {
+		atomic_fetch_add_explicit(&m->overflows, 1,
+				memory_order_relaxed);
+		return;
+	}
+
+	m->slot[n].busy = true;
+	m->slot[n].due = due;
+	m->slot[n].seq = m->seq++;
+	memcpy(m->buf + n * m->slot_size, item, m->slot_size);
+	m->held++;
+}
+
+/*
+ * Take an item arriving at time t; it is copied, so the caller's can
+ * be reused at once
+ */
+
+void impair_put(struct impair *m, double t, const void *item)
+{
+	unsigned int copies = 1, n;
+	double due;
+
+	if (lose(m)) {
+		atomic_fetch_add_explicit(&m->lost, 1, memory_order_relaxed);
+		return;
+	}
+
+	if (uniform(m) < m->c.duplicate) {
+		atomic_fetch_add_explicit(&m->duplicated, 1,
+				memory_order_relaxed);
+		copies = 2;
+	}
+
+	for (n = 0; n < copies; n++) {
+		due = t + m->c.delay;
+
+		/* Jitter alone keeps packets in order; a reordered
+		 * packet is held back outside of that order */
+
+		if (uniform(m) < m->c.reorder) {
+			atomic_fetch_add_explicit(&m->reordered, 1,
+					memory_order_relaxed);
+			due += m->c.hold;
+		} else {
+			due += jitter(m);
+			if (due < m->last)
+				due = m->last;
+			m->last = due;
+		}
+
+		hold(m, item, due);
+	}
+}
+
+static struct impair_slot* earliest(struct impair *m)
+{
+	size_t n;
+	struct impair_slot *s, *first = NULL;
+
+	for (n = 0; n < m->slots; n++) {
+		s = &m->slot[n];
+		if (!s->busy)
+			continue;
+
+		if (first == NULL || s->due < first->due
+			|| (s->due == first->due && s->seq < first->seq))
+		{
+			first = s;
+		}
+	}
+
+	return first;
+}
+
+/*
+ * Return the next item due by time t, and when it was due; or NULL.
+ * It remains valid until the next call to impair_put()
+ */
+
+void* impair_get(struct impair *m, double t, double *due)
+{
+	struct impair_slot *s;
+
+	if (m->held == 0)
+		return NULL;
+
+	s = earliest(m);
+	if (s->due > t)
+		return NULL;
+
+	s->busy = false;
+	m->held--;
+	*due = s->due;
+
+	return m->buf + (s - m->slot) * m->slot_size;
+}
+
+/*
+ * When the next item is due, or negative if none is held
+ */
+
+double impair_next(struct impair *m)
+{
+	if (m->held == 0)
+		return -1.0;
+
+	return earliest(m)->due;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A bad network on demand, for testing: packets are lost in bursts,
+ * delayed, reordered and duplicated. Every choice comes from a seeded
+ * generator, so that a run can be repeated exactly
+ */
+
+enum impair_dist {
+	IMPAIR_UNIFORM,
+	IMPAIR_EXPONENTIAL,
+	IMPAIR_PARETO
+};
+
+struct impair_config {
+	double loss, burst, good, bad; /* Gilbert-Elliott loss */
+	double delay, jitter, hold; /* seconds */
+	enum impair_dist dist;
+	double reorder, duplicate;
+	uint64_t seed;
+};
+
+/*
+ * Packets are held in slots of a fixed size until they are due, so
+ * nothing is allocated once running
+ */
+
+struct impair_slot {
+	bool busy;
+	double due;
+	uint64_t seq;
+};
+
+struct impair {
+	struct impair_config c;
+	double p, r; /* chance of a bad spell starting, and ending */
+	bool spell;
+	uint64_t rand, seq;
+	double last; /* when the latest packet in order is due */
+
+	size_t slots, slot_size, held;
+	struct impair_slot *slot;
+	unsigned char *buf;
+
+	atomic_ulong lost, duplicated, reordered, overflows;
+};
+
+int impair_parse(struct impair_config *c, const char *spec);
+
+int impair_init(struct impair *m, const struct impair_config *c,
+		size_t slots, size_t slot_size);
+void impair_clear(struct impair *m);
+
+void impair_put(struct impair *m, double t, const void *item);
+void* impair_get(struct impair *m, double t, double *due);
+double impair_next(struct impair *m);
+
+#endif
@@ -0,0 +1,446 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jitter.h"
+
+#define MASK (JITTER_SLOTS - 1)
+
+#define UPDATE_INTERVAL 16 /* packets between estimates */
+#define LEVEL_FILTER 16 /* frames */
+#define STARVE_LIMIT 0.5 /* seconds without audio before rebuffering */
+#define FORCE_DROP 4 /* frames of excess before dropping audible audio */
+
+int jitter_init(struct jitter *jb, unsigned int ts_rate,
+		double initial, double percentile, double margin)
+{
+	jb->slot = calloc(JITTER_SLOTS, sizeof *jb->slot);
+	if (jb->slot == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	jb->ts_rate = ts_rate;
+	jb->initial = initial;
+	jb->dtx_len = JITTER_DTX_LEN;
+	jb->percentile = percentile;
+	jb->margin = margin;
+
+	jitter_reset(jb);
+
+	return 0;
+}
+
+void jitter_clear(struct jitter *jb)
+{
+	free(jb->slot);
+}
+
+/*
+ * Forget the stream entirely, ready for a new one
+ */
+
+void jitter_reset(struct jitter *jb)
+{
+	jb->started = false;
+	jb->playing = false;
+	jb->dtx = false;
+	jb->frame_ts = jb->ts_rate / 400; /* smallest Opus frame, until known */
+	jb->ndelay = 0;
+	jb->pos = 0;
+	jb->since_update = 0;
+	jb->starve = 0;
+	jb->target = jb->initial;
+	jb->level = 0.0;
+
+	memset(&jb->stats, 0, sizeof jb->stats);
+	atomic_store(&jb->stats.target_us, jb->initial * 1e6);
+}
+
+static double frame_time(const struct jitter *jb)
+{
+	return (double)jb->frame_ts / jb->ts_rate;
+}
+
+/*
+ * Effective playout delay target, in seconds; never less than one
+ * frame
+ */
+
+double jitter_target(const struct jitter *jb)
+{
+	double frame;
+
+	frame = frame_time(jb);
+	return jb->target > frame ? jb->target : frame;
+}
+
+/*
+ * Depth of the buffer in frames, counting any gaps
+ */
+
+static int depth(const struct jitter *jb)
+{
+	return (int16_t)(jb->last_seq - jb->next_seq) + 1;
+}
+
+static void reset(struct jitter *jb, uint16_t seq, uint32_t ts)
+{
+	unsigned int n;
+
+	for (n = 0; n < JITTER_SLOTS; n++)
+		jb->slot[n].used = false;
+
+	jb->started = true;
+	jb->playing = false;
+	jb->dtx = false;
+	jb->last_dtx = false;
+	jb->next_seq = seq;
+	jb->last_seq = seq;
+	jb->last_ts = ts;
+	jb->ref_ts = ts;
+	jb->ndelay = 0;
+	jb->pos = 0;
+	jb->starve = 0;
+	jb->level = 0.0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	const double *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/*
+ * Derive the target playout delay from the spread of transit times
+ * over the recent window
+ */
+
+static void estimate(struct jitter *jb)
+{
+	size_t n;
+	double sorted[JITTER_WINDOW], jitter, target, max;
+
+	memcpy(sorted, jb->delay, jb->ndelay * sizeof *sorted);
+	qsort(sorted, jb->ndelay, sizeof *sorted, cmp_double);
+
+	n = (size_t)(jb->percentile / 100.0 * (jb->ndelay - 1) + 0.5);
+	if (n > jb->ndelay - 1)
+		n = jb->ndelay - 1;
+	jitter = sorted[n] - sorted[0];
+
+	target = jitter + jb->margin;
+	max = (JITTER_SLOTS / 2) * frame_time(jb);
+	if (target > max)
+		target = max;
+
+	jb->target = target;
+
+	atomic_store_explicit(&jb->stats.jitter_us, jitter * 1e6,
+			memory_order_relaxed);
+	atomic_store_explicit(&jb->stats.target_us, target * 1e6,
+			memory_order_relaxed);
+}
+
+static void measure(struct jitter *jb, uint32_t ts, double arrival)
+{
+	int32_t rel;
+
+	/* Rebase the reference before the timestamp difference can
+	 * overflow; the estimate depends only on relative delays */
+
+	rel = (int32_t)(ts - jb->ref_ts);
+	if (rel > INT32_MAX / 2 || rel < -INT32_MAX / 2) {
+		size_t n;
+		double shift;
+
+		shift = (double)rel / jb->ts_rate;
+		for (n = 0; n < jb->ndelay; n++)
+			jb->delay[n] += shift;
+
+		jb->ref_ts = ts;
+		rel = 0;
+	}
+
+	jb->delay[jb->pos] = arrival - (double)rel / jb->ts_rate;
+	jb->pos = (jb->pos + 1) % JITTER_WINDOW;
+	if (jb->ndelay < JITTER_WINDOW)
+		jb->ndelay++;
+
+	if (++jb->since_update >= UPDATE_INTERVAL) {
+		jb->since_update = 0;
+		estimate(jb);
+	}
+}
+
+/*
+ * Insert a packet which arrived at the given time (in seconds, any
+ * epoch)
+ */
+
+void jitter_put(struct jitter *jb, const void *data, size_t len,
+		uint16_t seq, uint32_t ts, bool marker, double arrival)
+{
+	int16_t d;
+	struct jitter_packet *p;
+
+	if (len > JITTER_MAX_PACKET)
+		return;
+
+	atomic_fetch_add_explicit(&jb->stats.received, 1,
+			memory_order_relaxed);
+
+	if (!jb->started)
+		reset(jb, seq, ts);
+
+	d = seq - jb->next_seq;
+	if (d < 0) {
+		atomic_fetch_add_explicit(&jb->stats.late, 1,
+				memory_order_relaxed);
+		return;
+	}
+
+	/* Too far ahead to fit; the sender has most likely restarted */
+
+	if (d >= JITTER_SLOTS) {
+		atomic_fetch_add_explicit(&jb->stats.resets, 1,
+				memory_order_relaxed);
+		reset(jb, seq, ts);
+	}
+
+	p = &jb->slot[seq & MASK];
+	if (p->used && p->seq == seq) {
+		atomic_fetch_add_explicit(&jb->stats.duplicate, 1,
+				memory_order_relaxed);
+		return;
+	}
+
+	p->used = true;
+	p->seq = seq;
+	p->ts = ts;
+	p->len = len;
+	memcpy(p->data, data, len);
+
+	/* The timestamp runs on over a DTX gap but the sequence does
+	 * not, so the step to a talkspurt is not the frame size */
+
+	d = seq - jb->last_seq;
+	if (d > 0) {
+		uint32_t step;
+
+		step = (ts - jb->last_ts) / d;
+		if (!marker && !jb->last_dtx
+			&& step > 0 && step <= jb->ts_rate / 10)
+		{
+			jb->frame_ts = step;
+		}
+
+		jb->last_seq = seq;
+		jb->last_ts = ts;
+		jb->last_dtx = len <= jb->dtx_len;
+	}
+
+	measure(jb, ts, arrival);
+}
+
+/*
+ * Fill a gap from a redundant copy of an earlier frame; it does not
+ * advance the buffer or contribute to the delay estimate
+ */
+
+void jitter_put_redundant(struct jitter *jb, const void *data, size_t len,
+		uint16_t seq, uint32_t ts)
+{
+	struct jitter_packet *p;
+
+	if (!jb->started || len > JITTER_MAX_PACKET)
+		return;
+
+	/* Only useful if not yet played and not already received */
+
+	if ((int16_t)(seq - jb->next_seq) < 0)
+		return;
+	if ((int16_t)(jb->last_seq - seq) < 0)
+		return;
+
+	p = &jb->slot[seq & MASK];
+	if (p->used && p->seq == seq)
+		return;
+
+	p->used = true;
+	p->seq = seq;
+	p->ts = ts;
+	p->len = len;
+	memcpy(p->data, data, len);
+
+	atomic_fetch_add_explicit(&jb->stats.recovered, 1,
+			memory_order_relaxed);
+}
+
+/*
+ * Decide whether to grow (+1) or shrink (-1) the buffer by one frame
+ * before the next pop. Changes are only made while the output is
+ * quiet or concealed, unless the excess becomes large
+ */
+
+int jitter_adjust(struct jitter *jb, bool quiet)
+{
+	double frame, target;
+
+	if (!jb->playing)
+		return 0;
+
+	frame = frame_time(jb);
+	target = jitter_target(jb);
+
+	if (quiet && jb->level < target - frame / 2) {
+		jb->level += frame;
+		atomic_fetch_add_explicit(&jb->stats.inserted, 1,
+				memory_order_relaxed);
+		return 1;
+	}
+
+	if (depth(jb) > 1 && (jb->level > target + FORCE_DROP * frame
+			|| (quiet && jb->level > target + frame)))
+	{
+		jb->level -= frame;
+		atomic_fetch_add_explicit(&jb->stats.dropped, 1,
+				memory_order_relaxed);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Take the next frame for playout; on JITTER_PACKET the data remains
+ * valid until the next call to jitter_put
+ */
+
+int jitter_pop(struct jitter *jb, const void **data, size_t *len)
+{
+	int n;
+	double frame, target;
+	struct jitter_packet *p;
+
+	if (!jb->started)
+		return JITTER_WAIT;
+
+	frame = frame_time(jb);
+	n = depth(jb);
+
+	atomic_store_explicit(&jb->stats.depth_us,
+			n > 0 ? n * frame * 1e6 : 0, memory_order_relaxed);
+
+	if (!jb->playing) {
+		target = jitter_target(jb);
+		if (n * frame < target)
+			return JITTER_WAIT;
+
+		jb->playing = true;
+		jb->level = n * frame;
+	}
+
+	/* The sender is in DTX, so an empty buffer is a pause and not
+	 * a loss. Its next talkspurt is held back by the target delay,
+	 * as at the start; this is where the delay changes for free */
+
+	if (jb->dtx) {
+		if (n <= 0) {
+			jb->dtx_wait = 0;
+			atomic_fetch_add_explicit(&jb->stats.dtx, 1,
+					memory_order_relaxed);
+			return JITTER_DTX;
+		}
+
+		target = jitter_target(jb);
+		if (++jb->dtx_wait * frame < target && n * frame < target) {
+			atomic_fetch_add_explicit(&jb->stats.dtx, 1,
+					memory_order_relaxed);
+			return JITTER_DTX;
+		}
+
+		jb->dtx = false;
+		jb->level = target;
+	}
+
+	jb->level += (n * frame - jb->level) / LEVEL_FILTER;
+
+	/* Nothing buffered: conceal but do not advance, so the delay
+	 * grows to absorb the late packet. Eventually give up and
+	 * rebuffer */
+
+	if (n <= 0) {
+		if (++jb->starve * frame > STARVE_LIMIT) {
+			jb->playing = false;
+			jb->started = false;
+		}
+		return JITTER_MISSING;
+	}
+
+	jb->starve = 0;
+
+	p = &jb->slot[jb->next_seq & MASK];
+	jb->next_seq++;
+
+	if (!p->used || p->seq != (uint16_t)(jb->next_seq - 1)) {
+		atomic_fetch_add_explicit(&jb->stats.lost, 1,
+				memory_order_relaxed);
+		return JITTER_MISSING;
+	}
+
+	p->used = false;
+	*data = p->data;
+	*len = p->len;
+
+	/* The sender has gone quiet after this frame */
+
+	if (p->len <= jb->dtx_len) {
+		jb->dtx = true;
+		jb->dtx_wait = 0;
+	}
+
+	return JITTER_PACKET;
+}
+
+/*
+ * Look at the packet which follows the one most recently popped,
+ * eg. to recover a lost frame from its in-band FEC
+ */
+
+bool jitter_peek(struct jitter *jb, const void **data, size_t *len)
+{
+	struct jitter_packet *p;
+
+	if (!jb->started)
+		return false;
+
+	p = &jb->slot[jb->next_seq & MASK];
+	if (!p->used || p->seq != jb->next_seq)
+		return false;
+
+	*data = p->data;
+	*len = p->len;
+
+	return true;
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef JITTER_H
+#define JITTER_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Adaptive jitter buffer, keyed on RTP sequence number. The playout
+ * delay follows a percentile of the measured transit jitter plus a
+ * safety margin, and is adjusted one frame at a time while the
+ * audio is quiet or being concealed
+ */
+
+#define JITTER_SLOTS 256 /* power of two */
+#define JITTER_WINDOW 256 /* packets in the delay estimate */
+#define JITTER_MAX_PACKET 1500
+#define JITTER_DTX_LEN 2 /* a payload this small is a DTX frame, as Opus */
+
+enum {
+	JITTER_WAIT, /* buffering, nothing to play */
+	JITTER_PACKET, /* next packet is available */
+	JITTER_MISSING, /* next packet is lost; conceal it */
+	JITTER_DTX, /* sender is silent (DTX); play comfort noise */
+};
+
+struct jitter_packet {
+	bool used;
+	uint16_t seq;
+	uint32_t ts;
+	size_t len;
+	unsigned char data[JITTER_MAX_PACKET];
+};
+
+/* Read by other threads for reporting */
+
+struct jitter_stats {
+	atomic_ulong received, late, duplicate, lost, recovered,
+		inserted, dropped, resets, dtx;
+	atomic_uint depth_us, target_us, jitter_us;
+};
+
+struct jitter {
+	struct jitter_packet *slot;
+
+	unsigned int ts_rate; /* timestamp units per second */
+	double initial, percentile, margin;
+	size_t dtx_len; /* JITTER_DTX_LEN, unless set otherwise */
+
+	bool started, playing, dtx, last_dtx;
+	uint16_t next_seq, last_seq;
+	uint32_t last_ts, frame_ts, ref_ts;
+
+	double delay[JITTER_WINDOW];
+	size_t ndelay, pos;
+	unsigned int since_update, starve, dtx_wait;
+
+	double target, level; /* seconds */
+
+	struct jitter_stats stats;
+};
+
+int jitter_init(struct jitter *jb, unsigned int ts_rate,
+		double initial, double percentile, double margin);
+void jitter_clear(struct jitter *jb);
+void jitter_reset(struct jitter *jb);
+
+void jitter_put(struct jitter *jb, const void *data, size_t len,
+		uint16_t seq, uint32_t ts, bool marker, double arrival);
+void jitter_put_redundant(struct jitter *jb, const void *data, size_t len,
+		uint16_t seq, uint32_t ts);
+
+int jitter_adjust(struct jitter *jb, bool quiet);
+int jitter_pop(struct jitter *jb, const void **data, size_t *len);
+bool jitter_peek(struct jitter *jb, const void **data, size_t *len);
+
+double jitter_target(const struct jitter *jb);
+
+#endif
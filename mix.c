@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <math.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "mix.h"
+
+#define KNEE 0.8f /* limiter is transparent below this level */
+
+/*
+ * Accumulate n samples into the mix with the given gain
+ */
+
+void mix_add(float *out, const float *in, float gain, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE__)
+	__m128 g;
+
+	g = _mm_set1_ps(gain);
+	for (; i + 4 <= n; i += 4) {
+		__m128 x;
+
+		x = _mm_mul_ps(_mm_loadu_ps(in + i), g);
+		_mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), x));
+	}
+#elif defined(__ARM_NEON)
+	for (; i + 4 <= n; i += 4) {
+		float32x4_t x;
+
+		x = vmlaq_n_f32(vld1q_f32(out + i), vld1q_f32(in + i), gain);
+		vst1q_f32(out + i, x);
+	}
+#endif
+
+	for (; i < n; i++)
+		out[i] += in[i] * gain;
+}
+
+/*
+ * Soft limiter: linear up to the knee, then a smooth curve towards
+ * full scale. Written without branches so it vectorises
+ */
+
+void mix_limit(float *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		float x, a, over, y;
+
+		x = buf[i];
+		a = fabsf(x);
+
+		/* Rational approximation of tanh, exact at +/-3 */
+
+		over = fminf((fmaxf(a, KNEE) - KNEE) / (1.0f - KNEE), 3.0f);
+		y = over * (27.0f + over * over) / (27.0f + 9.0f * over * over);
+
+		buf[i] = copysignf(fminf(a, KNEE) + (1.0f - KNEE) * y, x);
+	}
+}
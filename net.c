@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "net.h"
+
+static int join_group(int fd, const struct addrinfo *ai)
+{
+	if (ai->ai_family == AF_INET) {
+		struct ip_mreq mreq;
+		const struct sockaddr_in *sin = (void*)ai->ai_addr;
+
+		if (!IN_MULTICAST(ntohl(sin->sin_addr.s_addr)))
+			return 0;
+
+		memset(&mreq, 0, sizeof mreq);
+		mreq.imr_multiaddr = sin->sin_addr;
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+		if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+				&mreq, sizeof mreq) == -1)
+		{
+			perror("IP_ADD_MEMBERSHIP");
+			return -1;
+		}
+
+	} else if (ai->ai_family == AF_INET6) {
+		struct ipv6_mreq mreq;
+		const struct sockaddr_in6 *sin6 = (void*)ai->ai_addr;
+
+		if (!IN6_IS_ADDR_MULTICAST(&sin6->sin6_addr))
+			return 0;
+
+		memset(&mreq, 0, sizeof mreq);
+		mreq.ipv6mr_multiaddr = sin6->sin6_addr;
+
+		if (setsockopt(fd, IPPROTO_IPV6, IPV6_JOIN_GROUP,
+				&mreq, sizeof mreq) == -1)
+		{
+			perror("IPV6_JOIN_GROUP");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Open a UDP socket bound to the given address and port, joining
+ * the group if the address is multicast
+ */
+
+int net_listen(const char *addr, unsigned int port)
+{
+	int r, fd, one = 1;
+	char service[16];
+	struct addrinfo hints, *res;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+	snprintf(service, sizeof service, "%u", port);
+
+	r = getaddrinfo(addr, service, &hints, &res);
+	if (r != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(r));
+		return -1;
+	}
+
+	fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (fd == -1) {
+		perror("socket");
+		goto fail;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) == -1) {
+		perror("SO_REUSEADDR");
+		goto fail_close;
+	}
+
+	if (bind(fd, res->ai_addr, res->ai_addrlen) == -1) {
+		perror("bind");
+		goto fail_close;
+	}
+
+	if (join_group(fd, res) == -1)
+		goto fail_close;
+
+	freeaddrinfo(res);
+	return fd;
+
+fail_close:
+	close(fd);
+fail:
+	freeaddrinfo(res);
+	return -1;
+}
+
+/*
+ * Have the kernel stamp each datagram with its time of arrival
+ * (CLOCK_REALTIME), delivered as a control message
+ */
+
+int net_timestamp(int fd)
+{
+	int one = 1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof one) == -1) {
+		perror("SO_TIMESTAMPNS");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Resolve a destination address and port
+ */
+
+int net_resolve(const char *addr, unsigned int port,
+		struct sockaddr_storage *dest, socklen_t *len)
+{
+	int r;
+	char service[16];
+	struct addrinfo hints, *res;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	snprintf(service, sizeof service, "%u", port);
+
+	r = getaddrinfo(addr, service, &hints, &res);
+	if (r != 0) {
+		fprintf(stderr, "getaddrinfo: %s: %s\n", addr, gai_strerror(r));
+		return -1;
+	}
+
+	memcpy(dest, res->ai_addr, res->ai_addrlen);
+	*len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	return 0;
+}
+
+/*
+ * The kernel's timestamp of a received datagram (see net_timestamp);
+ * return -1 if there is none
+ */
+
+int net_stamp(struct msghdr *msg, struct timespec *ts)
+{
+	struct cmsghdr *cm;
+
+	for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET
+			|| cm->cmsg_type != SCM_TIMESTAMPNS)
+		{
+			continue;
+		}
+
+		memcpy(ts, CMSG_DATA(cm), sizeof *ts);
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * How long a received datagram waited in the socket, from the
+ * kernel's timestamp and the time it was taken; negative if there is
+ * no timestamp or the clock was stepped
+ */
+
+double net_waited(struct msghdr *msg, const struct timespec *now)
+{
+	struct timespec ts;
+
+	if (net_stamp(msg, &ts) == -1)
+		return -1.0;
+
+	return (now->tv_sec - ts.tv_sec) + (now->tv_nsec - ts.tv_nsec) * 1e-9;
+}
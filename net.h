@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef NET_H
+#define NET_H
+
+#include <time.h>
+#include <sys/socket.h>
+
+int net_listen(const char *addr, unsigned int port);
+int net_timestamp(int fd);
+int net_resolve(const char *addr, unsigned int port,
+		struct sockaddr_storage *dest, socklen_t *len);
+int net_stamp(struct msghdr *msg, struct timespec *ts);
+double net_waited(struct msghdr *msg, const struct timespec *now);
+
+#endif
@@ -0,0 +1,605 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <byteswap.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "pcap.h"
+
+#define MAGIC_USEC 0xa1b2c3d4
+#define MAGIC_NSEC 0xa1b23c4d
+#define MAGIC_PCAPNG 0x0a0d0d0a
+#define MAGIC_USEC_SWAPPED 0xd4c3b2a1
+#define MAGIC_NSEC_SWAPPED 0x4d3cb2a1
+#define SNAPLEN 262144
+
+#define LINK_NULL 0
+#define LINK_ETHERNET 1
+#define LINK_RAW 101
+#define LINK_LINUX_SLL 113
+#define LINK_IPV4 228
+#define LINK_IPV6 229
+#define LINK_LINUX_SLL2 276
+
+#define ETHER_IPV4 0x0800
+#define ETHER_IPV6 0x86dd
+#define ETHER_VLAN 0x8100
+#define ETHER_QINQ 0x88a8
+
+#define TEE_SLOTS 256
+#define TEE_PAUSE 10000000 /* ns */
+#define MAX_HEADER 48 /* IPv6 and UDP */
+
+struct file_header {
+	uint32_t magic;
+	uint16_t major, minor;
+	int32_t zone;
+	uint32_t sigfigs, snaplen, linktype;
+};
+
+struct record_header {
+	uint32_t sec, frac, incl, orig;
+};
+
+/*
+ * A datagram waiting in a ring to be written
+ */
+
+struct record {
+	struct timespec ts;
+	struct sockaddr_storage src, dst;
+	size_t len, kept;
+	unsigned char data[PCAP_MAX_DATA];
+};
+
+static uint16_t get16(const unsigned char *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static void put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+/*
+ * Internet checksum, over pieces of even length but the last
+ */
+
+static uint32_t sum16(uint32_t sum, const unsigned char *p, size_t len)
+{
+	for (; len > 1; p += 2, len -= 2)
+		sum += get16(p);
+	if (len > 0)
+		sum += p[0] << 8;
+
+	return sum;
+}
+
+static uint16_t fold(uint32_t sum)
+{
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+static void copy_addr(struct sockaddr_storage *to, const struct sockaddr *from)
+{
+	to->ss_family = AF_UNSPEC;
+
+	if (from == NULL)
+		return;
+	if (from->sa_family == AF_INET)
+		memcpy(to, from, sizeof(struct sockaddr_in));
+	if (from->sa_family == AF_INET6)
+		memcpy(to, from, sizeof(struct sockaddr_in6));
+}
+
+/*
+ * The IP and UDP headers the datagram would have had on the wire;
+ * an unknown source address is left as zero
+ */
+
+static size_t ip_header(unsigned char *h, const struct record *r)
+{
+	uint16_t udp_len = 8 + r->len, sport = 0, dport = 0, c;
+	uint32_t sum;
+	unsigned char *u;
+	size_t n;
+
+	if (r->dst.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *s = (const void*)&r->src,
+			*d = (const void*)&r->dst;
+
+		n = 40;
+		memset(h, 0, n);
+		h[0] = 0x60;
+		put16(h + 4, udp_len);
+		h[6] = IPPROTO_UDP;
+		h[7] = 64;
+		if (r->src.ss_family == AF_INET6) {
+			memcpy(h + 8, &s->sin6_addr, 16);
+			sport = ntohs(s->sin6_port);
+		}
+		memcpy(h + 24, &d->sin6_addr, 16);
+		dport = ntohs(d->sin6_port);
+
+		sum = sum16(0, h + 8, 32) + udp_len + IPPROTO_UDP;
+	} else {
+		const struct sockaddr_in *s = (const void*)&r->src,
+			*d = (const void*)&r->dst;
+
+		n = 20;
+		memset(h, 0, n);
+		h[0] = 0x45;
+		put16(h + 2, n + udp_len);
+		h[8] = 64;
+		h[9] = IPPROTO_UDP;
+		if (r->src.ss_family == AF_INET) {
+			memcpy(h + 12, &s->sin_addr, 4);
+			sport = ntohs(s->sin_port);
+		}
+		memcpy(h + 16, &d->sin_addr, 4);
+		dport = ntohs(d->sin_port);
+		put16(h + 10, fold(sum16(0, h, n)));
+
+		sum = sum16(0, h + 12, 8) + udp_len + IPPROTO_UDP;
+	}
+
+	u = h + n;
+	put16(u, sport);
+	put16(u + 2, dport);
+	put16(u + 4, udp_len);
+	put16(u + 6, 0);
+
+	/* No checksum can be given for a datagram cut short */
+
+	if (r->kept == r->len) {
+		c = fold(sum16(sum16(sum, u, 8), r->data, r->len));
+		put16(u + 6, c ? c : 0xffff);
+	}
+
+	return n + 8;
+}
+
+static int write_record(struct pcap_tee *t, const struct record *r)
+{
+	unsigned char h[MAX_HEADER];
+	struct record_header rh;
+	size_t n;
+
+	n = ip_header(h, r);
+
+	rh.sec = r->ts.tv_sec;
+	rh.frac = r->ts.tv_nsec;
+	rh.incl = n + r->kept;
+	rh.orig = n + r->len;
+
+	if (fwrite(&rh, sizeof rh, 1, t->f) != 1
+		|| fwrite(h, n, 1, t->f) != 1
+		|| fwrite(r->data, 1, r->kept, t->f) != r->kept)
+	{
+		perror("fwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write out the earliest datagram waiting in any ring; return 0 if
+ * there was none
+ */
+
+static int write_earliest(struct pcap_tee *t)
+{
+	size_t n, first = 0;
+	struct record *r, *earliest = NULL;
+
+	for (n = 0; n < t->nring; n++) {
+		r = ring_read_slot(&t->ring[n]);
+		if (r == NULL)
+			continue;
+
+		if (earliest == NULL || r->ts.tv_sec < earliest->ts.tv_sec
+			|| (r->ts.tv_sec == earliest->ts.tv_sec
+				&& r->ts.tv_nsec < earliest->ts.tv_nsec))
+		{
+			earliest = r;
+			first = n;
+		}
+	}
+
+	if (earliest == NULL)
+		return 0;
+
+	write_record(t, earliest);
+	ring_release(&t->ring[first]);
+
+	return 1;
+}
+
+static void* tee_main(void *arg)
+{
+	struct pcap_tee *t = arg;
+	struct timespec pause = { 0, TEE_PAUSE };
+	int stop;
+
+	do {
+		stop = atomic_load(&t->stop);
+		while (write_earliest(t));
+		nanosleep(&pause, NULL);
+	} while (!stop);
+
+	return NULL;
+}
+
+/*
+ * Start a capture of datagrams in nanosecond pcap format, from the
+ * given number of threads
+ */
+
+int pcap_tee_open(struct pcap_tee *t, const char *path, size_t producers)
+{
+	int r;
+	size_t n;
+	struct file_header h;
+
+	t->f = fopen(path, "wb");
+	if (!t->f) {
+		perror(path);
+		return -1;
+	}
+
+	h.magic = MAGIC_NSEC;
+	h.major = 2;
+	h.minor = 4;
+	h.zone = 0;
+	h.sigfigs = 0;
+	h.snaplen = MAX_HEADER + PCAP_MAX_DATA;
+	h.linktype = LINK_RAW;
+
+	if (fwrite(&h, sizeof h, 1, t->f) != 1) {
+		perror("fwrite");
+		return -1;
+	}
+
+	t->nring = producers;
+	t->ring = calloc(producers, sizeof *t->ring);
+	if (t->ring == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (n = 0; n < producers; n++) {
+		if (ring_init(&t->ring[n], TEE_SLOTS, sizeof(struct record)) == -1)
+			return -1;
+	}
+
+	atomic_init(&t->stop, 0);
+
+	r = pthread_create(&t->thread, NULL, tee_main, t);
+	if (r != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(r));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Write out all that is waiting, and finish
+ */
+
+void pcap_tee_close(struct pcap_tee *t)
+{
+	size_t n;
+	unsigned long lost = 0;
+
+	atomic_store(&t->stop, 1);
+	pthread_join(t->thread, NULL);
+
+	for (n = 0; n < t->nring; n++) {
+		lost += atomic_load(&t->ring[n].overruns);
+		ring_clear(&t->ring[n]);
+	}
+	free(t->ring);
+
+	if (lost > 0)
+		fprintf(stderr, "Capture is missing %lu packets\n", lost);
+
+	if (fclose(t->f) != 0)
+		perror("fclose");
+}
+
+/*
+ * Add a datagram from the given thread; if its ring is full it is
+ * not kept, and is counted as an overrun
+ */
+
+void pcap_tee_add(struct pcap_tee *t, size_t producer,
+		const struct timespec *ts, const struct sockaddr *src,
+		const struct sockaddr *dst, const void *data, size_t len)
+{
+	struct ring *ring = &t->ring[producer];
+	struct record *r;
+
+	r = ring_write_slot(ring);
+	if (r == NULL)
+		return;
+
+	r->ts = *ts;
+	copy_addr(&r->src, src);
+	copy_addr(&r->dst, dst);
+	r->len = len;
+	r->kept = len < PCAP_MAX_DATA ? len : PCAP_MAX_DATA;
+	memcpy(r->data, data, r->kept);
+
+	ring_commit(ring);
+}
+
+int pcap_open(struct pcap_reader *r, const char *path)
+{
+	struct file_header h;
+
+	r->f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	if (!r->f) {
+		perror(path);
+		return -1;
+	}
+
+	if (fread(&h, sizeof h, 1, r->f) != 1)
+		h.magic = 0;
+
+	switch (h.magic) {
+	case MAGIC_USEC:
+	case MAGIC_NSEC:
+		r->swapped = false;
+		break;
+	case MAGIC_USEC_SWAPPED:
+	case MAGIC_NSEC_SWAPPED:
+		r->swapped = true;
+		h.magic = bswap_32(h.magic);
+		h.linktype = bswap_32(h.linktype);
+		break;
+	case MAGIC_PCAPNG:
+		fprintf(stderr, "%s: pcapng is not supported; convert it "
+			"with 'editcap -F pcap'\n", path);
+		return -1;
+	default:
+		fprintf(stderr, "%s: not a pcap file\n", path);
+		return -1;
+	}
+
+	r->nano = h.magic == MAGIC_NSEC;
+	r->linktype = h.linktype & 0xffff;
+
+	switch (r->linktype) {
+	case LINK_NULL:
+	case LINK_ETHERNET:
+	case LINK_RAW:
+	case LINK_LINUX_SLL:
+	case LINK_IPV4:
+	case LINK_IPV6:
+	case LINK_LINUX_SLL2:
+		break;
+	default:
+		fprintf(stderr, "%s: unsupported link type %u\n", path,
+			r->linktype);
+		return -1;
+	}
+
+	r->buf = malloc(SNAPLEN);
+	if (r->buf == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	return 0;
+}
+
+void pcap_close(struct pcap_reader *r)
+{
+	if (r->f != stdin)
+		fclose(r->f);
+	free(r->buf);
+}
+
+static int parse_udp(struct pcap_datagram *d, const unsigned char *p,
+		size_t len)
+{
+	uint16_t udp_len;
+
+	if (len < 8)
+		return -1;
+
+	/* The port is in the same place for either family */
+
+	memcpy(&((struct sockaddr_in*)&d->src)->sin_port, p, 2);
+	memcpy(&((struct sockaddr_in*)&d->dst)->sin_port, p + 2, 2);
+
+	/* A datagram cut short by the capture is no use */
+
+	udp_len = get16(p + 4);
+	if (udp_len < 8 || udp_len > len)
+		return -1;
+
+	d->data = p + 8;
+	d->len = udp_len - 8;
+
+	return 0;
+}
+
+static int parse_ipv4(struct pcap_datagram *d, const unsigned char *p,
+		size_t len)
+{
+	size_t ihl;
+	struct sockaddr_in *s = (void*)&d->src, *t = (void*)&d->dst;
+
+	if (len < 20 || p[0] >> 4 != 4)
+		return -1;
+
+	ihl = (p[0] & 0xf) * 4;
+	if (ihl < 20 || ihl > len || p[9] != IPPROTO_UDP)
+		return -1;
+
+	/* Fragments are not put back together */
+
+	if (get16(p + 6) & 0x3fff)
+		return -1;
+	if (get16(p + 2) < len)
+		len = get16(p + 2);
+
+	memset(s, 0, sizeof *s);
+	s->sin_family = AF_INET;
+	memcpy(&s->sin_addr, p + 12, 4);
+
+	memset(t, 0, sizeof *t);
+	t->sin_family = AF_INET;
+	memcpy(&t->sin_addr, p + 16, 4);
+
+	return parse_udp(d, p + ihl, len - ihl);
+}
+
+static int parse_ipv6(struct pcap_datagram *d, const unsigned char *p,
+		size_t len)
+{
+	size_t total;
+	struct sockaddr_in6 *s = (void*)&d->src, *t = (void*)&d->dst;
+
+	/* Only UDP straight after the header, without extensions */
+
+	if (len < 40 || p[0] >> 4 != 6 || p[6] != IPPROTO_UDP)
+		return -1;
+
+	total = 40 + get16(p + 4);
+	if (total < len)
+		len = total;
+
+	memset(s, 0, sizeof *s);
+	s->sin6_family = AF_INET6;
+	memcpy(&s->sin6_addr, p + 8, 16);
+
+	memset(t, 0, sizeof *t);
+	t->sin6_family = AF_INET6;
+	memcpy(&t->sin6_addr, p + 24, 16);
+
+	return parse_udp(d, p + 40, len - 40);
+}
+
+static int parse(struct pcap_reader *r, struct pcap_datagram *d,
+		const unsigned char *p, size_t len)
+{
+	unsigned int type = 0; /* or from the IP version */
+
+	switch (r->linktype) {
+	case LINK_ETHERNET:
+		if (len < 14)
+			return -1;
+		type = get16(p + 12);
+		p += 14;
+		len -= 14;
+
+		while ((type == ETHER_VLAN || type == ETHER_QINQ) && len >= 4) {
+			type = get16(p + 2);
+			p += 4;
+			len -= 4;
+		}
+		break;
+
+	case LINK_LINUX_SLL:
+		if (len < 16)
+			return -1;
+		type = get16(p + 14);
+		p += 16;
+		len -= 16;
+		break;
+
+	case LINK_LINUX_SLL2:
+		if (len < 20)
+			return -1;
+		type = get16(p);
+		p += 20;
+		len -= 20;
+		break;
+
+	case LINK_NULL:
+		if (len < 4)
+			return -1;
+		p += 4;
+		len -= 4;
+		break;
+	}
+
+	if (type == 0 && len > 0)
+		type = p[0] >> 4 == 6 ? ETHER_IPV6 : ETHER_IPV4;
+
+	switch (type) {
+	case ETHER_IPV4:
+		return parse_ipv4(d, p, len);
+	case ETHER_IPV6:
+		return parse_ipv6(d, p, len);
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Read the next UDP datagram of the capture, skipping anything else;
+ * return 0 at the end of the file
+ */
+
+int pcap_next(struct pcap_reader *r, struct pcap_datagram *d)
+{
+	struct record_header rh;
+
+	for (;;) {
+		if (fread(&rh, sizeof rh, 1, r->f) != 1) {
+			if (ferror(r->f)) {
+				perror("fread");
+				return -1;
+			}
+			return 0;
+		}
+
+		if (r->swapped) {
+			rh.sec = bswap_32(rh.sec);
+			rh.frac = bswap_32(rh.frac);
+			rh.incl = bswap_32(rh.incl);
+		}
+
+		if (rh.incl > SNAPLEN) {
+			fprintf(stderr, "Capture is corrupt\n");
+			return -1;
+		}
+
+		if (fread(r->buf, 1, rh.incl, r->f) != rh.incl)
+			return 0; /* cut off part way through */
+
+		d->ts.tv_sec = rh.sec;
+		d->ts.tv_nsec = r->nano ? rh.frac : rh.frac * 1000;
+
+		if (parse(r, d, r->buf, rh.incl) == 0)
+			return 1;
+	}
+}
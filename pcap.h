@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef PCAP_H
+#define PCAP_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "ring.h"
+
+/*
+ * Datagrams to and from files in the classic pcap format, so that
+ * traffic can be kept, replayed and looked at with other tools
+ */
+
+#define PCAP_MAX_DATA 1500 /* bytes kept of each datagram */
+
+/*
+ * A copy of datagrams sent or received, written out by a thread of
+ * its own so that real-time threads never wait on the disk. Each
+ * thread which adds to it has a ring of its own
+ */
+
+struct pcap_tee {
+	FILE *f;
+	struct ring *ring;
+	size_t nring;
+	pthread_t thread;
+	atomic_int stop;
+};
+
+int pcap_tee_open(struct pcap_tee *t, const char *path, size_t producers);
+void pcap_tee_close(struct pcap_tee *t);
+
+void pcap_tee_add(struct pcap_tee *t, size_t producer,
+		const struct timespec *ts, const struct sockaddr *src,
+		const struct sockaddr *dst, const void *data, size_t len);
+
+/*
+ * The UDP datagrams of a capture, from Ethernet, Linux "any" or raw
+ * IP links
+ */
+
+struct pcap_reader {
+	FILE *f;
+	bool swapped, nano;
+	uint32_t linktype;
+	unsigned char *buf;
+};
+
+struct pcap_datagram {
+	struct timespec ts;
+	struct sockaddr_storage src, dst;
+	const unsigned char *data;
+	size_t len;
+};
+
+int pcap_open(struct pcap_reader *r, const char *path);
+void pcap_close(struct pcap_reader *r);
+int pcap_next(struct pcap_reader *r, struct pcap_datagram *d);
+
+#endif
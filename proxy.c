@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "defaults.h"
+#include "impair.h"
+#include "net.h"
+#include "notice.h"
+
+#define MAX_DATAGRAM 2048
+#define SLOTS 1024 /* datagrams held at once */
+
+/*
+ * A UDP proxy which passes datagrams on through an impairment, to
+ * try tx and rx over a bad network on one machine. Replies, such as
+ * reception reports, go back to the latest sender unimpaired
+ */
+
+struct datagram {
+	size_t len;
+	unsigned char data[MAX_DATAGRAM];
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Take everything waiting from the senders into the impairment
+ */
+
+static int take(struct impair *m, int fd, struct sockaddr_storage *client,
+		socklen_t *client_len)
+{
+	struct datagram d;
+	ssize_t z;
+
+	for (;;) {
+		*client_len = sizeof *client;
+		z = recvfrom(fd, d.data, sizeof d.data, MSG_DONTWAIT,
+				(struct sockaddr*)client, client_len);
+		if (z == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			perror("recvfrom");
+			return -1;
+		}
+
+		d.len = z;
+		impair_put(m, now(), &d);
+	}
+}
+
+/*
+ * Pass replies straight back to whoever sent to us last
+ */
+
+static int reply(int fd, int back, const struct sockaddr_storage *client,
+		socklen_t client_len)
+{
+	unsigned char buf[MAX_DATAGRAM];
+	ssize_t z;
+
+	for (;;) {
+		z = recv(fd, buf, sizeof buf, MSG_DONTWAIT);
+		if (z == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			perror("recv");
+			return -1;
+		}
+
+		if (client_len > 0 && sendto(back, buf, z, 0,
+				(const struct sockaddr*)client,
+				client_len) == -1)
+		{
+			perror("sendto");
+		}
+	}
+}
+
+static int run(struct impair *m, int in, int out,
+		const struct sockaddr_storage *dest, socklen_t dest_len)
+{
+	struct pollfd pe[2];
+	struct sockaddr_storage client;
+	socklen_t client_len = 0;
+	struct datagram *d;
+	struct timespec wait;
+	double next, due;
+
+	pe[0].fd = in;
+	pe[0].events = POLLIN;
+	pe[1].fd = out;
+	pe[1].events = POLLIN;
+
+	for (;;) {
+		next = impair_next(m);
+		if (next >= 0.0) {
+			next -= now();
+			if (next < 0.0)
+				next = 0.0;
+			wait.tv_sec = next;
+			wait.tv_nsec = (next - wait.tv_sec) * 1e9;
+		}
+
+		if (ppoll(pe, 2, next >= 0.0 ? &wait : NULL, NULL) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("ppoll");
+			return -1;
+		}
+
+		if (pe[0].revents & POLLIN) {
+			if (take(m, in, &client, &client_len) == -1)
+				return -1;
+		}
+
+		if (pe[1].revents & POLLIN) {
+			if (reply(out, in, &client, client_len) == -1)
+				return -1;
+		}
+
+		while ((d = impair_get(m, now(), &due)) != NULL) {
+			if (sendto(out, d->data, d->len, 0,
+					(const struct sockaddr*)dest,
+					dest_len) == -1)
+			{
+				perror("sendto");
+			}
+		}
+	}
+}
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: impair -I <spec> [<parameters>]\n"
+		"UDP proxy which impairs what passes through it\n");
+
+	fprintf(fd, "\nNetwork parameters:\n");
+	fprintf(fd, "  -l <addr>   IP address to listen on (default any)\n");
+	fprintf(fd, "  -L <port>   UDP port to listen on (default %d)\n",
+		DEFAULT_PORT + 1);
+	fprintf(fd, "  -h <addr>   IP address to send to (default 127.0.0.1)\n");
+	fprintf(fd, "  -p <port>   UDP port to send to (default %d)\n",
+		DEFAULT_PORT);
+
+	fprintf(fd, "\nImpairment:\n");
+	fprintf(fd, "  -I <spec>   Comma-separated key=value pairs, eg.\n"
+		"              loss=2,burst=4,delay=20,jitter=5,dist=pareto,reorder=1,dup=1\n"
+		"              loss, good, bad, reorder and dup in percent;\n"
+		"              delay, jitter and hold in milliseconds; burst in packets;\n"
+		"              dist is uniform, exponential or pareto; seed picks a run\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int in, out;
+	struct sockaddr_storage dest;
+	socklen_t dest_len;
+	struct impair_config ic;
+	struct impair m;
+
+	/* command-line options */
+	const char *local = NULL,
+		*addr = "127.0.0.1",
+		*spec = NULL;
+	unsigned int listen_port = DEFAULT_PORT + 1,
+		port = DEFAULT_PORT;
+
+	fputs(COPYRIGHT "\n", stderr);
+
+	for (;;) {
+		int c;
+
+		c = getopt(argc, argv, "h:l:p:I:L:");
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'h':
+			addr = optarg;
+			break;
+		case 'l':
+			local = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'I':
+			spec = optarg;
+			break;
+		case 'L':
+			listen_port = atoi(optarg);
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (spec == NULL) {
+		usage(stderr);
+		return -1;
+	}
+
+	if (impair_parse(&ic, spec) == -1)
+		return -1;
+	if (impair_init(&m, &ic, SLOTS, sizeof(struct datagram)) == -1)
+		return -1;
+
+	in = net_listen(local, listen_port);
+	if (in == -1)
+		return -1;
+
+	if (net_resolve(addr, port, &dest, &dest_len) == -1)
+		return -1;
+
+	out = socket(dest.ss_family, SOCK_DGRAM, 0);
+	if (out == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	run(&m, in, out, &dest, dest_len);
+
+	close(out);
+	close(in);
+	impair_clear(&m);
+
+	return -1;
+}
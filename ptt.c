@@ -4,12 +4,17 @@
 #include <gpiod.h>
 #include <linux/input.h>
 #include <linux/input-event-codes.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 
 #define KEY_RELEASED 0
 #define KEY_PRESSED  1
@@ -27,35 +32,42 @@ typedef enum {
   PTT_KEY_STATE_UNKNOWN
 } ptt_key_state_t;
 
+typedef int (*read_proc_t)(ptt_t *);
 typedef void (*destroy_proc_t)(ptt_t *);
-typedef bool (*is_pressed_proc_t)(ptt_t *);
 
 extern unsigned int verbose;
 
-static void *dev_input_thread_main(void *arg);
-static bool dev_input_is_pressed(ptt_t *ptt);
+static int dev_input_read(ptt_t *ptt);
 static void dev_input_destroy(ptt_t *ptt);
+static int gpio_read(ptt_t *ptt);
 static void gpio_destroy(ptt_t *ptt);
-static bool gpio_is_pressed(ptt_t *ptt);
+
+// The key state is only ever changed by an edge (an input event or a
+// GPIO line event), never by polling the hardware, and is read
+// without locking from the audio path.
 
 typedef struct ptt_s {
   // Common state variables:
   ptt_input_source_t input_source;
-  ptt_key_state_t prev_key_state;
-  ptt_key_state_t key_state;  // protected by a mutex
+  ptt_key_state_t prev_key_state; // for ptt_loop_iter(), caller only
+  atomic_int key_state;
+  atomic_uint_least64_t pressed_at; // CLOCK_MONOTONIC nanoseconds
   char const *device;
+  int fd; // descriptor which becomes readable on an edge
+  read_proc_t read_proc;
   destroy_proc_t destroy_proc;
-  is_pressed_proc_t is_pressed_proc;
   ptt_pressed_cb_t pressed_cb;
   void *pressed_user_data;
   ptt_released_cb_t released_cb;
   void *released_user_data;
 
+  // state variables when read by our own thread:
+  bool is_threaded;
+  int stop_fd; // eventfd to tell the thread to exit
+  pthread_t pid;
+
   // state variables when input source is /dev/input:
   int keycode;
-  bool is_active; // variable to tell thread when to exit from main loop
-  pthread_t pid; // ptt gpio thread id
-  pthread_mutex_t mutex; // mutex for shared state
 
   // state variables when the input source is gpio.  Note that we use
   // the linux gpiod interface:
@@ -63,137 +75,318 @@ typedef struct ptt_s {
   struct gpiod_line *line;
 } ptt_t;
 
-
-//////////////////////////////////////////////////////////////////////
-// INPUT SOURCE: /DEV/INPUT
-
-ptt_t *ptt_dev_input_create(char *input_device, int keycode) {
+static ptt_t *ptt_alloc(ptt_input_source_t input_source, char const *device) {
   ptt_t *ptt = (ptt_t *)malloc(sizeof(ptt_t));
-  ptt->input_source = PTT_INPUT_SOURCE_DEV_INPUT;
-  ptt->device = input_device;
-  ptt->keycode = keycode;
+  if (ptt == NULL) {
+    perror("malloc");
+    return NULL;
+  }
+  ptt->input_source = input_source;
+  ptt->device = device;
+  ptt->fd = -1;
   ptt->prev_key_state = PTT_KEY_STATE_UNKNOWN;
-  ptt->key_state = PTT_KEY_STATE_UNKNOWN;
-  ptt->is_active = true;
-  ptt->destroy_proc = &dev_input_destroy;
-  ptt->is_pressed_proc = &dev_input_is_pressed;
+  atomic_init(&ptt->key_state, PTT_KEY_STATE_UNKNOWN);
+  atomic_init(&ptt->pressed_at, 0);
   ptt->pressed_cb = NULL;
   ptt->pressed_user_data = NULL;
   ptt->released_cb = NULL;
   ptt->released_user_data = NULL;
-  pthread_mutex_init(&ptt->mutex, NULL);
-  pthread_create(&ptt->pid, NULL, &dev_input_thread_main, (void *)ptt);
+  ptt->is_threaded = false;
+  ptt->stop_fd = -1;
+  ptt->chip = NULL;
+  ptt->line = NULL;
   return ptt;
 }
 
-static void *dev_input_thread_main(void *arg) {
-  ptt_t *ptt = (ptt_t *)arg;
-  struct input_event ev;
-  ssize_t n;
-  int fd;
+static uint64_t timespec_ns(const struct timespec *ts) {
+  return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+// An edge; the time of a press is kept first, so that anyone who
+// sees the key down also sees when it went down
+static void set_key_state(ptt_t *ptt, ptt_key_state_t state, uint64_t when) {
+  if (state == PTT_KEY_STATE_PRESSED)
+    atomic_store_explicit(&ptt->pressed_at, when, memory_order_relaxed);
+  atomic_store_explicit(&ptt->key_state, state, memory_order_release);
+}
+
+//////////////////////////////////////////////////////////////////////
+// INPUT SOURCE: /DEV/INPUT
+
+static ptt_t *dev_input_open(char const *input_device, int keycode) {
+  ptt_t *ptt;
+  int clock = CLOCK_MONOTONIC;
+  unsigned long keys[KEY_MAX / (8 * sizeof(unsigned long)) + 1];
+  struct timespec now;
+
+  ptt = ptt_alloc(PTT_INPUT_SOURCE_DEV_INPUT, input_device);
+  if (ptt == NULL)
+    return NULL;
+  ptt->keycode = keycode;
+  ptt->read_proc = &dev_input_read;
+  ptt->destroy_proc = &dev_input_destroy;
 
-  if ((fd = open(ptt->device, O_RDONLY)) == -1) {
-    fprintf(stderr, "Cannot open %s: %s.\n", ptt->device, strerror(errno));
+  ptt->fd = open(input_device, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (ptt->fd == -1) {
+    fprintf(stderr, "Cannot open %s: %s.\n", input_device, strerror(errno));
+    free(ptt);
     return NULL;
   }
 
-  while (ptt->is_active) {
-    // blocking read to prevent over-utilizaton of CPU
-    if ((n = read(fd, &ev, sizeof ev)) == (ssize_t)-1) {
+  // Have events stamped on the same clock as the audio path
+  if (ioctl(ptt->fd, EVIOCSCLOCKID, &clock) == -1)
+    perror("EVIOCSCLOCKID");
+
+  // The key may already be held
+  memset(keys, 0, sizeof keys);
+  if (ioctl(ptt->fd, EVIOCGKEY(sizeof keys), keys) == -1) {
+    perror("EVIOCGKEY");
+  } else {
+    bool down = keys[keycode / (8 * sizeof(unsigned long))]
+      & (1UL << (keycode % (8 * sizeof(unsigned long))));
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    set_key_state(ptt, down ? PTT_KEY_STATE_PRESSED : PTT_KEY_STATE_RELEASED,
+                  timespec_ns(&now));
+  }
+
+  return ptt;
+}
+
+static void dev_input_event(ptt_t *ptt, const struct input_event *ev) {
+  struct timespec ts;
+
+  if (ev->type != EV_KEY || ev->code != ptt->keycode)
+    return;
+
+  ts.tv_sec = ev->input_event_sec;
+  ts.tv_nsec = ev->input_event_usec * 1000;
+
+  switch(ev->value) {
+  case KEY_PRESSED:
+    set_key_state(ptt, PTT_KEY_STATE_PRESSED, timespec_ns(&ts));
+    break;
+  case KEY_RELEASED:
+    set_key_state(ptt, PTT_KEY_STATE_RELEASED, timespec_ns(&ts));
+    break;
+  case KEY_REPEATED:
+    return;
+  }
+
+  if (verbose > 1)
+    fprintf(stderr, "%s 0x%04x (%d)\n", evval[ev->value], (int)ev->code, (int)ev->code);
+}
+
+// Take every event waiting on the device
+static int dev_input_read(ptt_t *ptt) {
+  struct input_event ev[16];
+  ssize_t n;
+  size_t i;
+
+  for (;;) {
+    n = read(ptt->fd, ev, sizeof ev);
+    if (n == (ssize_t)-1) {
       if (errno == EINTR)
         continue;
-      else
-        break;
-    } else {
-      if (n != sizeof ev) {
-        errno = EIO;
-        break;
-      }
+      if (errno == EAGAIN)
+        return 0;
+      perror("read");
+      return -1;
     }
-    if (ev.type == EV_KEY && ev.code == ptt->keycode) {
-      switch(ev.value) {
-      case KEY_PRESSED:
-        printf("%s 0x%04x (%d)\n", evval[ev.value], (int)ev.code, (int)ev.code);
-        pthread_mutex_lock(&ptt->mutex);
-        ptt->key_state = PTT_KEY_STATE_PRESSED;
-        pthread_mutex_unlock(&ptt->mutex);
-        break;
-      case KEY_RELEASED:
-        printf("%s 0x%04x (%d)\n", evval[ev.value], (int)ev.code, (int)ev.code);
-        pthread_mutex_lock(&ptt->mutex);
-        ptt->key_state = PTT_KEY_STATE_RELEASED;
-        pthread_mutex_unlock(&ptt->mutex);
-        break;
-      case KEY_REPEATED:
-        break;
-      }
+    if (n % sizeof *ev != 0) {
+      fprintf(stderr, "Short read from %s\n", ptt->device);
+      return -1;
     }
+    for (i = 0; i < n / sizeof *ev; i++)
+      dev_input_event(ptt, &ev[i]);
   }
-
-  close(fd);
-
-  return NULL;
 }
 
 static void dev_input_destroy(ptt_t *ptt) {
-  ptt->is_active = false; // tell the thread to exit its main loop
-  pthread_join(ptt->pid, NULL);
-  pthread_mutex_destroy(&ptt->mutex);
-}
-
-static bool dev_input_is_pressed(ptt_t *ptt) {
-  bool rval = false;
-  pthread_mutex_lock(&ptt->mutex);
-  rval = ptt->key_state == PTT_KEY_STATE_PRESSED;
-  pthread_mutex_unlock(&ptt->mutex);
-  return rval;
+  close(ptt->fd);
 }
 
 //////////////////////////////////////////////////////////////////////
 // INPUT SOURCE: GPIO
 
-ptt_t *ptt_create_gpio(char const *device_name, int pin_number) {
-  ptt_t *ptt = (ptt_t *)malloc(sizeof(ptt_t));
-  ptt->input_source = PTT_INPUT_SOURCE_GPIO;
-  ptt->prev_key_state = PTT_KEY_STATE_UNKNOWN;
-  ptt->key_state = PTT_KEY_STATE_UNKNOWN;
-  ptt->is_active = true;
+static ptt_t *gpio_open(char const *device_name, int pin_number) {
+  ptt_t *ptt;
+  int val;
+  struct timespec now;
+
+  ptt = ptt_alloc(PTT_INPUT_SOURCE_GPIO, device_name);
+  if (ptt == NULL)
+    return NULL;
+  ptt->read_proc = &gpio_read;
   ptt->destroy_proc = &gpio_destroy;
-  ptt->is_pressed_proc = &gpio_is_pressed;
-  ptt->pressed_cb = NULL;
-  ptt->pressed_user_data = NULL;
-  ptt->released_cb = NULL;
-  ptt->released_user_data = NULL;
+
   ptt->chip = gpiod_chip_open(device_name);
+  if (ptt->chip == NULL) {
+    fprintf(stderr, "Cannot open %s: %s.\n", device_name, strerror(errno));
+    free(ptt);
+    return NULL;
+  }
+
   ptt->line = gpiod_chip_get_line(ptt->chip, pin_number);
-  gpiod_line_request_input(ptt->line, "PTT");
+  if (ptt->line == NULL
+      || gpiod_line_request_both_edges_events(ptt->line, "PTT") == -1) {
+    fprintf(stderr, "Cannot use line %d of %s: %s.\n", pin_number,
+            device_name, strerror(errno));
+    gpiod_chip_close(ptt->chip);
+    free(ptt);
+    return NULL;
+  }
+
+  ptt->fd = gpiod_line_event_get_fd(ptt->line);
+
+  // Once only, for the state before the first edge
+  val = gpiod_line_get_value(ptt->line);
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  set_key_state(ptt, val == 1 ? PTT_KEY_STATE_PRESSED : PTT_KEY_STATE_RELEASED,
+                timespec_ns(&now));
+
   return ptt;
 }
 
+// Take the event waiting on the line; its timestamp is on the
+// monotonic clock (Linux 5.7 onwards)
+static int gpio_read(ptt_t *ptt) {
+  struct gpiod_line_event ev;
+  struct pollfd pfd;
+
+  pfd.fd = ptt->fd;
+  pfd.events = POLLIN;
+
+  while (poll(&pfd, 1, 0) == 1) {
+    if (gpiod_line_event_read_fd(ptt->fd, &ev) == -1) {
+      perror("gpiod_line_event_read_fd");
+      return -1;
+    }
+
+    if (ev.event_type == GPIOD_LINE_EVENT_RISING_EDGE)
+      set_key_state(ptt, PTT_KEY_STATE_PRESSED, timespec_ns(&ev.ts));
+    else
+      set_key_state(ptt, PTT_KEY_STATE_RELEASED, timespec_ns(&ev.ts));
+  }
+
+  return 0;
+}
+
 static void gpio_destroy(ptt_t *ptt) {
   gpiod_line_release(ptt->line);
   gpiod_chip_close(ptt->chip);
 }
 
-static bool gpio_is_pressed(ptt_t *ptt) {
-  int val = gpiod_line_get_value(ptt->line);
-  return (val == 0 || val == -1) ? false : true;
+//////////////////////////////////////////////////////////////////////
+// THREAD, for callers without an event loop of their own
+
+static void *thread_main(void *arg) {
+  ptt_t *ptt = (ptt_t *)arg;
+  struct pollfd pfd[2];
+
+  pfd[0].fd = ptt->fd;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = ptt->stop_fd;
+  pfd[1].events = POLLIN;
+
+  for (;;) {
+    // sleep until there is an edge, or we are told to stop
+    if (poll(pfd, 2, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+    if (pfd[1].revents)
+      break;
+    if (pfd[0].revents && ptt->read_proc(ptt) == -1)
+      break;
+  }
+
+  return NULL;
+}
+
+static ptt_t *start_thread(ptt_t *ptt) {
+  int r;
+
+  if (ptt == NULL)
+    return NULL;
+
+  ptt->stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (ptt->stop_fd == -1) {
+    perror("eventfd");
+    ptt_destroy(ptt);
+    return NULL;
+  }
+
+  r = pthread_create(&ptt->pid, NULL, &thread_main, (void *)ptt);
+  if (r != 0) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(r));
+    ptt_destroy(ptt);
+    return NULL;
+  }
+
+  ptt->is_threaded = true;
+  return ptt;
+}
+
+static void stop_thread(ptt_t *ptt) {
+  uint64_t one = 1;
+
+  if (ptt->is_threaded) {
+    if (write(ptt->stop_fd, &one, sizeof one) != sizeof one)
+      perror("write");
+    pthread_join(ptt->pid, NULL);
+  }
+  if (ptt->stop_fd != -1)
+    close(ptt->stop_fd);
 }
 
 //////////////////////////////////////////////////////////////////////
 // PTT API
 
 ptt_t *ptt_create_simple() {
-  return ptt_dev_input_create(DEFAULT_PTT_DEV_INPUT_DEVICE, KEY_LEFTCTRL);
+  return ptt_create_dev_input(DEFAULT_PTT_DEV_INPUT_DEVICE, KEY_LEFTCTRL);
+}
+
+ptt_t *ptt_create_dev_input(char const *input_device, int keycode) {
+  return start_thread(dev_input_open(input_device, keycode));
+}
+
+ptt_t *ptt_create_gpio(char const *device_name, int pin_number) {
+  return start_thread(gpio_open(device_name, pin_number));
+}
+
+ptt_t *ptt_open_dev_input(char const *input_device, int keycode) {
+  return dev_input_open(input_device, keycode);
+}
+
+ptt_t *ptt_open_gpio(char const *device_name, int pin_number) {
+  return gpio_open(device_name, pin_number);
 }
 
 void ptt_destroy(ptt_t *ptt) {
+  if (ptt == NULL)
+    return;
+  stop_thread(ptt);
   ptt->destroy_proc(ptt);
   free(ptt);
 }
 
+int ptt_fd(ptt_t *ptt) {
+  return ptt->is_threaded ? -1 : ptt->fd;
+}
+
+int ptt_read(ptt_t *ptt) {
+  return ptt->read_proc(ptt);
+}
+
 bool ptt_is_pressed(ptt_t *ptt) {
-  return ptt->is_pressed_proc(ptt);
+  return atomic_load_explicit(&ptt->key_state, memory_order_acquire)
+    == PTT_KEY_STATE_PRESSED;
+}
+
+uint64_t ptt_pressed_at(ptt_t *ptt) {
+  return atomic_load_explicit(&ptt->pressed_at, memory_order_relaxed);
 }
 
 void ptt_add_pressed_cb(ptt_t *ptt, ptt_pressed_cb_t cb, void *user_data) {
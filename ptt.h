@@ -2,6 +2,7 @@
 #define PTT_H_INCLUDED
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <linux/input-event-codes.h>
 
 typedef enum {
@@ -28,9 +29,13 @@ typedef void (*ptt_released_cb_t)(ptt_t *ptt, void *user_data);
 // Simple constructor, using defaults (/dev/input source, Left Ctrl Key as the PTT button):
 ptt_t *ptt_create_simple();
 
-// initialize the ptt object and start the task
+// initialize the ptt object and start the task; NULL on error
 ptt_t *ptt_create_dev_input(char const *device, int keycode);
 ptt_t *ptt_create_gpio(char const *device, int pin_number);
+
+// open the input without starting a task; NULL on error
+ptt_t *ptt_open_dev_input(char const *device, int keycode);
+ptt_t *ptt_open_gpio(char const *device, int pin_number);
 // ptt_t *ptt_create_stdin(int keycode);
 
 // Add button state change callbacks:
@@ -40,11 +45,20 @@ void ptt_add_released_cb(ptt_t *ptt, ptt_released_cb_t cb, void *user_data);
 // terminate the ptt task
 void ptt_destroy(ptt_t *ptt);
 
-// OPTION 1: get the current state of the ptt button
+// OPTION 1: get the current state of the ptt button; it is kept up
+// to date from edges, so this is a single atomic load
 bool ptt_is_pressed(ptt_t *ptt);
 
+// when the button last went down, CLOCK_MONOTONIC nanoseconds
+uint64_t ptt_pressed_at(ptt_t *ptt);
+
 // OPTION 2: invoke this from your thread context's main loop to
 // invoke the button state change callbacks
 void ptt_loop_iter(ptt_t *ptt);
 
+// For ptt_open_*(): the descriptor to wait on (-1 if there is a
+// task), and take the events waiting on it; -1 on error
+int ptt_fd(ptt_t *ptt);
+int ptt_read(ptt_t *ptt);
+
 #endif /* PTT_H_INCLUDED */
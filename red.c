@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+#include <sys/types.h>
+
+#include "red.h"
+
+/*
+ * Pack the given blocks, oldest first with the primary last, into a
+ * single payload. Return its length, or -1 if it does not fit
+ */
+
+ssize_t red_encode(unsigned char *out, size_t size,
+		const struct red_block *block, unsigned int n)
+{
+	unsigned int i;
+	size_t z;
+	unsigned char *p;
+
+	z = 4 * (n - 1) + 1;
+	for (i = 0; i < n; i++)
+		z += block[i].len;
+	if (z > size)
+		return -1;
+
+	p = out;
+	for (i = 0; i + 1 < n; i++) {
+		const struct red_block *b = &block[i];
+
+		if (b->offset > RED_MAX_OFFSET || b->len > RED_MAX_LEN)
+			return -1;
+
+		*p++ = 0x80 | b->pt;
+		*p++ = b->offset >> 6;
+		*p++ = (b->offset & 0x3f) << 2 | b->len >> 8;
+		*p++ = b->len & 0xff;
+	}
+	*p++ = block[n - 1].pt;
+
+	for (i = 0; i < n; i++) {
+		memcpy(p, block[i].data, block[i].len);
+		p += block[i].len;
+	}
+
+	return z;
+}
+
+/*
+ * Split a payload into its blocks, pointing into the given buffer.
+ * Return the number of blocks (the last being the primary) or -1 if
+ * the payload is malformed
+ */
+
+int red_parse(struct red_block *block, unsigned int max,
+		const unsigned char *buf, size_t len)
+{
+	unsigned int n, i;
+	const unsigned char *p, *end;
+
+	p = buf;
+	end = buf + len;
+
+	for (n = 0;; n++) {
+		if (n == max || p >= end)
+			return -1;
+
+		block[n].pt = p[0] & 0x7f;
+
+		if (!(p[0] & 0x80)) {
+			block[n].offset = 0;
+			p++;
+			break;
+		}
+
+		if (p + 4 > end)
+			return -1;
+
+		block[n].offset = p[1] << 6 | p[2] >> 2;
+		block[n].len = (p[2] & 0x3) << 8 | p[3];
+		p += 4;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (p + block[i].len > end)
+			return -1;
+		block[i].data = p;
+		p += block[i].len;
+	}
+
+	block[n].data = p;
+	block[n].len = end - p;
+
+	return n + 1;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef RED_H
+#define RED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Redundant audio data (RFC 2198): earlier frames are carried again
+ * ahead of the primary, each with its timestamp offset
+ */
+
+#define RED_MAX_BLOCKS 8 /* including the primary */
+#define RED_MAX_OFFSET 0x3fff
+#define RED_MAX_LEN 0x3ff
+
+struct red_block {
+	unsigned int pt;
+	uint32_t offset;
+	const unsigned char *data;
+	size_t len;
+};
+
+ssize_t red_encode(unsigned char *out, size_t size,
+		const struct red_block *block, unsigned int n);
+int red_parse(struct red_block *block, unsigned int max,
+		const unsigned char *buf, size_t len);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <string.h>
+
+#include "report.h"
+#include "rtp.h"
+
+#define PT_RR 201
+#define PT_APP 204
+#define APP_NAME "trx " /* four characters */
+
+static uint32_t get32(const unsigned char *b)
+{
+	return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16
+		| (uint32_t)b[2] << 8 | b[3];
+}
+
+static void put32(unsigned char *b, uint32_t v)
+{
+	b[0] = v >> 24;
+	b[1] = v >> 16;
+	b[2] = v >> 8;
+	b[3] = v;
+}
+
+/*
+ * Common header; the length is in 32-bit words, less one
+ */
+
+static void put_header(unsigned char *b, unsigned int count, unsigned int pt,
+		size_t len)
+{
+	b[0] = 2 << 6 | count;
+	b[1] = pt;
+	b[2] = (len / 4 - 1) >> 8;
+	b[3] = len / 4 - 1;
+}
+
+/*
+ * Write a report as a compound RTCP packet. Return its length, or -1
+ * if it does not fit
+ */
+
+ssize_t report_write(unsigned char *buf, size_t size, const struct report *r)
+{
+	unsigned char *b;
+	double loss;
+	uint32_t depth;
+
+	if (size < REPORT_SIZE)
+		return -1;
+
+	loss = r->loss < 0.0 ? 0.0 : r->loss > 1.0 ? 1.0 : r->loss;
+	depth = r->depth > 0.0 ? r->depth * 1e6 : 0;
+
+	/* Receiver report, with a single report block and no sender
+	 * reports to refer to (LSR and DLSR are zero) */
+
+	b = buf;
+	put_header(b, 1, PT_RR, 32);
+	put32(b + 4, r->from);
+	put32(b + 8, r->ssrc);
+	put32(b + 12, (uint32_t)(loss < 1.0 ? loss * 256.0 : 255) << 24
+		| (r->lost & 0xffffff));
+	put32(b + 16, r->seq);
+	put32(b + 20, r->jitter * RTP_TS_RATE);
+	put32(b + 24, 0);
+	put32(b + 28, 0);
+
+	/* Buffer depth, in microseconds */
+
+	b = buf + 32;
+	put_header(b, 0, PT_APP, 16);
+	put32(b + 4, r->from);
+	memcpy(b + 8, APP_NAME, 4);
+	put32(b + 12, depth);
+
+	return REPORT_SIZE;
+}
+
+/*
+ * Parse a report written by report_write(); the buffer depth is
+ * optional. Return -1 if this is not a report
+ */
+
+int report_parse(struct report *r, const unsigned char *buf, size_t len)
+{
+	size_t off;
+
+	if (len < 32 || buf[0] >> 6 != 2 || buf[1] != PT_RR)
+		return -1;
+	if ((buf[0] & 0x1f) < 1)
+		return -1;
+
+	r->from = get32(buf + 4);
+	r->ssrc = get32(buf + 8);
+	r->loss = buf[12] / 256.0;
+	r->lost = get32(buf + 12) & 0xffffff;
+	r->seq = get32(buf + 16);
+	r->jitter = (double)get32(buf + 20) / RTP_TS_RATE;
+	r->depth = 0.0;
+
+	off = ((size_t)buf[2] << 8 | buf[3]) * 4 + 4;
+	if (off + 16 <= len && buf[off + 1] == PT_APP
+		&& !memcmp(buf + off + 8, APP_NAME, 4))
+	{
+		r->depth = get32(buf + off + 12) * 1e-6;
+	}
+
+	return 0;
+}
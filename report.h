@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Reception report from a receiver back to a sender, on the socket
+ * the sender's packets came from: an RTCP receiver report (RFC 3550)
+ * of one block, followed by an application-defined packet giving the
+ * depth of the receiver's jitter buffer
+ */
+
+#define REPORT_INTERVAL 1.0 /* seconds */
+#define REPORT_SIZE 48 /* bytes */
+
+struct report {
+	uint32_t from, ssrc; /* the receiver, and the sender reported on */
+	double loss; /* fraction lost since the previous report */
+	uint32_t lost; /* in total */
+	uint32_t seq; /* highest sequence number received */
+	double jitter, depth; /* seconds */
+};
+
+ssize_t report_write(unsigned char *buf, size_t size, const struct report *r);
+int report_parse(struct report *r, const unsigned char *buf, size_t len);
+
+#endif
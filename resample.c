@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+#include "resample.h"
+
+#define CUTOFF 0.95 /* of Nyquist */
+#define KAISER_BETA 8.0
+
+/* One extra phase so interpolation never reads past the table */
+
+static float coeff[RESAMPLE_PHASES + 1][RESAMPLE_TAPS]
+	__attribute__((aligned(16)));
+static int have_coeff = 0;
+
+static double bessel_i0(double x)
+{
+	int k;
+	double sum = 1.0, term = 1.0;
+
+	for (k = 1; k < 32; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+
+	return sum;
+}
+
+static void make_coeff(void)
+{
+	int p, k;
+
+	for (p = 0; p <= RESAMPLE_PHASES; p++) {
+		double frac, sum = 0.0;
+
+		frac = (double)p / RESAMPLE_PHASES;
+
+		for (k = 0; k < RESAMPLE_TAPS; k++) {
+			double t, w, s, r;
+
+			t = k - (RESAMPLE_TAPS / 2 - 1) - frac;
+			r = t / (RESAMPLE_TAPS / 2);
+			w = (r * r < 1.0)
+				? bessel_i0(KAISER_BETA * sqrt(1.0 - r * r))
+					/ bessel_i0(KAISER_BETA)
+				: 0.0;
+			s = (t == 0.0) ? CUTOFF
+				: sin(M_PI * CUTOFF * t) / (M_PI * t);
+
+			coeff[p][k] = s * w;
+			sum += s * w;
+		}
+
+		/* Unity gain at DC */
+
+		for (k = 0; k < RESAMPLE_TAPS; k++)
+			coeff[p][k] /= sum;
+	}
+
+	have_coeff = 1;
+}
+
+/*
+ * Prepare to accept up to max_in frames per call
+ */
+
+int resample_init(struct resample *rs, unsigned int channels,
+		size_t max_in)
+{
+	if (!have_coeff)
+		make_coeff();
+
+	rs->channels = channels;
+	rs->size = max_in + RESAMPLE_TAPS + 1;
+
+	rs->hist = calloc(rs->size * channels, sizeof *rs->hist);
+	if (rs->hist == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	resample_reset(rs);
+
+	return 0;
+}
+
+void resample_clear(struct resample *rs)
+{
+	free(rs->hist);
+}
+
+void resample_reset(struct resample *rs)
+{
+	/* Start with a history of silence, which sets the delay */
+
+	memset(rs->hist, 0, rs->size * rs->channels * sizeof *rs->hist);
+	rs->fill = RESAMPLE_TAPS - 1;
+	rs->pos = 0.0;
+	rs->ratio = 1.0;
+}
+
+/*
+ * Set the number of input frames consumed per output frame
+ */
+
+void resample_set_ratio(struct resample *rs, double ratio)
+{
+	rs->ratio = ratio;
+}
+
+static inline float dot(const float *x, const float *c)
+{
+#if defined(__SSE__)
+	__m128 acc;
+	float r[4];
+	int k;
+
+	acc = _mm_setzero_ps();
+	for (k = 0; k < RESAMPLE_TAPS; k += 4)
+		acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + k),
+						_mm_load_ps(c + k)));
+	_mm_storeu_ps(r, acc);
+	return (r[0] + r[1]) + (r[2] + r[3]);
+#elif defined(__ARM_NEON)
+	float32x4_t acc;
+	int k;
+
+	acc = vdupq_n_f32(0.0f);
+	for (k = 0; k < RESAMPLE_TAPS; k += 4)
+		acc = vmlaq_f32(acc, vld1q_f32(x + k), vld1q_f32(c + k));
+	return vgetq_lane_f32(acc, 0) + vgetq_lane_f32(acc, 1)
+		+ vgetq_lane_f32(acc, 2) + vgetq_lane_f32(acc, 3);
+#else
+	float sum = 0.0f;
+	int k;
+
+	for (k = 0; k < RESAMPLE_TAPS; k++)
+		sum += x[k] * c[k];
+	return sum;
+#endif
+}
+
+/*
+ * Resample interleaved audio; return the number of frames written,
+ * which varies from call to call with the ratio and the phase
+ */
+
+size_t resample_process(struct resample *rs,
+		const float *in, size_t nin,
+		float *out, size_t max_out)
+{
+	unsigned int c, ch;
+	size_t n, i, o, used;
+	float taps[RESAMPLE_TAPS] __attribute__((aligned(16)));
+
+	ch = rs->channels;
+	if (nin > rs->size - rs->fill)
+		nin = rs->size - rs->fill;
+
+	/* De-interleave into the history */
+
+	for (c = 0; c < ch; c++) {
+		float *h = rs->hist + c * rs->size + rs->fill;
+
+		for (n = 0; n < nin; n++)
+			h[n] = in[n * ch + c];
+	}
+	rs->fill += nin;
+
+	for (o = 0; o < max_out; o++) {
+		double phase, a;
+		int p;
+
+		i = (size_t)rs->pos;
+		if (i + RESAMPLE_TAPS > rs->fill)
+			break;
+
+		phase = (rs->pos - i) * RESAMPLE_PHASES;
+		p = (int)phase;
+		a = phase - p;
+
+		for (n = 0; n < RESAMPLE_TAPS; n++) {
+			taps[n] = coeff[p][n]
+				+ (float)a * (coeff[p + 1][n] - coeff[p][n]);
+		}
+
+		for (c = 0; c < ch; c++)
+			out[o * ch + c] = dot(rs->hist + c * rs->size + i, taps);
+
+		rs->pos += rs->ratio;
+	}
+
+	/* Discard what can no longer be reached */
+
+	used = (size_t)rs->pos;
+	if (used > rs->fill)
+		used = rs->fill;
+
+	for (c = 0; c < ch; c++) {
+		float *h = rs->hist + c * rs->size;
+
+		memmove(h, h + used, (rs->fill - used) * sizeof *h);
+	}
+	rs->fill -= used;
+	rs->pos -= used;
+
+	return o;
+}
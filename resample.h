@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stddef.h>
+
+/*
+ * Fractional resampler for small, continuously varying ratios, eg.
+ * to absorb the drift between two sound card clocks. Windowed sinc
+ * with interpolated polyphase coefficients; audio is planar
+ * internally so the convolution is contiguous
+ */
+
+#define RESAMPLE_TAPS 16
+#define RESAMPLE_PHASES 256
+
+struct resample {
+	unsigned int channels;
+	size_t size, fill; /* frames of history */
+	double ratio, pos;
+	float *hist;
+};
+
+int resample_init(struct resample *rs, unsigned int channels,
+		size_t max_in);
+void resample_clear(struct resample *rs);
+void resample_reset(struct resample *rs);
+
+void resample_set_ratio(struct resample *rs, double ratio);
+size_t resample_process(struct resample *rs,
+		const float *in, size_t nin,
+		float *out, size_t max_out);
+
+#endif
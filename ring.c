@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+#define ALIGN(x, a) (((x) + (a) - 1) & ~((size_t)(a) - 1))
+
+/*
+ * Initialise a ring of at least the given number of slots, rounded
+ * up to a power of two
+ */
+
+int ring_init(struct ring *r, size_t slots, size_t slot_size)
+{
+	size_t n;
+
+	for (n = 1; n < slots; n <<= 1);
+
+	r->slots = n;
+	r->mask = n - 1;
+	r->slot_size = ALIGN(slot_size, RING_CACHELINE);
+
+	if (posix_memalign((void**)&r->buf, RING_CACHELINE,
+				r->slots * r->slot_size) != 0)
+	{
+		perror("posix_memalign");
+		return -1;
+	}
+
+	/* Touch every page now, not on the real-time path */
+
+	memset(r->buf, 0, r->slots * r->slot_size);
+
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->high_water, 0);
+	atomic_init(&r->overruns, 0);
+
+	return 0;
+}
+
+void ring_clear(struct ring *r)
+{
+	free(r->buf);
+}
+
+/*
+ * Return the next slot to be filled by the producer, or NULL if the
+ * ring is full (which is counted as an overrun)
+ */
+
+void* ring_write_slot(struct ring *r)
+{
+	size_t head, tail;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	if (head - tail == r->slots) {
+		atomic_fetch_add_explicit(&r->overruns, 1,
+				memory_order_relaxed);
+		return NULL;
+	}
+
+	return r->buf + (head & r->mask) * r->slot_size;
+}
+
+/*
+ * Return up to max consecutive free slots, for a producer that fills
+ * several at once; none are counted as overruns
+ */
+
+size_t ring_write_slots(struct ring *r, void **slot, size_t max)
+{
+	size_t head, tail, n;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+	for (n = 0; n < max && head + n - tail < r->slots; n++)
+		slot[n] = r->buf + ((head + n) & r->mask) * r->slot_size;
+
+	return n;
+}
+
+void ring_commit(struct ring *r)
+{
+	ring_commit_slots(r, 1);
+}
+
+void ring_commit_slots(struct ring *r, size_t count)
+{
+	size_t head, tail, n;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed) + count;
+	atomic_store_explicit(&r->head, head, memory_order_release);
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	n = head - tail;
+	if (n > atomic_load_explicit(&r->high_water, memory_order_relaxed))
+		atomic_store_explicit(&r->high_water, n, memory_order_relaxed);
+}
+
+/*
+ * Return the oldest committed slot, or NULL if the ring is empty
+ */
+
+void* ring_read_slot(struct ring *r)
+{
+	size_t head, tail;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	if (head == tail)
+		return NULL;
+
+	return r->buf + (tail & r->mask) * r->slot_size;
+}
+
+void ring_release(struct ring *r)
+{
+	size_t tail;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+/*
+ * Number of committed slots; approximate if called from a thread
+ * other than the producer or consumer
+ */
+
+size_t ring_occupancy(struct ring *r)
+{
+	size_t head, tail;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+	return head - tail;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/*
+ * Lock-free single-producer, single-consumer ring of fixed-size
+ * slots. All memory is allocated up front; the producer fills a
+ * slot in place and commits it, the consumer reads it in place and
+ * releases it
+ */
+
+#define RING_CACHELINE 64
+
+struct ring {
+	unsigned char *buf;
+	size_t slots, slot_size, mask;
+
+	_Alignas(RING_CACHELINE) atomic_size_t head; /* written by producer */
+	_Alignas(RING_CACHELINE) atomic_size_t tail; /* written by consumer */
+
+	_Alignas(RING_CACHELINE) atomic_size_t high_water;
+	atomic_ulong overruns;
+};
+
+int ring_init(struct ring *r, size_t slots, size_t slot_size);
+void ring_clear(struct ring *r);
+
+void* ring_write_slot(struct ring *r);
+size_t ring_write_slots(struct ring *r, void **slot, size_t max);
+void ring_commit(struct ring *r);
+void ring_commit_slots(struct ring *r, size_t count);
+
+void* ring_read_slot(struct ring *r);
+void ring_release(struct ring *r);
+
+size_t ring_occupancy(struct ring *r);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <math.h>
+
+#include "rtp.h"
+
+#define EXT_ONE_BYTE 0xbede /* RFC 8285 */
+#define NTP_EPOCH 2208988800 /* seconds from 1900 to 1970 */
+
+static uint16_t get16(const unsigned char *b)
+{
+	return (uint16_t)b[0] << 8 | b[1];
+}
+
+static uint32_t get32(const unsigned char *b)
+{
+	return (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16
+		| (uint32_t)b[2] << 8 | b[3];
+}
+
+static uint64_t get64(const unsigned char *b)
+{
+	return (uint64_t)get32(b) << 32 | get32(b + 4);
+}
+
+static void put16(unsigned char *b, uint16_t v)
+{
+	b[0] = v >> 8;
+	b[1] = v;
+}
+
+static void put32(unsigned char *b, uint32_t v)
+{
+	b[0] = v >> 24;
+	b[1] = v >> 16;
+	b[2] = v >> 8;
+	b[3] = v;
+}
+
+static void put64(unsigned char *b, uint64_t v)
+{
+	put32(b, v >> 32);
+	put32(b + 4, v);
+}
+
+/*
+ * Convert between seconds since 1970 and the NTP timestamp format
+ */
+
+uint64_t rtp_ntp(double t)
+{
+	double s;
+
+	s = floor(t);
+	return (uint64_t)(s + NTP_EPOCH) << 32
+		| (uint32_t)((t - s) * 4294967296.0);
+}
+
+double rtp_unix(uint64_t ntp)
+{
+	return (double)(ntp >> 32) - NTP_EPOCH
+		+ (ntp & 0xffffffff) / 4294967296.0;
+}
+
+/*
+ * Room taken by the header, ahead of the payload
+ */
+
+size_t rtp_header_size(const struct rtp *p)
+{
+	return RTP_HEADER_SIZE + (p->stamped ? RTP_EXT_SIZE : 0);
+}
+
+/*
+ * Write an RTP header (no CSRC, but the capture time if stamped) to
+ * the start of a packet buffer, ahead of a payload already in place
+ */
+
+void rtp_write_header(unsigned char *buf, const struct rtp *p)
+{
+	unsigned char *ext;
+
+	buf[0] = 2 << 6;
+	buf[1] = (p->marker ? 0x80 : 0) | (p->pt & 0x7f);
+	put16(buf + 2, p->seq);
+	put32(buf + 4, p->ts);
+	put32(buf + 8, p->ssrc);
+
+	if (!p->stamped)
+		return;
+
+	/* One element of 8 bytes, padded to a whole word */
+
+	buf[0] |= 0x10;
+	ext = buf + RTP_HEADER_SIZE;
+	put16(ext, EXT_ONE_BYTE);
+	put16(ext + 2, (RTP_EXT_SIZE - 4) / 4);
+	ext[4] = RTP_EXT_CAPTURE_TIME << 4 | (8 - 1);
+	put64(ext + 5, p->stamp);
+	ext[13] = ext[14] = ext[15] = 0;
+}
+
+/*
+ * Find the capture time amongst RFC 8285 one-byte elements; others
+ * are ignored
+ */
+
+static void parse_extension(struct rtp *p, const unsigned char *b,
+		size_t len)
+{
+	size_t n = 0, z;
+	unsigned int id;
+
+	while (n < len) {
+		if (b[n] == 0) { /* padding */
+			n++;
+			continue;
+		}
+
+		id = b[n] >> 4;
+		z = (b[n] & 0xf) + 1;
+		if (id == 15 || n + 1 + z > len)
+			return;
+
+		if (id == RTP_EXT_CAPTURE_TIME && z >= 8) {
+			p->stamped = true;
+			p->stamp = get64(b + n + 1);
+		}
+
+		n += 1 + z;
+	}
+}
+
+/*
+ * Parse an RTP packet (RFC 3550) in place; the payload points into
+ * the given buffer. Return -1 if the packet is malformed
+ */
+
+int rtp_parse(struct rtp *p, const unsigned char *buf, size_t len)
+{
+	size_t off;
+	unsigned int cc;
+
+	if (len < RTP_HEADER_SIZE)
+		return -1;
+	if (buf[0] >> 6 != 2)
+		return -1;
+
+	cc = buf[0] & 0xf;
+	p->marker = buf[1] >> 7;
+	p->pt = buf[1] & 0x7f;
+	p->seq = get16(buf + 2);
+	p->ts = get32(buf + 4);
+	p->ssrc = get32(buf + 8);
+
+	off = RTP_HEADER_SIZE + cc * 4;
+	if (off > len)
+		return -1;
+
+	p->stamped = false;
+
+	if (buf[0] & 0x10) { /* extension */
+		size_t z;
+
+		if (off + 4 > len)
+			return -1;
+		z = get16(buf + off + 2) * 4;
+		if (off + 4 + z > len)
+			return -1;
+		if (get16(buf + off) == EXT_ONE_BYTE)
+			parse_extension(p, buf + off + 4, z);
+		off += 4 + z;
+	}
+
+	if (buf[0] & 0x20) { /* padding */
+		unsigned int pad;
+
+		pad = buf[len - 1];
+		if (pad == 0 || off + pad > len)
+			return -1;
+		len -= pad;
+	}
+
+	p->payload = buf + off;
+	p->len = len - off;
+
+	return 0;
+}
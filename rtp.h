@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef RTP_H
+#define RTP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RTP_HEADER_SIZE 12
+
+/* Follow the RFC, payload 0 has 8kHz reference rate */
+
+#define RTP_PT_OPUS 0
+#define RTP_PT_RED 96 /* RFC 2198, dynamic */
+#define RTP_TS_RATE 8000
+
+/* The capture time of the audio, as an RFC 8285 one-byte header
+ * extension; its 64-bit NTP format is that of abs-capture-time */
+
+#define RTP_EXT_CAPTURE_TIME 1
+#define RTP_EXT_SIZE 16
+
+struct rtp {
+	unsigned int pt, marker;
+	uint16_t seq;
+	uint32_t ts, ssrc;
+
+	bool stamped;
+	uint64_t stamp;
+
+	const unsigned char *payload;
+	size_t len;
+};
+
+int rtp_parse(struct rtp *p, const unsigned char *buf, size_t len);
+size_t rtp_header_size(const struct rtp *p);
+void rtp_write_header(unsigned char *buf, const struct rtp *p);
+
+uint64_t rtp_ntp(double t);
+double rtp_unix(uint64_t ntp);
+
+#endif
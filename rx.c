@@ -17,133 +17,1116 @@
  *
  */
 
+#include <math.h>
 #include <netdb.h>
+#include <poll.h>
 #include <string.h>
 #include <alsa/asoundlib.h>
-#include <opus/opus.h>
-#include <ortp/ortp.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
 
+#include "batch.h"
+#include "codec.h"
 #include "defaults.h"
 #include "device.h"
+#include "format.h"
+#include "impair.h"
+#include "jitter.h"
+#include "mix.h"
+#include "net.h"
 #include "notice.h"
+#include "pcap.h"
+#include "report.h"
+#include "ring.h"
+#include "rtp.h"
+#include "source.h"
+#include "stats.h"
+#include "tripwire.h"
 #include "trx-sched.h"
+#include "wallclock.h"
+#include "wav.h"
 
-static unsigned int verbose = DEFAULT_VERBOSE;
+#define STATS_INTERVAL 10 /* seconds */
+#define RECEIVE_QUEUE 64 /* packets */
+#define RECEIVE_BATCH 16 /* packets per system call */
+#define MAX_PORTS 16
+#define SOURCE_TIMEOUT 5.0 /* seconds before a silent sender is dropped */
+#define FILE_PAUSE 100000 /* ns, waiting on the network */
+#define UNPACED_IDLE 0.5 /* seconds without packets to end the stream */
+#define MAX_FRAME 0.12 /* seconds, the longest Opus packet */
+#define IMPAIR_SLOTS 256 /* packets held back by an impairment */
 
-static void timestamp_jump(RtpSession *session, void *a, void *b, void *c)
+unsigned int verbose = DEFAULT_VERBOSE;
+
+/*
+ * The receiver runs two threads: one takes packets from the network,
+ * with the time the kernel received them, the other owns the jitter
+ * buffers and feeds the sound card. They are joined by a ring of raw
+ * packets.
+ *
+ * Each sender (by port and SSRC) is a source with its own jitter
+ * buffer, decoder and drift compensation. Sources decode into their
+ * own queue of audio, from which fixed-size blocks are mixed. Once a
+ * second each sender is sent a report of how its packets arrive
+ */
+
+struct packet {
+	size_t len;
+	unsigned int port;
+	double arrival;
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	unsigned char data[JITTER_MAX_PACKET];
+};
+
+struct rx {
+	int sock[MAX_PORTS];
+	unsigned int nsock, port[MAX_PORTS];
+	snd_pcm_t *snd;
+	unsigned int channels, rate;
+	snd_pcm_uframes_t block;
+
+	struct ring ring;
+	atomic_int failed;
+	atomic_ulong unrouted, packets, calls, wait_us, xruns, recovers;
+
+	struct source *source;
+	unsigned int nsource;
+	float gain[MAX_PORTS];
+
+	bool report;
+	uint32_t ssrc; /* our own, as the author of reports */
+	struct batch reports;
+
+	bool mmap;
+	float *mix;
+	void *out;
+	snd_pcm_format_t format;
+
+	/* Or a file in place of the device, written in time with the
+	 * clock; unpaced, time is the audio written so far */
+
+	bool to_file, unpaced, heard, idle;
+	struct wav file;
+	uint64_t epoch;
+	unsigned long nwritten;
+	double clock, newest;
+	atomic_int finished;
+
+	/* Or a capture in place of the network, replayed in its own
+	 * time scaled by the speed */
+
+	bool replaying;
+	struct pcap_reader pcap;
+	double speed;
+	atomic_int replayed;
+
+	/* Optional bad network, between the ring and the sources */
+
+	bool impairing;
+	struct impair impair;
+
+	/* Optional copy of packets received */
+
+	bool teeing;
+	struct pcap_tee tee;
+	struct sockaddr_storage local[MAX_PORTS];
+
+	/* Packets stamped with their capture time give the one-way
+	 * delay, if they arrive in real time */
+
+	bool timing;
+	struct wallclock wall;
+	double offset; /* from the monotonic clock */
+
+	int receive_cpu, receive_priority,
+		playback_cpu, playback_priority;
+
+	struct hist arrival_jitter, depth, decode, alsa_delay, one_way;
+};
+
+static double now(void)
 {
-	if (verbose > 1)
-		fputc('|', stderr);
-	rtp_session_resync(session);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-static RtpSession* create_rtp_recv(const char *addr_desc, const int port,
-		unsigned int jitter)
+/*
+ * Time of arrival from the kernel's timestamp, moved onto the
+ * monotonic clock using the time the packet spent in the socket
+ */
+
+static double arrival_time(struct rx *rx, struct msghdr *msg,
+		const struct timespec *real, double mono)
 {
-	RtpSession *session;
-
-	session = rtp_session_new(RTP_SESSION_RECVONLY);
-	rtp_session_set_scheduling_mode(session, FALSE);
-	rtp_session_set_blocking_mode(session, FALSE);
-	rtp_session_set_local_addr(session, addr_desc, port, -1);
-	rtp_session_set_connected_mode(session, FALSE);
-	rtp_session_enable_adaptive_jitter_compensation(session, TRUE);
-	rtp_session_set_jitter_compensation(session, jitter); /* ms */
-	rtp_session_set_time_jump_limit(session, jitter * 16); /* ms */
-	if (rtp_session_set_payload_type(session, 0) != 0)
-		abort();
-	if (rtp_session_signal_connect(session, "timestamp_jump",
-                                       (RtpCallback)timestamp_jump, 0) != 0)
-	{
-		abort();
+	double wait;
+	unsigned long us;
+
+	wait = net_waited(msg, real);
+	if (wait < 0.0)
+		return mono;
+
+	us = wait * 1e6;
+	if (us > atomic_load_explicit(&rx->wait_us, memory_order_relaxed))
+		atomic_store_explicit(&rx->wait_us, us, memory_order_relaxed);
+
+	return mono - wait;
+}
+
+/*
+ * Copy a packet received to the capture, stamped with the time the
+ * kernel took it
+ */
+
+static void tee(struct rx *rx, struct msghdr *msg,
+		const struct timespec *real, const struct packet *p)
+{
+	struct timespec ts;
+
+	if (net_stamp(msg, &ts) == -1)
+		ts = *real;
+
+	pcap_tee_add(&rx->tee, 0, &ts, (const struct sockaddr*)&p->from,
+		(const struct sockaddr*)&rx->local[p->port], p->data, p->len);
+}
+
+/*
+ * Take every packet waiting on a socket, up to a batch at a time,
+ * straight into the ring
+ */
+
+static int receive_batch(struct rx *rx, unsigned int port,
+		struct packet *scratch)
+{
+	int z, n;
+	size_t max;
+	void *slot[RECEIVE_BATCH];
+	struct mmsghdr msg[RECEIVE_BATCH];
+	struct iovec iov[RECEIVE_BATCH];
+	char control[RECEIVE_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+	struct timespec real;
+	double mono;
+
+	max = ring_write_slots(&rx->ring, slot, RECEIVE_BATCH);
+
+	/* If the ring is full the packet is lost, but the socket
+	 * must still be drained */
+
+	if (max == 0) {
+		ring_write_slot(&rx->ring); /* counts the overrun */
+		z = recv(rx->sock[port], scratch->data, sizeof scratch->data,
+				MSG_DONTWAIT);
+		if (z == -1 && errno != EINTR && errno != EAGAIN) {
+			perror("recv");
+			return -1;
+		}
+		return z > 0;
+	}
+
+	memset(msg, 0, sizeof(*msg) * max);
+	for (n = 0; n < (int)max; n++) {
+		struct packet *p = slot[n];
+
+		iov[n].iov_base = p->data;
+		iov[n].iov_len = sizeof p->data;
+		msg[n].msg_hdr.msg_name = &p->from;
+		msg[n].msg_hdr.msg_namelen = sizeof p->from;
+		msg[n].msg_hdr.msg_iov = &iov[n];
+		msg[n].msg_hdr.msg_iovlen = 1;
+		msg[n].msg_hdr.msg_control = control[n];
+		msg[n].msg_hdr.msg_controllen = sizeof control[n];
+	}
+
+	z = recvmmsg(rx->sock[port], msg, max, MSG_DONTWAIT, NULL);
+	if (z == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		perror("recvmmsg");
+		return -1;
+	}
+
+	/* One reading of each clock serves the whole batch */
+
+	clock_gettime(CLOCK_REALTIME, &real);
+	mono = now();
+
+	for (n = 0; n < z; n++) {
+		struct packet *p = slot[n];
+
+		p->len = msg[n].msg_len;
+		p->port = port;
+		p->from_len = msg[n].msg_hdr.msg_namelen;
+		p->arrival = arrival_time(rx, &msg[n].msg_hdr, &real, mono);
+
+		if (rx->teeing)
+			tee(rx, &msg[n].msg_hdr, &real, p);
 	}
 
-	/*
-	 * oRTP in RECVONLY mode attempts to send RTCP packets and
-	 * segfaults (v4.3.0 tested)
-	 *
-	 * https://stackoverflow.com/questions/43591690/receiving-rtcp-issues-within-ortp-library
-	 */
+	ring_commit_slots(&rx->ring, z);
 
-	rtp_session_enable_rtcp(session, FALSE);
+	atomic_fetch_add_explicit(&rx->packets, z, memory_order_relaxed);
+	atomic_fetch_add_explicit(&rx->calls, 1, memory_order_relaxed);
 
-	return session;
+	return z;
 }
 
-static int play_one_frame(void *packet,
-		size_t len,
-		OpusDecoder *decoder,
-		snd_pcm_t *snd,
-		const unsigned int channels)
+static void* receive_main(void *arg)
 {
+	struct rx *rx = arg;
+	struct packet scratch;
+	struct pollfd pe[MAX_PORTS];
+	unsigned int n;
 	int r;
-	int16_t *pcm;
-	snd_pcm_sframes_t f, samples = 1920;
 
-	pcm = alloca(sizeof(*pcm) * samples * channels);
+	go_realtime_thread(rx->receive_priority, rx->receive_cpu);
 
-	if (packet == NULL) {
-		r = opus_decode(decoder, NULL, 0, pcm, samples, 1);
-	} else {
-		r = opus_decode(decoder, packet, len, pcm, samples, 0);
+	for (n = 0; n < rx->nsock; n++) {
+		pe[n].fd = rx->sock[n];
+		pe[n].events = POLLIN;
+	}
+
+	while (!atomic_load(&rx->failed)) {
+		tripwire_step();
+
+		if (poll(pe, rx->nsock, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			atomic_store(&rx->failed, 1);
+			break;
+		}
+
+		for (n = 0; n < rx->nsock; n++) {
+			if (!(pe[n].revents & POLLIN))
+				continue;
+
+			/* Drain the socket; a full batch may mean
+			 * there are more packets waiting */
+
+			while ((r = receive_batch(rx, n, &scratch))
+					== RECEIVE_BATCH);
+
+			if (r == -1) {
+				atomic_store(&rx->failed, 1);
+				break;
+			}
+		}
 	}
-	if (r < 0) {
-		fprintf(stderr, "opus_decode: %s\n", opus_strerror(r));
+
+	tripwire_disarm();
+
+	return NULL;
+}
+
+/*
+ * The port a datagram of the capture was sent to, as an index to our
+ * own; nsock if it is not one of them
+ */
+
+static unsigned int replay_port(struct rx *rx,
+		const struct sockaddr_storage *dst)
+{
+	unsigned int n, port;
+
+	/* In the same place for either family */
+
+	port = ntohs(((const struct sockaddr_in*)dst)->sin_port);
+
+	for (n = 0; n < rx->nsock; n++) {
+		if (rx->port[n] == port)
+			break;
+	}
+
+	return n;
+}
+
+/*
+ * Feed the ring from a capture in place of the network. Each packet
+ * arrives at the time it was first received, relative to the first
+ * and scaled by the speed. Unpaced, it is the clock of the audio
+ * written which catches up, so the ring is never overrun
+ */
+
+static void* replay_main(void *arg)
+{
+	struct rx *rx = arg;
+	struct pcap_datagram d;
+	struct packet *p;
+	struct timespec ts, pause = { 0, FILE_PAUSE };
+	double first = -1.0, t;
+	uint64_t start, due;
+	unsigned int port;
+	int r;
+
+	go_realtime_thread(rx->receive_priority, rx->receive_cpu);
+
+	start = stats_now();
+
+	while (!atomic_load(&rx->failed)) {
+		tripwire_step();
+
+		r = pcap_next(&rx->pcap, &d);
+		if (r == -1) {
+			atomic_store(&rx->failed, 1);
+			break;
+		}
+		if (r == 0)
+			break;
+
+		port = replay_port(rx, &d.dst);
+		if (port == rx->nsock || d.len > JITTER_MAX_PACKET)
+			continue;
+
+		t = d.ts.tv_sec + d.ts.tv_nsec * 1e-9;
+		if (first < 0.0)
+			first = t;
+		t = (t - first) / rx->speed;
+
+		if (rx->unpaced) {
+			while (ring_write_slots(&rx->ring, (void**)&p, 1) == 0
+					&& !atomic_load(&rx->failed))
+			{
+				nanosleep(&pause, NULL);
+			}
+		} else {
+			due = start + (uint64_t)(t * 1e9);
+			ts.tv_sec = due / 1000000000;
+			ts.tv_nsec = due % 1000000000;
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					&ts, NULL) == EINTR);
+
+			p = ring_write_slot(&rx->ring);
+			if (p == NULL)
+				continue;
+		}
+
+		if (atomic_load(&rx->failed))
+			break;
+
+		memcpy(p->data, d.data, d.len);
+		p->len = d.len;
+		p->port = port;
+		p->arrival = rx->unpaced ? t : now();
+
+		memcpy(&p->from, &d.src, sizeof d.src);
+		p->from_len = d.src.ss_family == AF_INET6 ?
+			sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+		ring_commit(&rx->ring);
+		atomic_fetch_add_explicit(&rx->packets, 1, memory_order_relaxed);
+	}
+
+	tripwire_disarm();
+	atomic_store(&rx->replayed, 1);
+
+	return NULL;
+}
+
+/*
+ * Find the source for a packet, taking on a new sender if there is
+ * room
+ */
+
+static struct source* route(struct rx *rx, const struct packet *p,
+		const struct rtp *h)
+{
+	unsigned int n;
+	uint32_t ssrc = h->ssrc;
+	double t = rx->unpaced ? rx->clock : p->arrival;
+	struct source *s, *spare = NULL;
+
+	for (n = 0; n < rx->nsource; n++) {
+		s = &rx->source[n];
+
+		if (!s->active) {
+			if (spare == NULL)
+				spare = s;
+			continue;
+		}
+
+		if (s->port == p->port && s->ssrc == ssrc) {
+			s->seen = t;
+			return s;
+		}
+	}
+
+	if (spare == NULL)
+		return NULL;
+
+	source_reset(spare);
+	spare->active = true;
+	spare->port = p->port;
+	spare->ssrc = ssrc;
+	spare->seen = t;
+	spare->reported = t;
+	spare->origin = t;
+	spare->origin_ts = h->ts;
+	spare->gain = rx->gain[p->port];
+	spare->last = rx->block;
+
+	memcpy(&spare->from, &p->from, p->from_len);
+	spare->from_len = p->from_len;
+
+	rx->heard = true;
+
+	if (verbose > 0)
+		fprintf(stderr, "source %08x on port %u\n", ssrc, p->port);
+
+	return spare;
+}
+
+/*
+ * Unpaced, a packet arrives when its timestamp says, as if over a
+ * perfect network
+ */
+
+static double unpaced_arrival(struct rx *rx, struct source *s,
+		const struct rtp *h)
+{
+	double t;
+
+	t = s->origin + (int32_t)(h->ts - s->origin_ts) / (double)RTP_TS_RATE;
+	if (t > rx->newest)
+		rx->newest = t;
+
+	return t;
+}
+
+/*
+ * Give a packet to the jitter buffer of its source
+ */
+
+static void take_packet(struct rx *rx, struct packet *p)
+{
+	struct rtp h;
+	struct source *s;
+
+	if (rx->replaying && p->arrival > rx->newest)
+		rx->newest = p->arrival;
+
+	if (rtp_parse(&h, p->data, p->len) != 0)
+		return;
+
+	s = route(rx, p, &h);
+	if (s == NULL) {
+		atomic_fetch_add_explicit(&rx->unrouted, 1,
+				memory_order_relaxed);
+		return;
+	}
+
+	if (rx->unpaced && !rx->replaying)
+		p->arrival = unpaced_arrival(rx, s, &h);
+	source_put(s, &h, p->arrival);
+
+	if (rx->timing && h.stamped) {
+		s->stamped = true;
+		s->transit = p->arrival + rx->offset - rtp_unix(h.stamp);
+	}
+}
+
+/*
+ * Take the packets waiting in the ring. Impaired, they go through
+ * the impairment instead, and arrive when it lets them
+ */
+
+static void take_packets(struct rx *rx)
+{
+	struct packet *p;
+	double t, due;
+
+	while ((p = ring_read_slot(&rx->ring)) != NULL) {
+		/* Replayed unpaced, a packet waits for the clock */
+
+		if (rx->replaying && rx->unpaced && p->arrival > rx->clock)
+			break;
+
+		if (rx->impairing)
+			impair_put(&rx->impair, p->arrival, p);
+		else
+			take_packet(rx, p);
+
+		ring_release(&rx->ring);
+	}
+
+	if (!rx->impairing)
+		return;
+
+	t = rx->unpaced ? rx->clock : now();
+	while ((p = impair_get(&rx->impair, t, &due)) != NULL) {
+		p->arrival = due;
+		take_packet(rx, p);
+	}
+}
+
+/*
+ * Tell each sender how its packets are arriving, so that it can
+ * adapt to the path
+ */
+
+static void send_reports(struct rx *rx, double t)
+{
+	unsigned int n;
+	unsigned char *buf;
+	ssize_t z;
+	struct report r;
+
+	for (n = 0; n < rx->nsource; n++) {
+		struct source *s = &rx->source[n];
+
+		if (!s->active || t - s->reported < REPORT_INTERVAL)
+			continue;
+		if (s->from_len == 0 || s->from.ss_family != rx->reports.family)
+			continue;
+
+		s->reported = t;
+		source_report(s, &r);
+		r.from = rx->ssrc;
+
+		buf = batch_next(&rx->reports);
+		z = report_write(buf, rx->reports.size, &r);
+		if (z != -1)
+			batch_commit(&rx->reports, &s->from, s->from_len, z);
+	}
+
+	if (rx->reports.n > 0)
+		batch_flush(&rx->reports);
+}
+
+static int recover(struct rx *rx, int err)
+{
+	if (err == -EPIPE)
+		atomic_fetch_add_explicit(&rx->xruns, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&rx->recovers, 1, memory_order_relaxed);
+
+	err = snd_pcm_recover(rx->snd, err, 0);
+	if (err < 0) {
+		aerror("snd_pcm_recover", err);
 		return -1;
 	}
 
-	f = snd_pcm_writei(snd, pcm, r);
-	if (f < 0) {
-		f = snd_pcm_recover(snd, f, 0);
-		if (f < 0) {
-			aerror("snd_pcm_writei", f);
-			return -1;
+	return 0;
+}
+
+/*
+ * With mmap access the mix is converted straight into the device's
+ * buffer, in up to two parts if it wraps around the end
+ */
+
+static int write_block_mmap(struct rx *rx)
+{
+	int r;
+	const float *in = rx->mix;
+	snd_pcm_uframes_t left = rx->block;
+
+	while (left > 0) {
+		const snd_pcm_channel_area_t *area;
+		snd_pcm_uframes_t offset, frames;
+		snd_pcm_sframes_t avail;
+		char *out;
+
+		avail = snd_pcm_avail_update(rx->snd);
+		if (avail < 0) {
+			if (recover(rx, avail) == -1)
+				return -1;
+			continue;
 		}
-		return 0;
+
+		if (avail == 0) {
+			/* A full buffer starts the device, as it would
+			 * with snd_pcm_writei() */
+
+			if (snd_pcm_state(rx->snd) == SND_PCM_STATE_PREPARED)
+				r = snd_pcm_start(rx->snd);
+			else
+				r = snd_pcm_wait(rx->snd, -1);
+			if (r < 0 && recover(rx, r) == -1)
+				return -1;
+			continue;
+		}
+
+		frames = (snd_pcm_uframes_t)avail < left ? avail : left;
+		r = snd_pcm_mmap_begin(rx->snd, &area, &offset, &frames);
+		if (r < 0) {
+			if (recover(rx, r) == -1)
+				return -1;
+			continue;
+		}
+
+		out = (char*)area[0].addr
+			+ (area[0].first + offset * area[0].step) / 8;
+		format_store(out, rx->format, in, frames * rx->channels);
+
+		avail = snd_pcm_mmap_commit(rx->snd, offset, frames);
+		if (avail < 0 || (snd_pcm_uframes_t)avail != frames) {
+			if (recover(rx, avail >= 0 ? -EPIPE : avail) == -1)
+				return -1;
+			continue;
+		}
+
+		in += frames * rx->channels;
+		left -= frames;
 	}
-	if (f < r)
+
+	return 0;
+}
+
+static int write_block(struct rx *rx)
+{
+	snd_pcm_sframes_t f;
+
+	format_store(rx->out, rx->format, rx->mix, rx->block * rx->channels);
+
+	f = snd_pcm_writei(rx->snd, rx->out, rx->block);
+	if (f < 0)
+		return recover(rx, f);
+	if (f < rx->block)
 		fprintf(stderr, "Short write %ld\n", f);
 
-	return r;
+	return 0;
 }
 
-static int run_rx(RtpSession *session,
-		OpusDecoder *decoder,
-		snd_pcm_t *snd,
-		const unsigned int channels,
-		const unsigned int rate)
+static int write_block_file(struct rx *rx)
 {
-	int ts = 0;
+	uint64_t t;
+	struct timespec ts;
 
-	for (;;) {
-		int r, have_more;
-		char buf[32768];
-		void *packet;
-
-		r = rtp_session_recv_with_ts(session, (uint8_t*)buf,
-				sizeof(buf), ts, &have_more);
-		assert(r >= 0);
-		assert(have_more == 0);
-		if (r == 0) {
-			packet = NULL;
-			if (verbose > 1)
-				fputc('#', stderr);
-		} else {
-			packet = buf;
-			if (verbose > 1)
-				fputc('.', stderr);
+	format_store(rx->out, rx->format, rx->mix, rx->block * rx->channels);
+	if (wav_write(&rx->file, rx->out, rx->block) == -1)
+		return -1;
+
+	if (rx->nwritten == 0)
+		rx->epoch = stats_now();
+	rx->nwritten += rx->block;
+
+	if (rx->unpaced) {
+		rx->clock = (double)rx->nwritten / rx->rate;
+		return 0;
+	}
+
+	/* The clock sets the pace, as a sound card would */
+
+	t = rx->epoch + (uint64_t)rx->nwritten * 1000000000 / rx->rate;
+	ts.tv_sec = t / 1000000000;
+	ts.tv_nsec = t % 1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+			== EINTR);
+
+	return 0;
+}
+
+/*
+ * Unpaced, a block is mixed once packets have arrived to cover it,
+ * or once the senders have gone quiet, which ends the stream
+ */
+
+static void wait_for_packets(struct rx *rx)
+{
+	uint64_t since;
+	struct timespec pause = { 0, FILE_PAUSE };
+
+	since = stats_now();
+
+	while (!atomic_load(&rx->failed)) {
+		if (ring_occupancy(&rx->ring) > 0) {
+			take_packets(rx);
+			rx->idle = false;
+			since = stats_now();
+		}
+
+		if (rx->newest >= rx->clock || rx->idle)
+			return;
+
+		/* Until the first sender, there is nothing to play */
+
+		if (rx->heard && stats_now() - since > UNPACED_IDLE * 1e9) {
+			rx->idle = true;
+			return;
+		}
+
+		nanosleep(&pause, NULL);
+	}
+}
+
+/*
+ * Unpaced from a capture, a block is mixed once every packet up to
+ * the clock has been taken, or the capture has ended
+ */
+
+static void wait_for_replay(struct rx *rx)
+{
+	int ended;
+	struct timespec pause = { 0, FILE_PAUSE };
+
+	while (!atomic_load(&rx->failed)) {
+		ended = atomic_load(&rx->replayed);
+
+		take_packets(rx);
+		if (ring_occupancy(&rx->ring) > 0)
+			return; /* the next is beyond the clock */
+
+		if (ended) {
+			rx->idle = true;
+			return;
+		}
+
+		nanosleep(&pause, NULL);
+	}
+}
+
+/*
+ * Mouth to ear, for the latest stamped packet: from its capture to
+ * its arrival, then its wait in the jitter buffer, the source's
+ * queue of decoded audio and the device
+ */
+
+static void one_way(struct rx *rx, struct source *s, double device)
+{
+	double d;
+
+	d = s->transit + s->jb.level + (double)s->fill / s->rate + device;
+	if (d < 0.0)
+		return; /* the clocks are not in step */
+
+	hist_add(&rx->one_way, d * 1e9);
+	atomic_store_explicit(&s->one_way_us, d * 1e6, memory_order_relaxed);
+}
+
+/*
+ * Mix and play a block; return 1 if unpaced and every sender has
+ * been and gone, or the capture has been played out
+ */
+
+static int mix_one_block(struct rx *rx)
+{
+	unsigned int n;
+	size_t samples;
+	double device = 0.0, t, drain = 0.0;
+	snd_pcm_sframes_t delay;
+	bool playing = false;
+
+	if (rx->timing)
+		rx->offset = wallclock_offset(&rx->wall);
+
+	if (rx->unpaced && rx->replaying)
+		wait_for_replay(rx);
+	else if (rx->unpaced)
+		wait_for_packets(rx);
+	else if (rx->replaying && atomic_load(&rx->replayed))
+		rx->idle = true;
+	take_packets(rx);
+
+	if (!rx->to_file && snd_pcm_delay(rx->snd, &delay) == 0) {
+		device = (double)delay / rx->rate;
+		hist_add(&rx->alsa_delay, device * 1e9);
+	}
+
+	samples = rx->block * rx->channels;
+	memset(rx->mix, 0, sizeof(*rx->mix) * samples);
+	t = rx->unpaced ? rx->clock : now();
+
+	for (n = 0; n < rx->nsource; n++) {
+		struct source *s = &rx->source[n];
+
+		if (!s->active)
+			continue;
+
+		if ((!s->jb.started || s->jb.dtx)
+			&& t - s->seen > SOURCE_TIMEOUT)
+		{
+			if (verbose > 0)
+				fprintf(stderr, "source %08x gone\n", s->ssrc);
+			source_reset(s);
+			continue;
 		}
 
-		r = play_one_frame(packet, r, decoder, snd, channels);
+		if (source_fill(s, rx->block, device) == -1)
+			return -1;
+
+		if (s->jb.playing)
+			hist_add(&rx->depth, s->jb.level * 1e9);
+		if (s->stamped)
+			one_way(rx, s, device);
+
+		source_mix(s, rx->mix, rx->block);
+		playing = true;
+
+		if (jitter_target(&s->jb) > drain)
+			drain = jitter_target(&s->jb);
+	}
+
+	/* Unpaced, the stream ends when the senders have gone, or
+	 * gone quiet (or the capture ended) and their last packets
+	 * have been played */
+
+	if (rx->unpaced && rx->heard && !playing)
+		return 1;
+	if (rx->idle && t > rx->newest + drain + MAX_FRAME
+		&& (!rx->impairing || rx->impair.held == 0))
+	{
+		return 1;
+	}
+
+	mix_limit(rx->mix, samples);
+
+	if (rx->report)
+		send_reports(rx, t);
+
+	if (rx->to_file)
+		return write_block_file(rx);
+	else if (rx->mmap)
+		return write_block_mmap(rx);
+	else
+		return write_block(rx);
+}
+
+static void* playback_main(void *arg)
+{
+	struct rx *rx = arg;
+
+	go_realtime_thread(rx->playback_priority, rx->playback_cpu);
+
+	while (!atomic_load(&rx->failed)) {
+		int r;
+
+		tripwire_step();
+
+		r = mix_one_block(rx);
 		if (r == -1)
+			break;
+		if (r == 1) {
+			atomic_store(&rx->finished, 1);
+			break;
+		}
+	}
+
+	tripwire_disarm();
+	atomic_store(&rx->failed, 1);
+
+	return NULL;
+}
+
+static void print_jitter_stats(struct rx *rx)
+{
+	unsigned int n;
+
+	for (n = 0; n < rx->nsource; n++) {
+		struct source *src = &rx->source[n];
+		struct jitter_stats *s = &src->jb.stats;
+
+		if (!src->active)
+			continue;
+
+		fprintf(stderr, "source %08x: depth %.1fms, target %.1fms "
+			"(jitter %.1fms), "
+			"%lu received, %lu lost, %lu late, %lu duplicate, "
+			"%lu recovered, %lu fec, %lu plc, %lu dtx, "
+			"%lu inserted, %lu dropped, %lu resets, "
+			"drift %+.1fppm, one-way %.1fms\n",
+			src->ssrc,
+			atomic_load(&s->depth_us) / 1000.0,
+			atomic_load(&s->target_us) / 1000.0,
+			atomic_load(&s->jitter_us) / 1000.0,
+			atomic_load(&s->received), atomic_load(&s->lost),
+			atomic_load(&s->late), atomic_load(&s->duplicate),
+			atomic_load(&s->recovered), atomic_load(&src->fec),
+			atomic_load(&src->plc), atomic_load(&s->dtx),
+			atomic_load(&s->inserted),
+			atomic_load(&s->dropped), atomic_load(&s->resets),
+			atomic_load(&src->drift_ppb) / 1000.0,
+			atomic_load(&src->one_way_us) / 1000.0);
+	}
+
+	fprintf(stderr, "receive: %lu packets in %lu calls, "
+		"%.1fms longest in socket, "
+		"%lu overruns, %lu from too many senders; "
+		"playback: %lu xruns, %lu recoveries\n",
+		atomic_load(&rx->packets), atomic_load(&rx->calls),
+		atomic_exchange(&rx->wait_us, 0) / 1000.0,
+		atomic_load(&rx->ring.overruns), atomic_load(&rx->unrouted),
+		atomic_load(&rx->xruns), atomic_load(&rx->recovers));
+}
+
+/*
+ * Make the pipeline's timings and counters available to stats_serve()
+ */
+
+static int register_stats(struct rx *rx)
+{
+	unsigned int n;
+	char name[32];
+
+	atomic_init(&rx->unrouted, 0);
+	atomic_init(&rx->packets, 0);
+	atomic_init(&rx->calls, 0);
+	atomic_init(&rx->wait_us, 0);
+	atomic_init(&rx->xruns, 0);
+	atomic_init(&rx->recovers, 0);
+
+	hist_init(&rx->arrival_jitter);
+	hist_init(&rx->depth);
+	hist_init(&rx->decode);
+	hist_init(&rx->alsa_delay);
+	hist_init(&rx->one_way);
+
+	if (stats_add_hist("rx.arrival_jitter", &rx->arrival_jitter) == -1
+		|| stats_add_hist("rx.buffer_depth", &rx->depth) == -1
+		|| stats_add_hist("rx.decode", &rx->decode) == -1
+		|| stats_add_hist("rx.alsa_delay", &rx->alsa_delay) == -1
+		|| stats_add_hist("rx.one_way", &rx->one_way) == -1
+		|| stats_add_counter("rx.xruns", &rx->xruns) == -1
+		|| stats_add_counter("rx.recovers", &rx->recovers) == -1
+		|| stats_add_counter("rx.overruns", &rx->ring.overruns) == -1
+		|| stats_add_counter("rx.unrouted", &rx->unrouted) == -1)
+	{
+		return -1;
+	}
+
+	if (rx->report
+		&& stats_add_counter("rx.reports", &rx->reports.packets) == -1)
+	{
+		return -1;
+	}
+
+	if (rx->impairing) {
+		struct impair *m = &rx->impair;
+
+		if (stats_add_counter("rx.impair.lost", &m->lost) == -1
+			|| stats_add_counter("rx.impair.duplicated",
+				&m->duplicated) == -1
+			|| stats_add_counter("rx.impair.reordered",
+				&m->reordered) == -1
+			|| stats_add_counter("rx.impair.overflows",
+				&m->overflows) == -1)
+		{
 			return -1;
+		}
+	}
 
-		/* Follow the RFC, payload 0 has 8kHz reference rate */
+	for (n = 0; n < rx->nsource; n++) {
+		struct source *s = &rx->source[n];
+		struct jitter_stats *j = &s->jb.stats;
 
-		ts += r * 8000 / rate;
+		snprintf(name, sizeof name, "source%u.fec", n);
+		if (stats_add_counter(name, &s->fec) == -1)
+			return -1;
+		snprintf(name, sizeof name, "source%u.plc", n);
+		if (stats_add_counter(name, &s->plc) == -1)
+			return -1;
+		snprintf(name, sizeof name, "source%u.lost", n);
+		if (stats_add_counter(name, &j->lost) == -1)
+			return -1;
+		snprintf(name, sizeof name, "source%u.late", n);
+		if (stats_add_counter(name, &j->late) == -1)
+			return -1;
+		snprintf(name, sizeof name, "source%u.one_way_us", n);
+		if (stats_add_counter(name, &s->one_way_us) == -1)
+			return -1;
+		snprintf(name, sizeof name, "source%u.dtx", n);
+		if (stats_add_counter(name, &j->dtx) == -1)
+			return -1;
 	}
+
+	return 0;
+}
+
+static int run_rx(struct rx *rx)
+{
+	int r;
+	unsigned int n;
+	pthread_t receive, playback;
+
+	atomic_init(&rx->failed, 0);
+	atomic_init(&rx->finished, 0);
+	atomic_init(&rx->replayed, 0);
+
+	r = pthread_create(&playback, NULL, playback_main, rx);
+	if (r != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(r));
+		return -1;
+	}
+
+	r = pthread_create(&receive, NULL,
+			rx->replaying ? replay_main : receive_main, rx);
+	if (r != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(r));
+		atomic_store(&rx->failed, 1);
+		pthread_join(playback, NULL);
+		return -1;
+	}
+
+	/* The main thread is left to report on the pipeline */
+
+	for (n = 1; !atomic_load(&rx->failed); n++) {
+		sleep(1);
+		if (verbose > 0 && n % STATS_INTERVAL == 0)
+			print_jitter_stats(rx);
+	}
+
+	/* The receive thread may be blocked on the sockets */
+
+	for (n = 0; n < rx->nsock && !rx->replaying; n++)
+		shutdown(rx->sock[n], SHUT_RDWR);
+	pthread_join(receive, NULL);
+	pthread_join(playback, NULL);
+
+	if (verbose > 0)
+		print_jitter_stats(rx);
+
+	return atomic_load(&rx->finished) ? 0 : -1;
+}
+
+/*
+ * Keep a copy of every packet received, addressed to the sockets'
+ * own addresses
+ */
+
+static int open_tee(struct rx *rx, const char *path)
+{
+	unsigned int n;
+	socklen_t len;
+
+	for (n = 0; n < rx->nsock; n++) {
+		len = sizeof rx->local[n];
+		if (getsockname(rx->sock[n], (struct sockaddr*)&rx->local[n],
+				&len) == -1)
+		{
+			perror("getsockname");
+			return -1;
+		}
+	}
+
+	return pcap_tee_open(&rx->tee, path, 1);
+}
+
+/*
+ * Parse a comma-separated list of numbers; return how many were
+ * found, or -1 on error
+ */
+
+static int parse_list(const char *s, double *v, unsigned int max)
+{
+	unsigned int n;
+	char *end;
+
+	for (n = 0; n < max; n++) {
+		v[n] = strtod(s, &end);
+		if (end == s)
+			return -1;
+		if (*end == '\0')
+			return n + 1;
+		if (*end != ',')
+			return -1;
+		s = end + 1;
+	}
+
+	return -1;
 }
 
 static void usage(FILE *fd)
@@ -156,50 +1139,109 @@ static void usage(FILE *fd)
 		DEFAULT_DEVICE);
 	fprintf(fd, "  -m <ms>     Buffer time (default %d milliseconds)\n",
 		DEFAULT_BUFFER);
+	fprintf(fd, "  -z          Access the device buffer directly (mmap)\n");
+	fprintf(fd, "  -F <fmt>    Sample format: S16_LE, S24_3LE, S32_LE or FLOAT_LE\n"
+		"              (default is the device's own)\n");
+	fprintf(fd, "  -o <file>   Write a WAV (if named .wav) or raw file ('-' for stdout)\n"
+		"              instead of a device\n");
+	fprintf(fd, "  -X          Write the file as fast as packets arrive, not in real time\n");
 
 	fprintf(fd, "\nNetwork parameters:\n");
 	fprintf(fd, "  -h <addr>   IP address to listen on (default %s)\n",
 		DEFAULT_ADDR);
-	fprintf(fd, "  -p <port>   UDP port number (default %d)\n",
+	fprintf(fd, "  -p <port>,...  UDP port numbers (default %d)\n",
 		DEFAULT_PORT);
-	fprintf(fd, "  -j <ms>     Jitter buffer (default %d milliseconds)\n",
+	fprintf(fd, "  -j <ms>     Initial playout delay (default %d milliseconds)\n",
 		DEFAULT_JITTER);
+	fprintf(fd, "  -J <pct>    Percentile of jitter to absorb (default %d)\n",
+		DEFAULT_JITTER_PERCENTILE);
+	fprintf(fd, "  -g <ms>     Safety margin added to the jitter (default %d milliseconds)\n",
+		DEFAULT_JITTER_MARGIN);
+	fprintf(fd, "  -n          No compensation for sender clock drift\n");
+	fprintf(fd, "  -Q          Send no reception reports to the senders\n");
+	fprintf(fd, "  -K <file>   Write a copy of packets received to a pcap file\n");
+	fprintf(fd, "  -i <file>   Replay packets to our ports from a pcap file ('-' for stdin)\n"
+		"              instead of the network\n");
+	fprintf(fd, "  -x <speed>  Replay faster (> 1) or slower than recorded (default 1)\n");
+	fprintf(fd, "  -y <clock>  Clock on which senders stamp the capture time: 'realtime'\n"
+		"              (the default) or a PTP clock, eg. /dev/ptp0\n");
+	fprintf(fd, "  -I <spec>   Impair the network, for testing, eg.\n"
+		"              loss=2,burst=4,delay=20,jitter=5,dist=pareto,reorder=1,dup=1\n");
+
+	fprintf(fd, "\nMixing parameters:\n");
+	fprintf(fd, "  -S <n>      Most senders to mix at once (default %d)\n",
+		DEFAULT_SOURCES);
+	fprintf(fd, "  -G <dB>,... Gain for senders on each port (default 0)\n");
 
 	fprintf(fd, "\nEncoding parameters (must match sender):\n");
 	fprintf(fd, "  -r <rate>   Sample rate (default %dHz)\n",
 		DEFAULT_RATE);
 	fprintf(fd, "  -c <n>      Number of channels (default %d)\n",
 		DEFAULT_CHANNELS);
+	fprintf(fd, "  -u <map>    Layout of channels as Opus streams: pairs, mono or\n"
+		"              <coupled>:<stream channel>,... (default pairs)\n");
 
 	fprintf(fd, "\nProgram parameters:\n");
 	fprintf(fd, "  -v <n>      Verbosity level (default %d)\n",
 		DEFAULT_VERBOSE);
 	fprintf(fd, "  -D <file>   Run as a daemon, writing process ID to the given file\n");
+	fprintf(fd, "  -M <path>   Serve latency statistics on a UNIX socket\n");
+
+	fprintf(fd, "\nPipeline parameters:\n");
+	fprintf(fd, "  -A <cpu>[:<pri>]  Playback thread CPU and priority (default any:%d)\n",
+		DEFAULT_PLAYBACK_PRIORITY);
+	fprintf(fd, "  -N <cpu>[:<pri>]  Network thread CPU and priority (default any:%d)\n",
+		DEFAULT_RECEIVE_PRIORITY);
+	fprintf(fd, "  -e <pct>    Use SCHED_DEADLINE, reserving <pct> of each block period\n");
+	fprintf(fd, "  -w <ms>     Measure wakeup latency at startup (default %d, 0 to skip)\n",
+		DEFAULT_PROBE);
 }
 
 int main(int argc, char *argv[])
 {
-	int r, error;
+	int r;
+	unsigned int n;
+	struct rx rx;
 	snd_pcm_t *snd;
-	OpusDecoder *decoder;
-	RtpSession *session;
+	double ports[MAX_PORTS], gains[MAX_PORTS];
+	int nports = 1, ngains = 0;
 
 	/* command-line options */
 	const char *device = DEFAULT_DEVICE,
 		*addr = DEFAULT_ADDR,
-		*pid = NULL;
+		*pid = NULL,
+		*metrics = NULL,
+		*map = NULL,
+		*output = NULL,
+		*input = NULL,
+		*capture = NULL,
+		*impair = NULL,
+		*stamp = NULL;
+	double speed = 1.0;
 	unsigned int buffer = DEFAULT_BUFFER,
 		rate = DEFAULT_RATE,
 		jitter = DEFAULT_JITTER,
 		channels = DEFAULT_CHANNELS,
-		port = DEFAULT_PORT;
+		percentile = DEFAULT_JITTER_PERCENTILE,
+		margin = DEFAULT_JITTER_MARGIN,
+		sources = DEFAULT_SOURCES,
+		deadline = 0,
+		probe = DEFAULT_PROBE;
+	int receive_cpu = -1, receive_priority = DEFAULT_RECEIVE_PRIORITY,
+		playback_cpu = -1, playback_priority = DEFAULT_PLAYBACK_PRIORITY;
+	bool drift_comp = true, mmap = false, report = true, unpaced = false;
+	snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
+	struct alsa_config ac;
+	struct codec_layout layout;
 
 	fputs(COPYRIGHT "\n", stderr);
 
+	ports[0] = DEFAULT_PORT;
+
 	for (;;) {
 		int c;
 
-		c = getopt(argc, argv, "c:d:h:j:m:p:r:v:");
+		c = getopt(argc, argv, "c:d:e:g:h:i:j:m:no:p:r:u:v:w:x:y:zA:D:F:G:I:J:K:M:N:QS:X");
 		if (c == -1)
 			break;
 		switch (c) {
@@ -209,69 +1251,364 @@ int main(int argc, char *argv[])
 		case 'd':
 			device = optarg;
 			break;
+		case 'e':
+			deadline = atoi(optarg);
+			break;
+		case 'g':
+			margin = atoi(optarg);
+			break;
 		case 'h':
 			addr = optarg;
 			break;
+		case 'i':
+			input = optarg;
+			break;
 		case 'j':
 			jitter = atoi(optarg);
 			break;
 		case 'm':
 			buffer = atoi(optarg);
 			break;
+		case 'n':
+			drift_comp = false;
+			break;
+		case 'o':
+			output = optarg;
+			break;
 		case 'p':
-			port = atoi(optarg);
+			nports = parse_list(optarg, ports, MAX_PORTS);
+			if (nports == -1) {
+				usage(stderr);
+				return -1;
+			}
 			break;
 		case 'r':
 			rate = atoi(optarg);
 			break;
+		case 'u':
+			map = optarg;
+			break;
 		case 'v':
 			verbose = atoi(optarg);
 			break;
+		case 'w':
+			probe = atoi(optarg);
+			break;
+		case 'x':
+			speed = atof(optarg);
+			break;
+		case 'y':
+			stamp = optarg;
+			break;
+		case 'z':
+			mmap = true;
+			break;
+		case 'A':
+			if (parse_thread_opt(optarg, &playback_cpu,
+					&playback_priority) == -1)
+			{
+				usage(stderr);
+				return -1;
+			}
+			break;
 		case 'D':
 			pid = optarg;
 			break;
+		case 'F':
+			format = format_parse(optarg);
+			if (format == SND_PCM_FORMAT_UNKNOWN) {
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'G':
+			ngains = parse_list(optarg, gains, MAX_PORTS);
+			if (ngains == -1) {
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'I':
+			impair = optarg;
+			break;
+		case 'J':
+			percentile = atoi(optarg);
+			break;
+		case 'K':
+			capture = optarg;
+			break;
+		case 'M':
+			metrics = optarg;
+			break;
+		case 'N':
+			if (parse_thread_opt(optarg, &receive_cpu,
+					&receive_priority) == -1)
+			{
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'Q':
+			report = false;
+			break;
+		case 'S':
+			sources = atoi(optarg);
+			break;
+		case 'X':
+			unpaced = true;
+			break;
 		default:
 			usage(stderr);
 			return -1;
 		}
 	}
 
-	decoder = opus_decoder_create(rate, channels, &error);
-	if (decoder == NULL) {
-		fprintf(stderr, "opus_decoder_create: %s\n",
-			opus_strerror(error));
+	if (sources < 1) {
+		fprintf(stderr, "At least one source is required\n");
+		return -1;
+	}
+
+	if (percentile > 100) {
+		fprintf(stderr, "Jitter percentile must be 0 to 100\n");
+		return -1;
+	}
+
+	for (n = 0; n < (unsigned int)nports; n++) {
+		if (ports[n] < 1 || ports[n] > 65535
+			|| ports[n] != floor(ports[n]))
+		{
+			fprintf(stderr, "Port must be 1 to 65535\n");
+			return -1;
+		}
+	}
+
+	if (unpaced && !output) {
+		fprintf(stderr, "Only a file (-o) can be written unpaced\n");
+		return -1;
+	}
+
+	if (speed <= 0.0) {
+		fprintf(stderr, "Replay speed must be positive\n");
 		return -1;
 	}
 
-	ortp_init();
-	ortp_scheduler_init();
-	session = create_rtp_recv(addr, port, jitter);
-	assert(session != NULL);
+	if (impair && unpaced && !input) {
+		fprintf(stderr, "Unpaced, only a replay (-i) can be impaired\n");
+		return -1;
+	}
 
-	r = snd_pcm_open(&snd, device, SND_PCM_STREAM_PLAYBACK, 0);
-	if (r < 0) {
-		aerror("snd_pcm_open", r);
+	if (input && capture) {
+		fprintf(stderr, "A replay (-i) cannot also be captured (-K)\n");
 		return -1;
 	}
-	if (set_alsa_hw(snd, rate, channels, buffer * 1000) == -1)
+
+	if (codec_layout(&layout, channels, map) == -1)
 		return -1;
-	if (set_alsa_sw(snd) == -1)
+
+	/* A replay needs only the port numbers, to pick out packets */
+
+	rx.replaying = input != NULL;
+	rx.speed = speed;
+	if (input && pcap_open(&rx.pcap, input) == -1)
+		return -1;
+
+	rx.nsock = nports;
+	for (n = 0; n < rx.nsock; n++) {
+		rx.port[n] = ports[n];
+		rx.gain[n] = n < ngains ? powf(10.0f, gains[n] / 20.0f) : 1.0f;
+
+		if (rx.replaying) {
+			rx.sock[n] = -1;
+			continue;
+		}
+
+		rx.sock[n] = net_listen(addr, ports[n]);
+		if (rx.sock[n] == -1)
+			return -1;
+		if (net_timestamp(rx.sock[n]) == -1)
+			return -1;
+	}
+
+	if (output) {
+		if (wav_open_write(&rx.file, output, rate, channels,
+				format) == -1)
+		{
+			return -1;
+		}
+
+		rx.snd = NULL;
+		rx.mmap = false;
+		rx.format = rx.file.format;
+	} else {
+		r = snd_pcm_open(&snd, device, SND_PCM_STREAM_PLAYBACK, 0);
+		if (r < 0) {
+			aerror("snd_pcm_open", r);
+			return -1;
+		}
+		/* Wake for each block that is mixed */
+
+		ac.rate = rate;
+		ac.channels = channels;
+		ac.buffer = buffer * 1000;
+		ac.period = rate / 400; /* smallest Opus frame */
+		ac.format = format;
+		ac.mmap = mmap;
+
+		if (set_alsa_hw(snd, &ac) == -1)
+			return -1;
+		if (set_alsa_sw(snd) == -1)
+			return -1;
+		if (verbose > 0)
+			print_alsa_config(device, &ac);
+
+		rx.snd = snd;
+		rx.mmap = ac.mmap;
+		rx.format = ac.format;
+	}
+
+	rx.to_file = output != NULL;
+	rx.unpaced = unpaced;
+	rx.timing = !unpaced && !rx.replaying;
+	rx.offset = 0.0;
+	if (wallclock_open(&rx.wall, stamp) == -1)
+		return -1;
+	rx.heard = false;
+	rx.idle = false;
+	rx.nwritten = 0;
+	rx.clock = 0.0;
+	rx.newest = -1.0;
+
+	rx.channels = channels;
+	rx.rate = rate;
+	rx.block = rate / 400; /* smallest Opus frame */
+	rx.receive_cpu = receive_cpu;
+	rx.receive_priority = receive_priority;
+	rx.playback_cpu = playback_cpu;
+	rx.playback_priority = playback_priority;
+
+	rx.mix = malloc(sizeof(*rx.mix) * rx.block * channels);
+	rx.out = malloc(format_bytes(rx.format) * rx.block * channels);
+	if (rx.mix == NULL || rx.out == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	rx.nsource = sources;
+	rx.source = calloc(sources, sizeof *rx.source);
+	if (rx.source == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (n = 0; n < rx.nsource; n++) {
+		struct source *s = &rx.source[n];
+
+		if (source_init(s, rate, &layout, rx.block, drift_comp,
+				jitter / 1000.0, percentile,
+				margin / 1000.0) == -1)
+		{
+			return -1;
+		}
+
+		s->arrival_jitter = &rx.arrival_jitter;
+		s->decode = &rx.decode;
+	}
+
+	/* Reports go from a socket of our own, as the listening one may
+	 * be bound to a multicast group */
+
+	rx.report = report && !rx.replaying;
+	if (rx.report) {
+		struct sockaddr_storage ss;
+		socklen_t len = sizeof ss;
+
+		if (getsockname(rx.sock[0], (struct sockaddr*)&ss, &len) == -1) {
+			perror("getsockname");
+			return -1;
+		}
+		if (batch_init(&rx.reports, ss.ss_family, rx.nsource,
+				REPORT_SIZE) == -1)
+		{
+			return -1;
+		}
+		if (getrandom(&rx.ssrc, sizeof rx.ssrc, 0) == -1) {
+			perror("getrandom");
+			return -1;
+		}
+	}
+
+	if (ring_init(&rx.ring, RECEIVE_QUEUE, sizeof(struct packet)) == -1)
+		return -1;
+
+	rx.impairing = impair != NULL;
+	if (impair) {
+		struct impair_config ic;
+
+		if (impair_parse(&ic, impair) == -1)
+			return -1;
+		if (impair_init(&rx.impair, &ic, IMPAIR_SLOTS,
+				sizeof(struct packet)) == -1)
+		{
+			return -1;
+		}
+	}
+
+	if (register_stats(&rx) == -1)
+		return -1;
+
+	/* Threads wake at least once for every block */
+
+	if (deadline && go_deadline((double)rx.block / rate, deadline) == -1)
 		return -1;
 
 	if (pid)
 		go_daemon(pid);
 
-	go_realtime();
-	r = run_rx(session, decoder, snd, channels, rate);
+	/* Not before, as memory locks do not pass to a child */
 
-	if (snd_pcm_close(snd) < 0)
-		abort();
+	go_locked();
 
-	rtp_session_destroy(session);
-	ortp_exit();
-	ortp_global_stats_display();
+	rx.teeing = false;
+	if (capture) {
+		if (open_tee(&rx, capture) == -1)
+			return -1;
+		rx.teeing = true;
+	}
+	if (metrics && stats_serve(metrics) == -1)
+		return -1;
+
+	if (probe) {
+		probe_wakeup(playback_priority, playback_cpu,
+			(double)rx.block / rate, probe / 1000.0, verbose > 0);
+	}
+
+	r = run_rx(&rx);
+
+	stats_stop();
+
+	if (rx.teeing)
+		pcap_tee_close(&rx.tee);
+	if (rx.replaying)
+		pcap_close(&rx.pcap);
+
+	if (rx.to_file)
+		wav_close(&rx.file);
+	else if (snd_pcm_close(snd) < 0)
+		abort();
 
-	opus_decoder_destroy(decoder);
+	for (n = 0; n < rx.nsock && !rx.replaying; n++)
+		close(rx.sock[n]);
+	for (n = 0; n < rx.nsource; n++)
+		source_clear(&rx.source[n]);
+	free(rx.source);
+	ring_clear(&rx.ring);
+	if (rx.impairing)
+		impair_clear(&rx.impair);
+	wallclock_close(&rx.wall);
+	if (rx.report)
+		batch_clear(&rx.reports);
+	free(rx.mix);
+	free(rx.out);
 
 	return r;
 }
@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mix.h"
+#include "red.h"
+#include "source.h"
+
+#define QUIET_LEVEL (64.0f / 32768) /* peak considered silent */
+
+extern unsigned int verbose;
+
+int source_init(struct source *s, unsigned int rate,
+		const struct codec_layout *layout, size_t block, bool drift_comp,
+		double jitter, double percentile, double margin)
+{
+	unsigned int channels = layout->channels;
+
+	s->rate = rate;
+	s->channels = channels;
+	s->drift_comp = drift_comp;
+
+	/* Allow for the resampler running fast, on top of what is
+	 * already queued */
+
+	s->max_resampled = SOURCE_MAX_FRAME + SOURCE_MAX_FRAME / 100
+		+ RESAMPLE_TAPS;
+
+	s->decoder = codec_ms_decoder(rate, layout);
+	if (s->decoder == NULL)
+		return -1;
+
+	if (jitter_init(&s->jb, RTP_TS_RATE, jitter, percentile, margin) == -1)
+		return -1;
+	s->jb.dtx_len = codec_dtx_len(layout);
+	if (resample_init(&s->rs, channels, SOURCE_MAX_FRAME) == -1)
+		return -1;
+
+	s->pcm = malloc(sizeof(*s->pcm) * SOURCE_MAX_FRAME * channels);
+	s->queue = malloc(sizeof(*s->queue) * (s->max_resampled + block)
+			* channels);
+	if (s->pcm == NULL || s->queue == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	atomic_init(&s->fec, 0);
+	atomic_init(&s->plc, 0);
+	atomic_init(&s->drift_ppb, 0);
+	atomic_init(&s->one_way_us, 0);
+	source_reset(s);
+
+	return 0;
+}
+
+void source_clear(struct source *s)
+{
+	opus_multistream_decoder_destroy(s->decoder);
+	jitter_clear(&s->jb);
+	resample_clear(&s->rs);
+	free(s->pcm);
+	free(s->queue);
+}
+
+void source_reset(struct source *s)
+{
+	s->active = false;
+	s->quiet = true;
+	s->timed = false;
+	s->stamped = false;
+	s->fill = 0;
+	s->from_len = 0;
+	s->reported = 0.0;
+	s->report_lost = 0;
+	s->report_expected = 0;
+
+	jitter_reset(&s->jb);
+	opus_multistream_decoder_ctl(s->decoder, OPUS_RESET_STATE);
+	drift_init(&s->drift);
+	resample_reset(&s->rs);
+
+	atomic_store(&s->fec, 0);
+	atomic_store(&s->plc, 0);
+	atomic_store(&s->drift_ppb, 0);
+	atomic_store(&s->one_way_us, 0);
+}
+
+/*
+ * Unpack an RFC 2198 payload; the redundant blocks are earlier
+ * consecutive frames, oldest first
+ */
+
+static void put_red(struct jitter *jb, const struct rtp *h, double arrival)
+{
+	int n, i;
+	struct red_block block[RED_MAX_BLOCKS];
+
+	n = red_parse(block, RED_MAX_BLOCKS, h->payload, h->len);
+	if (n == -1)
+		return;
+
+	jitter_put(jb, block[n - 1].data, block[n - 1].len, h->seq, h->ts,
+		h->marker, arrival);
+
+	for (i = 0; i < n - 1; i++) {
+		jitter_put_redundant(jb, block[i].data, block[i].len,
+			h->seq - (n - 1 - i), h->ts - block[i].offset);
+	}
+}
+
+/*
+ * Variation in transit time from the previous packet, as RFC 3550
+ */
+
+static void time_arrival(struct source *s, const struct rtp *h,
+		double arrival)
+{
+	double d;
+
+	if (s->timed) {
+		d = (arrival - s->last_arrival)
+			- (int32_t)(h->ts - s->last_ts) / (double)RTP_TS_RATE;
+		hist_add(s->arrival_jitter, fabs(d) * 1e9);
+	}
+
+	s->timed = true;
+	s->last_arrival = arrival;
+	s->last_ts = h->ts;
+}
+
+/*
+ * Take a packet from this source into its jitter buffer
+ */
+
+void source_put(struct source *s, const struct rtp *h, double arrival)
+{
+	time_arrival(s, h, arrival);
+
+	if (h->pt == RTP_PT_RED)
+		put_red(&s->jb, h, arrival);
+	else
+		jitter_put(&s->jb, h->payload, h->len, h->seq, h->ts,
+			h->marker, arrival);
+}
+
+static bool is_quiet(const float *pcm, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (pcm[i] > QUIET_LEVEL || pcm[i] < -QUIET_LEVEL)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Steer the resampler from the source's buffering, which includes
+ * audio decoded but not yet mixed
+ */
+
+static void steer(struct source *s, double device, int n)
+{
+	double ratio, buffered;
+
+	if (!s->jb.playing)
+		return;
+
+	buffered = s->jb.level + (double)s->fill / s->rate;
+	ratio = drift_update(&s->drift, buffered, device,
+			jitter_target(&s->jb), (double)n / s->rate);
+	resample_set_ratio(&s->rs, ratio);
+
+	atomic_store_explicit(&s->drift_ppb, (ratio - 1.0) * 1e9,
+			memory_order_relaxed);
+}
+
+/*
+ * Append decoded audio to the queue, through the resampler if drift
+ * compensation is enabled
+ */
+
+static void enqueue(struct source *s, const float *pcm, int n, double device)
+{
+	float *q;
+
+	q = s->queue + s->fill * s->channels;
+
+	if (s->drift_comp) {
+		steer(s, device, n);
+		n = resample_process(&s->rs, pcm, n, q, s->max_resampled);
+	} else {
+		memcpy(q, pcm, sizeof(*pcm) * n * s->channels);
+	}
+
+	s->fill += n;
+}
+
+static int decode(struct source *s, const void *packet, size_t len,
+		int fec, int samples)
+{
+	int r;
+	uint64_t t;
+
+	t = stats_now();
+
+	if (packet == NULL) {
+		r = opus_multistream_decode_float(s->decoder, NULL, 0,
+				s->pcm, samples, 1);
+	} else {
+		r = opus_multistream_decode_float(s->decoder, packet, len,
+				s->pcm, samples, fec);
+	}
+	if (r < 0) {
+		fprintf(stderr, "opus_multistream_decode_float: %s\n",
+			opus_strerror(r));
+		return -1;
+	}
+
+	hist_add(s->decode, stats_now() - t);
+
+	return r;
+}
+
+/*
+ * Take the next frame from the jitter buffer into the queue;
+ * concealing, recovering or stretching as necessary
+ */
+
+static int produce(struct source *s, size_t block, double device)
+{
+	int r, adjust;
+	const void *packet;
+	size_t len;
+
+	adjust = jitter_adjust(&s->jb, s->quiet);
+	if (adjust > 0) {
+		/* Grow: conceal a frame without consuming one */
+
+		r = decode(s, NULL, 0, 0, s->last);
+		if (r == -1)
+			return -1;
+		enqueue(s, s->pcm, r, device);
+		if (verbose > 1)
+			fputc('+', stderr);
+		return 0;
+	}
+
+	if (adjust < 0) {
+		/* Shrink: decode a frame to keep the decoder state,
+		 * but do not play it */
+
+		if (jitter_pop(&s->jb, &packet, &len) == JITTER_PACKET)
+			decode(s, packet, len, 0, SOURCE_MAX_FRAME);
+		if (verbose > 1)
+			fputc('-', stderr);
+	}
+
+	switch (jitter_pop(&s->jb, &packet, &len)) {
+	case JITTER_WAIT:
+		memset(s->pcm, 0, sizeof(*s->pcm) * block * s->channels);
+		enqueue(s, s->pcm, block, device);
+		s->quiet = true;
+		return 0;
+
+	case JITTER_PACKET:
+		r = decode(s, packet, len, 0, SOURCE_MAX_FRAME);
+		if (verbose > 1)
+			fputc('.', stderr);
+		break;
+
+	case JITTER_DTX:
+		/* An intended gap; the decoder carries on with comfort
+		 * noise, which is not counted as concealment */
+
+		r = decode(s, NULL, 0, 0, s->last);
+		if (r == -1)
+			return -1;
+		enqueue(s, s->pcm, r, device);
+		s->quiet = true;
+		if (verbose > 1)
+			fputc('_', stderr);
+		return 0;
+
+	default:
+		/* Rebuild the lost frame from the in-band FEC of the
+		 * next one, if it has arrived; otherwise fall back to
+		 * plain concealment */
+
+		if (jitter_peek(&s->jb, &packet, &len)) {
+			r = decode(s, packet, len, 1, s->last);
+			atomic_fetch_add_explicit(&s->fec, 1,
+					memory_order_relaxed);
+			if (verbose > 1)
+				fputc('*', stderr);
+		} else {
+			r = decode(s, NULL, 0, 0, s->last);
+			atomic_fetch_add_explicit(&s->plc, 1,
+					memory_order_relaxed);
+			if (verbose > 1)
+				fputc('#', stderr);
+		}
+		break;
+	}
+
+	if (r == -1)
+		return -1;
+
+	if (r > 0) {
+		s->last = r;
+		s->quiet = is_quiet(s->pcm, r * s->channels);
+		enqueue(s, s->pcm, r, device);
+	}
+
+	return 0;
+}
+
+/*
+ * Decode until at least a block is queued; the device delay (in
+ * seconds) steers the drift compensation
+ */
+
+int source_fill(struct source *s, size_t block, double device)
+{
+	while (s->fill < block) {
+		if (produce(s, block, device) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Accumulate a block from the front of the queue into the mix
+ */
+
+void source_mix(struct source *s, float *mix, size_t block)
+{
+	size_t samples = block * s->channels;
+
+	mix_add(mix, s->queue, s->gain, samples);
+
+	s->fill -= block;
+	memmove(s->queue, s->queue + samples,
+		sizeof(*s->queue) * s->fill * s->channels);
+}
+
+/*
+ * Describe reception since the previous report; the caller fills in
+ * who it is from
+ */
+
+void source_report(struct source *s, struct report *r)
+{
+	struct jitter_stats *j = &s->jb.stats;
+	unsigned long lost, expected;
+
+	lost = atomic_load_explicit(&j->lost, memory_order_relaxed);
+	expected = lost
+		+ atomic_load_explicit(&j->received, memory_order_relaxed)
+		- atomic_load_explicit(&j->late, memory_order_relaxed)
+		- atomic_load_explicit(&j->duplicate, memory_order_relaxed);
+
+	r->ssrc = s->ssrc;
+	r->lost = lost;
+	r->seq = s->jb.last_seq;
+	r->jitter = atomic_load_explicit(&j->jitter_us,
+			memory_order_relaxed) * 1e-6;
+	r->depth = s->jb.playing ? s->jb.level : 0.0;
+
+	if (expected > s->report_expected)
+		r->loss = (double)(lost - s->report_lost)
+			/ (expected - s->report_expected);
+	else
+		r->loss = 0.0;
+
+	s->report_lost = lost;
+	s->report_expected = expected;
+}
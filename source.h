@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <opus/opus.h>
+
+#include "codec.h"
+#include "drift.h"
+#include "jitter.h"
+#include "report.h"
+#include "resample.h"
+#include "rtp.h"
+#include "stats.h"
+
+#define SOURCE_MAX_FRAME 1920 /* samples */
+
+/*
+ * One sender being received: its jitter buffer, decoder and drift
+ * compensation, decoding into a queue of audio from which fixed-size
+ * blocks are mixed
+ */
+
+struct source {
+	bool active;
+	unsigned int port;
+	uint32_t ssrc;
+	double seen;
+	float gain;
+
+	struct sockaddr_storage from; /* where reports are sent */
+	socklen_t from_len;
+	double reported;
+	unsigned long report_lost, report_expected;
+
+	double origin; /* for input not paced in real time (rx -X) */
+	uint32_t origin_ts;
+
+	struct jitter jb;
+	OpusMSDecoder *decoder;
+	struct drift drift;
+	struct resample rs;
+
+	unsigned int rate, channels;
+	bool drift_comp;
+	size_t max_resampled;
+
+	bool quiet;
+	int last;
+	atomic_ulong fec, plc;
+
+	bool timed; /* for arrival jitter */
+	double last_arrival;
+	uint32_t last_ts;
+
+	atomic_long drift_ppb;
+
+	/* Capture to arrival of the latest packet stamped with its
+	 * capture time, on the wall clock; and the one-way delay that
+	 * makes at playout */
+
+	bool stamped;
+	double transit;
+	atomic_ulong one_way_us;
+
+	float *pcm, *queue;
+	size_t fill; /* frames in the queue */
+
+	struct hist *arrival_jitter, *decode; /* set by the caller */
+};
+
+int source_init(struct source *s, unsigned int rate,
+		const struct codec_layout *layout, size_t block, bool drift_comp,
+		double jitter, double percentile, double margin);
+void source_clear(struct source *s);
+void source_reset(struct source *s);
+
+void source_put(struct source *s, const struct rtp *h, double arrival);
+int source_fill(struct source *s, size_t block, double device);
+void source_mix(struct source *s, float *mix, size_t block);
+void source_report(struct source *s, struct report *r);
+
+#endif
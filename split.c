@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "split.h"
+#include "tripwire.h"
+#include "trx-sched.h"
+
+/*
+ * The channels of the frame which feed a stream
+ */
+
+static void find_inputs(struct split_part *p, const struct codec_layout *l,
+		unsigned int stream)
+{
+	unsigned int n, c;
+
+	p->input[0] = -1;
+	p->input[1] = -1;
+
+	for (n = 0; n < l->channels; n++) {
+		for (c = 0; c < p->channels; c++) {
+			unsigned int want;
+
+			if (stream < l->coupled)
+				want = 2 * stream + c;
+			else
+				want = l->coupled + stream;
+
+			if (l->mapping[n] == want && p->input[c] == -1)
+				p->input[c] = n;
+		}
+	}
+}
+
+int split_init(struct split *sp, const struct codec_layout *l,
+		unsigned int rate, size_t frame, size_t max,
+		unsigned int loss, unsigned int complexity)
+{
+	unsigned int n;
+
+	sp->layout = *l;
+	sp->frame = frame;
+	sp->nthreads = 0;
+	sp->thread = NULL;
+
+	sp->part = calloc(l->streams, sizeof *sp->part);
+	if (sp->part == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (n = 0; n < l->streams; n++) {
+		struct split_part *p = &sp->part[n];
+
+		p->channels = n < l->coupled ? 2 : 1;
+		find_inputs(p, l, n);
+
+		p->encoder = codec_encoder(rate, p->channels, loss, complexity);
+		if (p->encoder == NULL)
+			return -1;
+
+		p->size = max;
+		p->max = max;
+		p->pcm = malloc(sizeof(*p->pcm) * frame * p->channels);
+		p->data = malloc(max);
+		if (p->pcm == NULL || p->data == NULL) {
+			perror("malloc");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void stop_threads(struct split *sp)
+{
+	unsigned int n;
+
+	atomic_store(&sp->stop, 1);
+
+	for (n = 1; n < sp->nthreads; n++)
+		sem_post(&sp->thread[n].go);
+	for (n = 1; n < sp->nthreads; n++) {
+		pthread_join(sp->thread[n].thread, NULL);
+		sem_destroy(&sp->thread[n].go);
+	}
+
+	if (sp->nthreads > 0)
+		sem_destroy(&sp->done);
+
+	free(sp->thread);
+	sp->nthreads = 0;
+}
+
+void split_clear(struct split *sp)
+{
+	unsigned int n;
+
+	stop_threads(sp);
+
+	for (n = 0; n < sp->layout.streams; n++) {
+		struct split_part *p = &sp->part[n];
+
+		if (p->encoder != NULL)
+			opus_encoder_destroy(p->encoder);
+		free(p->pcm);
+		free(p->data);
+	}
+
+	free(sp->part);
+}
+
+static void encode_share(struct split *sp, unsigned int index)
+{
+	unsigned int n;
+
+	for (n = index; n < sp->layout.streams; n += sp->nthreads) {
+		struct split_part *p = &sp->part[n];
+
+		p->len = opus_encode_float(p->encoder, p->pcm, sp->frame,
+				p->data, p->max);
+	}
+}
+
+static void* helper_main(void *arg)
+{
+	struct split_thread *t = arg;
+	struct split *sp = t->sp;
+
+	go_realtime_thread(t->priority, t->cpu);
+
+	for (;;) {
+		while (sem_wait(&t->go) == -1 && errno == EINTR);
+		if (atomic_load(&sp->stop))
+			break;
+
+		tripwire_step();
+
+		encode_share(sp, t->index);
+		sem_post(&sp->done);
+	}
+
+	tripwire_disarm();
+
+	return NULL;
+}
+
+/*
+ * Share the streams out between the caller and threads-1 helpers;
+ * there is no point in more threads than streams
+ */
+
+int split_start(struct split *sp, unsigned int threads, int cpu,
+		int priority)
+{
+	int r;
+	unsigned int n;
+
+	if (threads > sp->layout.streams)
+		threads = sp->layout.streams;
+	if (threads < 2)
+		return 0;
+
+	sp->thread = calloc(threads, sizeof *sp->thread);
+	if (sp->thread == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	atomic_init(&sp->stop, 0);
+	if (sem_init(&sp->done, 0, 0) == -1) {
+		perror("sem_init");
+		return -1;
+	}
+
+	sp->nthreads = 1;
+
+	for (n = 1; n < threads; n++) {
+		struct split_thread *t = &sp->thread[n];
+
+		t->sp = sp;
+		t->index = n;
+		t->cpu = cpu;
+		t->priority = priority;
+
+		if (sem_init(&t->go, 0, 0) == -1) {
+			perror("sem_init");
+			return -1;
+		}
+
+		r = pthread_create(&t->thread, NULL, helper_main, t);
+		if (r != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(r));
+			sem_destroy(&t->go);
+			return -1;
+		}
+
+		sp->nthreads++;
+	}
+
+	return 0;
+}
+
+/*
+ * Apply an encoder control to every stream; the bitrate is the total,
+ * shared between them by their number of channels
+ */
+
+int split_ctl(struct split *sp, int request, opus_int32 value)
+{
+	unsigned int n;
+	opus_int32 v;
+	int r;
+
+	for (n = 0; n < sp->layout.streams; n++) {
+		struct split_part *p = &sp->part[n];
+
+		v = value;
+		if (request == OPUS_SET_BITRATE_REQUEST && value > 0)
+			v = (int64_t)value * p->channels / sp->layout.channels;
+
+		r = opus_encoder_ctl(p->encoder, request, v);
+		if (r != OPUS_OK)
+			return r;
+	}
+
+	return OPUS_OK;
+}
+
+static int encode_size(unsigned char *b, opus_int32 size)
+{
+	if (size < 252) {
+		b[0] = size;
+		return 1;
+	}
+
+	b[0] = 252 + (size & 0x3);
+	b[1] = (size - b[0]) >> 2;
+	return 2;
+}
+
+/*
+ * Copy a packet in self-delimiting framing (RFC 6716, appendix B), as
+ * every stream but the last in a multistream packet: the size of the
+ * last frame follows the header
+ */
+
+static opus_int32 delimit(unsigned char *out, const unsigned char *data,
+		opus_int32 len)
+{
+	unsigned char toc;
+	const unsigned char *frame[48];
+	opus_int16 size[48];
+	int n, offset;
+	opus_int32 z;
+
+	n = opus_packet_parse(data, len, &toc, frame, size, &offset);
+	if (n < 0)
+		return n;
+
+	memcpy(out, data, offset);
+	z = offset + encode_size(out + offset, size[n - 1]);
+	memcpy(out + z, data + offset, len - offset);
+
+	return z + len - offset;
+}
+
+static void deinterleave(struct split *sp, const float *pcm)
+{
+	unsigned int n, c;
+	size_t i;
+
+	for (n = 0; n < sp->layout.streams; n++) {
+		struct split_part *p = &sp->part[n];
+
+		for (c = 0; c < p->channels; c++) {
+			float *out = p->pcm + c;
+
+			if (p->input[c] == -1) {
+				for (i = 0; i < sp->frame; i++)
+					out[i * p->channels] = 0.0f;
+				continue;
+			}
+
+			for (i = 0; i < sp->frame; i++) {
+				out[i * p->channels] =
+					pcm[i * sp->layout.channels + p->input[c]];
+			}
+		}
+	}
+}
+
+/*
+ * Encode a frame of interleaved audio into a multistream packet of
+ * no more than max bytes; each stream may take its share, by number
+ * of channels, of what is left after the framing
+ */
+
+opus_int32 split_encode(struct split *sp, const float *pcm,
+		unsigned char *out, opus_int32 max)
+{
+	unsigned int n, streams = sp->layout.streams;
+	opus_int32 z, share;
+
+	/* A single stream is a plain Opus packet */
+
+	if (streams == 1) {
+		struct split_part *p = &sp->part[0];
+
+		if (p->input[0] == 0 && (p->channels == 1 || p->input[1] == 1)) {
+			p->len = opus_encode_float(p->encoder, pcm, sp->frame,
+					out, max);
+			return p->len;
+		}
+	}
+
+	deinterleave(sp, pcm);
+
+	share = max - 2 * (streams - 1);
+	for (n = 0; n < streams; n++) {
+		struct split_part *p = &sp->part[n];
+		opus_int32 m;
+
+		m = (int64_t)share * p->channels / sp->layout.channels;
+		p->max = m < p->size ? m : p->size;
+	}
+
+	for (n = 1; n < sp->nthreads; n++)
+		sem_post(&sp->thread[n].go);
+
+	encode_share(sp, 0);
+
+	for (n = 1; n < sp->nthreads; n++)
+		while (sem_wait(&sp->done) == -1 && errno == EINTR);
+
+	z = 0;
+	for (n = 0; n < streams; n++) {
+		struct split_part *p = &sp->part[n];
+		opus_int32 r;
+
+		if (p->len < 0)
+			return p->len;
+
+		if (n + 1 < streams) {
+			r = delimit(out + z, p->data, p->len);
+			if (r < 0)
+				return r;
+		} else {
+			memcpy(out + z, p->data, p->len);
+			r = p->len;
+		}
+		z += r;
+	}
+
+	return z;
+}
+
+/*
+ * Whether every stream of the last frame was DTX
+ */
+
+bool split_silent(const struct split *sp)
+{
+	unsigned int n;
+
+	for (n = 0; n < sp->layout.streams; n++) {
+		if (sp->part[n].len > CODEC_DTX_LEN)
+			return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef SPLIT_H
+#define SPLIT_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <opus/opus.h>
+
+#include "codec.h"
+
+/*
+ * An Opus multistream encoder built from one encoder for each stream,
+ * so that the streams of a link with many channels can be encoded in
+ * parallel. Their packets are joined as opus_multistream_encode()
+ * would, and decode with an ordinary multistream decoder
+ */
+
+struct split_part {
+	OpusEncoder *encoder;
+	unsigned int channels;
+	int input[2]; /* channel of the frame, or -1 for silence */
+	float *pcm;
+	unsigned char *data;
+	opus_int32 size, max, len;
+};
+
+struct split_thread {
+	struct split *sp;
+	unsigned int index;
+	sem_t go;
+	pthread_t thread;
+	int cpu, priority;
+};
+
+struct split {
+	struct codec_layout layout;
+	size_t frame;
+	struct split_part *part;
+
+	/* Helpers each encode every nth part, the caller the first */
+
+	unsigned int nthreads;
+	struct split_thread *thread;
+	sem_t done;
+	atomic_int stop;
+};
+
+int split_init(struct split *sp, const struct codec_layout *l,
+		unsigned int rate, size_t frame, size_t max,
+		unsigned int loss, unsigned int complexity);
+void split_clear(struct split *sp);
+
+int split_start(struct split *sp, unsigned int threads, int cpu,
+		int priority);
+
+int split_ctl(struct split *sp, int request, opus_int32 value);
+opus_int32 split_encode(struct split *sp, const float *pcm,
+		unsigned char *out, opus_int32 max);
+bool split_silent(const struct split *sp);
+
+#endif
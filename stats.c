@@ -0,0 +1,283 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "stats.h"
+
+#define MAX_ENTRIES 128
+#define MAX_NAME 32
+
+static unsigned int bucket(uint64_t v)
+{
+	unsigned int e;
+
+	if (v < HIST_SUB)
+		return v;
+
+	if (v >> HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+
+	e = 63 - __builtin_clzll(v); /* >= HIST_SUB_BITS */
+
+	return HIST_SUB * (e - HIST_SUB_BITS + 1)
+		+ ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * Highest value which falls in the given bucket
+ */
+
+static uint64_t bucket_value(unsigned int b)
+{
+	unsigned int e, m;
+
+	if (b < HIST_SUB)
+		return b;
+
+	e = b / HIST_SUB + HIST_SUB_BITS - 1;
+	m = b % HIST_SUB;
+
+	return ((uint64_t)(HIST_SUB + m + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+void hist_init(struct hist *h)
+{
+	unsigned int n;
+
+	for (n = 0; n < HIST_BUCKETS; n++)
+		atomic_init(&h->bucket[n], 0);
+	atomic_init(&h->count, 0);
+	atomic_init(&h->max, 0);
+}
+
+/*
+ * Record a value; safe from any number of threads at once
+ */
+
+void hist_add(struct hist *h, uint64_t ns)
+{
+	unsigned long max;
+
+	atomic_fetch_add_explicit(&h->bucket[bucket(ns)], 1,
+			memory_order_relaxed);
+	atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+
+	max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	while (ns > max && !atomic_compare_exchange_weak_explicit(&h->max,
+			&max, ns, memory_order_relaxed,
+			memory_order_relaxed));
+}
+
+/*
+ * Value below which the given fraction of samples fall; approximate
+ * if samples are being added at the same time
+ */
+
+uint64_t hist_percentile(struct hist *h, double p)
+{
+	unsigned int n;
+	unsigned long count, target, sum = 0;
+	uint64_t max;
+
+	count = atomic_load_explicit(&h->count, memory_order_relaxed);
+	max = atomic_load_explicit(&h->max, memory_order_relaxed);
+	if (count == 0)
+		return 0;
+
+	target = p * count + 0.5;
+	if (target < 1)
+		target = 1;
+
+	for (n = 0; n < HIST_BUCKETS; n++) {
+		sum += atomic_load_explicit(&h->bucket[n],
+				memory_order_relaxed);
+		if (sum >= target)
+			break;
+	}
+
+	if (n == HIST_BUCKETS || bucket_value(n) > max)
+		return max;
+
+	return bucket_value(n);
+}
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * The registry is filled before the threads start, and is read-only
+ * from then on
+ */
+
+static struct entry {
+	char name[MAX_NAME];
+	struct hist *hist;
+	atomic_ulong *counter;
+} entry[MAX_ENTRIES];
+
+static unsigned int nentry;
+
+static int add(const char *name, struct hist *h, atomic_ulong *c)
+{
+	struct entry *e;
+
+	if (nentry == MAX_ENTRIES) {
+		fprintf(stderr, "Too many statistics\n");
+		return -1;
+	}
+
+	e = &entry[nentry++];
+	snprintf(e->name, sizeof e->name, "%s", name);
+	e->hist = h;
+	e->counter = c;
+
+	return 0;
+}
+
+int stats_add_hist(const char *name, struct hist *h)
+{
+	return add(name, h, NULL);
+}
+
+int stats_add_counter(const char *name, atomic_ulong *c)
+{
+	return add(name, NULL, c);
+}
+
+/*
+ * Write every statistic as a line of text, times in microseconds
+ */
+
+void stats_dump(int fd)
+{
+	unsigned int n;
+
+	for (n = 0; n < nentry; n++) {
+		struct entry *e = &entry[n];
+
+		if (e->counter) {
+			dprintf(fd, "counter %s %lu\n", e->name,
+				atomic_load(e->counter));
+			continue;
+		}
+
+		dprintf(fd, "hist %s count=%lu p50=%.1f p99=%.1f max=%.1f\n",
+			e->name, atomic_load(&e->hist->count),
+			hist_percentile(e->hist, 0.50) / 1000.0,
+			hist_percentile(e->hist, 0.99) / 1000.0,
+			atomic_load(&e->hist->max) / 1000.0);
+	}
+}
+
+/*
+ * Each connection to the socket is answered with a dump and closed,
+ * from an ordinary thread
+ */
+
+static int listener = -1;
+static pthread_t server;
+static struct sockaddr_un addr;
+
+static void* serve_main(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		int fd;
+
+		fd = accept(listener, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break; /* including shutdown */
+		}
+
+		stats_dump(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+int stats_serve(const char *path)
+{
+	int r;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof addr.sun_path) {
+		fprintf(stderr, "Socket path '%s' is too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener == -1) {
+		perror("socket");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(listener, (struct sockaddr*)&addr, sizeof addr) == -1) {
+		perror("bind");
+		goto fail;
+	}
+	if (listen(listener, 4) == -1) {
+		perror("listen");
+		goto fail;
+	}
+
+	r = pthread_create(&server, NULL, serve_main, NULL);
+	if (r != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(r));
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	close(listener);
+	listener = -1;
+	return -1;
+}
+
+void stats_stop(void)
+{
+	if (listener == -1)
+		return;
+
+	shutdown(listener, SHUT_RDWR);
+	pthread_join(server, NULL);
+	close(listener);
+	unlink(addr.sun_path);
+	listener = -1;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * Histograms of durations in nanoseconds, log-linear in the style of
+ * HdrHistogram: each power of two is split into 16 buckets, so any
+ * value is placed to within about 6%. Recording is a few relaxed
+ * atomic operations, so real-time threads never wait on a reader
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40 /* about 18 minutes */
+#define HIST_BUCKETS (HIST_SUB * (HIST_MAX_BITS - HIST_SUB_BITS + 1))
+
+struct hist {
+	atomic_ulong bucket[HIST_BUCKETS];
+	atomic_ulong count, max;
+};
+
+void hist_init(struct hist *h);
+void hist_add(struct hist *h, uint64_t ns);
+uint64_t hist_percentile(struct hist *h, double p);
+
+uint64_t stats_now(void);
+
+/*
+ * A registry of histograms and counters by name, which can be read
+ * at any time from a UNIX socket
+ */
+
+int stats_add_hist(const char *name, struct hist *h);
+int stats_add_counter(const char *name, atomic_ulong *c);
+
+void stats_dump(int fd);
+int stats_serve(const char *path);
+void stats_stop(void);
+
+#endif
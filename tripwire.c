@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "tripwire.h"
+
+#ifdef TRIPWIRE
+
+#define SETTLE 2.0 /* seconds from the first pass of a loop */
+
+/*
+ * Interpose on glibc's allocator, as bench/codec.c does
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void __libc_free(void *p);
+
+static _Thread_local bool armed;
+static _Thread_local double since = -1.0;
+
+/*
+ * Count a pass of a real-time thread's loop; the first ones may
+ * fault in or set up what they need, but after that it is armed
+ */
+
+void tripwire_step(void)
+{
+	struct timespec ts;
+	double now;
+
+	if (armed)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec + ts.tv_nsec / 1e9;
+
+	if (since < 0.0)
+		since = now;
+	else if (now - since >= SETTLE)
+		armed = true;
+}
+
+/*
+ * Leaving the loop, as the thread's own exit may allocate and free
+ */
+
+void tripwire_disarm(void)
+{
+	armed = false;
+	since = -1.0;
+}
+
+static void trip(const char *call)
+{
+	armed = false;
+	fprintf(stderr, "Tripwire: %s() in a real-time thread\n", call);
+	abort();
+}
+
+void* malloc(size_t size)
+{
+	if (armed)
+		trip("malloc");
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+	if (armed)
+		trip("calloc");
+	return __libc_calloc(n, size);
+}
+
+void* realloc(void *p, size_t size)
+{
+	if (armed)
+		trip("realloc");
+	return __libc_realloc(p, size);
+}
+
+void* memalign(size_t align, size_t size)
+{
+	if (armed)
+		trip("memalign");
+	return __libc_memalign(align, size);
+}
+
+void* aligned_alloc(size_t align, size_t size)
+{
+	if (armed)
+		trip("aligned_alloc");
+	return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **p, size_t align, size_t size)
+{
+	void *m;
+
+	if (armed)
+		trip("posix_memalign");
+
+	if (align % sizeof(void*) != 0 || (align & (align - 1)) != 0)
+		return EINVAL;
+
+	m = __libc_memalign(align, size);
+	if (m == NULL)
+		return ENOMEM;
+
+	*p = m;
+	return 0;
+}
+
+void free(void *p)
+{
+	if (armed && p != NULL)
+		trip("free");
+	__libc_free(p);
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef TRIPWIRE_H
+#define TRIPWIRE_H
+
+/*
+ * A test mode (./configure --enable-tripwire) in which a real-time
+ * thread that calls the allocator, once settled into its loop,
+ * aborts the program. Otherwise these cost nothing
+ */
+
+#ifdef TRIPWIRE
+
+void tripwire_step(void);
+void tripwire_disarm(void);
+
+#else
+
+static inline void tripwire_step(void) {}
+static inline void tripwire_disarm(void) {}
+
+#endif
+
+#endif
@@ -17,14 +17,51 @@
  *
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
 #include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
+#include "stats.h"
 #include "trx-sched.h"
 
 #define REALTIME_PRIORITY 80
 
+#define STACK_PREFAULT (256 * 1024)
+#define HEAP_PREFAULT (8 * 1024 * 1024)
+#define THREAD_STACK (1024 * 1024)
+
+#define PROBE_INTERVAL 1000000 /* ns, as cyclictest */
+#define PROBE_BUDGET 0.5 /* of the period, for waking up */
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+
+/*
+ * sched_setattr(2) has no wrapper in older C libraries
+ */
+
+struct deadline_attr {
+	uint32_t size, policy;
+	uint64_t flags;
+	int32_t nice;
+	uint32_t priority;
+	uint64_t runtime, deadline, period; /* ns */
+};
+
+static uint64_t deadline_runtime, deadline_period; /* or zero for FIFO */
+
 int go_realtime(void)
 {
 	int max_pri;
@@ -51,6 +88,390 @@ int go_realtime(void)
 	return 0;
 }
 
+/*
+ * Lock the process into memory, including all that it maps later,
+ * and fault in some stack and heap now so that the real-time path
+ * does not take a page fault the first time it reaches further
+ */
+
+static void __attribute__((noinline)) prefault_stack(long page)
+{
+	volatile unsigned char stack[STACK_PREFAULT];
+	size_t n;
+
+	for (n = 0; n < sizeof stack; n += page)
+		stack[n] = 0;
+}
+
+int go_locked(void)
+{
+	long page;
+	size_t n;
+	volatile unsigned char *heap;
+	pthread_attr_t attr;
+
+	/* Keep what is freed in one heap, rather than giving it back
+	 * to the system to be faulted in again */
+
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	mallopt(M_ARENA_MAX, 1);
+
+	/* The stack of each new thread is locked whole, so keep them
+	 * modest */
+
+	if (pthread_attr_init(&attr) == 0) {
+		pthread_attr_setstacksize(&attr, THREAD_STACK);
+		pthread_setattr_default_np(&attr);
+		pthread_attr_destroy(&attr);
+	}
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		perror("mlockall");
+		return -1;
+	}
+
+	page = sysconf(_SC_PAGESIZE);
+	prefault_stack(page);
+
+	heap = malloc(HEAP_PREFAULT);
+	if (heap == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (n = 0; n < HEAP_PREFAULT; n += page)
+		heap[n] = 0;
+
+	free((void*)heap);
+
+	return 0;
+}
+
+/*
+ * Have go_realtime_thread() use SCHED_DEADLINE, reserving a
+ * percentage of every period, in place of SCHED_FIFO
+ */
+
+int go_deadline(double period, unsigned int percent)
+{
+	if (percent == 0 || percent > 100) {
+		fprintf(stderr, "Deadline runtime must be 1 to 100 percent\n");
+		return -1;
+	}
+
+	deadline_period = period * 1e9;
+	deadline_runtime = deadline_period * percent / 100;
+
+	return 0;
+}
+
+static int set_deadline(void)
+{
+	struct deadline_attr a;
+
+	memset(&a, 0, sizeof a);
+	a.size = sizeof a;
+	a.policy = SCHED_DEADLINE;
+	a.runtime = deadline_runtime;
+	a.deadline = deadline_period;
+	a.period = deadline_period;
+
+	if (syscall(SYS_sched_setattr, 0, &a, 0) == -1) {
+		perror("sched_setattr");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Set the scheduling of the calling thread only, optionally pinning
+ * it to a single CPU (cpu < 0 to leave the affinity alone)
+ */
+
+int go_realtime_thread(int priority, int cpu)
+{
+	int r, max_pri;
+	struct sched_param sp;
+
+	/* The kernel admits deadline threads across all CPUs of a
+	 * domain, so they cannot be pinned */
+
+	if (deadline_period) {
+		if (cpu >= 0) {
+			fprintf(stderr, "CPU %d ignored under SCHED_DEADLINE\n",
+				cpu);
+		}
+		return set_deadline();
+	}
+
+	max_pri = sched_get_priority_max(SCHED_FIFO);
+	if (priority > max_pri) {
+		fprintf(stderr, "Invalid priority (maximum %d)\n", max_pri);
+		return -1;
+	}
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+
+		r = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+		if (r != 0) {
+			fprintf(stderr, "pthread_setaffinity_np: %s\n",
+				strerror(r));
+			return -1;
+		}
+	}
+
+	memset(&sp, 0, sizeof sp);
+	sp.sched_priority = priority;
+
+	r = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+	if (r != 0) {
+		fprintf(stderr, "pthread_setschedparam: %s\n", strerror(r));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse a thread placement given as "<cpu>[:<priority>]"; a CPU of
+ * -1 means no affinity. The priority is left untouched if absent
+ */
+
+int parse_thread_opt(const char *s, int *cpu, int *priority)
+{
+	char *end;
+
+	*cpu = strtol(s, &end, 10);
+	if (end == s)
+		return -1;
+
+	if (*end == '\0')
+		return 0;
+	if (*end != ':')
+		return -1;
+
+	s = end + 1;
+	*priority = strtol(s, &end, 10);
+	if (end == s || *end != '\0')
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Advise on a CPU to which a real-time thread is pinned, from the
+ * kernel's lists of isolated CPUs and default interrupt affinity
+ */
+
+static int read_line(const char *path, char *buf, size_t len)
+{
+	FILE *f;
+	char *r;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	r = fgets(buf, len, f);
+	fclose(f);
+	if (!r)
+		return -1;
+
+	buf[strcspn(buf, "\n")] = '\0';
+	return 0;
+}
+
+static int in_cpu_list(const char *path, int cpu)
+{
+	char buf[256], *s, *end;
+	long lo, hi;
+
+	if (read_line(path, buf, sizeof buf) == -1)
+		return -1;
+
+	for (s = buf; *s != '\0'; s = end + 1) {
+		lo = strtol(s, &end, 10);
+		if (end == s)
+			break;
+
+		hi = lo;
+		if (*end == '-') {
+			s = end + 1;
+			hi = strtol(s, &end, 10);
+		}
+
+		if (cpu >= lo && cpu <= hi)
+			return 1;
+		if (*end != ',')
+			break;
+	}
+
+	return 0;
+}
+
+static int in_cpu_mask(const char *path, int cpu)
+{
+	char buf[256], *c;
+	int bit;
+
+	if (read_line(path, buf, sizeof buf) == -1)
+		return -1;
+
+	/* Hex digits, least significant last, in groups by commas */
+
+	bit = 0;
+	for (c = buf + strlen(buf); c-- > buf;) {
+		int v;
+
+		if (*c == ',')
+			continue;
+		if (!isxdigit((unsigned char)*c))
+			return -1;
+
+		v = isdigit((unsigned char)*c) ? *c - '0'
+			: tolower((unsigned char)*c) - 'a' + 10;
+		if (cpu < bit + 4)
+			return (v >> (cpu - bit)) & 1;
+		bit += 4;
+	}
+
+	return 0;
+}
+
+static void advise_cpu(int cpu)
+{
+	if (in_cpu_list("/sys/devices/system/cpu/isolated", cpu) == 0) {
+		fprintf(stderr, "CPU %d is shared with other tasks; "
+			"consider isolcpus=%d nohz_full=%d\n", cpu, cpu, cpu);
+	}
+
+	if (in_cpu_mask("/proc/irq/default_smp_affinity", cpu) == 1) {
+		fprintf(stderr, "CPU %d takes interrupts; "
+			"see /proc/irq/*/smp_affinity\n", cpu);
+	}
+}
+
+/*
+ * Measure how late a real-time thread wakes from a timer, in the
+ * manner of cyclictest, and warn if it eats too far into a period
+ * (in seconds) of the work which is to follow
+ */
+
+struct probe {
+	int priority, cpu;
+	unsigned long wakeups;
+	long faults;
+	int r;
+	struct hist hist;
+};
+
+static void* probe_main(void *arg)
+{
+	struct probe *p = arg;
+	struct timespec next, now;
+	struct rusage before, after;
+	unsigned long n;
+
+	p->r = go_realtime_thread(p->priority, p->cpu);
+	if (p->r == -1)
+		return NULL;
+
+	/* The first pass faults in what the loop uses, and is not
+	 * counted */
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (n = 0; n <= p->wakeups; n++) {
+		next.tv_nsec += PROBE_INTERVAL;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				&next, NULL) == EINTR);
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if (n == 0) {
+			getrusage(RUSAGE_THREAD, &before);
+			continue;
+		}
+
+		hist_add(&p->hist, (now.tv_sec - next.tv_sec) * 1000000000LL
+				+ now.tv_nsec - next.tv_nsec);
+	}
+
+	getrusage(RUSAGE_THREAD, &after);
+	p->faults = after.ru_minflt - before.ru_minflt
+		+ after.ru_majflt - before.ru_majflt;
+
+	return NULL;
+}
+
+int probe_wakeup(int priority, int cpu, double period, double duration,
+		bool report)
+{
+	int r;
+	pthread_t thread;
+	struct probe *p;
+	double p99, max, budget;
+
+	p = malloc(sizeof *p);
+	if (p == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	p->priority = priority;
+	p->cpu = cpu;
+	p->wakeups = duration * 1e9 / PROBE_INTERVAL;
+	hist_init(&p->hist);
+
+	r = pthread_create(&thread, NULL, probe_main, p);
+	if (r != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(r));
+		free(p);
+		return -1;
+	}
+
+	pthread_join(thread, NULL);
+
+	if (p->r == -1) {
+		free(p);
+		return -1;
+	}
+
+	p99 = hist_percentile(&p->hist, 0.99) / 1e3;
+	max = atomic_load(&p->hist.max) / 1e3;
+	budget = period * PROBE_BUDGET * 1e6;
+
+	if (report || max > budget) {
+		fprintf(stderr, "Wakeup latency p99 %.0fus, max %.0fus "
+			"over %lu wakeups\n", p99, max, p->wakeups);
+	}
+
+	if (max > budget) {
+		fprintf(stderr, "Warning: this host may not keep to %.1fms "
+			"periods; expect clicks\n", period * 1e3);
+		if (cpu >= 0 && !deadline_period)
+			advise_cpu(cpu);
+	}
+
+	if (p->faults > 0) {
+		fprintf(stderr, "Warning: %ld page faults in real-time "
+			"thread; is memory locked?\n", p->faults);
+	}
+
+	free(p);
+	return 0;
+}
+
 int go_daemon(const char *pid_file)
 {
 	FILE *f;
@@ -20,7 +20,15 @@
 #ifndef TRX_SCHED_H
 #define TRX_SCHED_H
 
+#include <stdbool.h>
+
 int go_realtime(void);
+int go_locked(void);
+int go_deadline(double period, unsigned int percent);
+int go_realtime_thread(int priority, int cpu);
+int parse_thread_opt(const char *s, int *cpu, int *priority);
+int probe_wakeup(int priority, int cpu, double period, double duration,
+		bool report);
 int go_daemon(const char *pid_file);
 
 #endif /* TRX_SCHED_H */
@@ -0,0 +1,1623 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <math.h>
+#include <string.h>
+#include <alsa/asoundlib.h>
+#include <opus/opus.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "adapt.h"
+#include "batch.h"
+#include "codec.h"
+#include "defaults.h"
+#include "device.h"
+#include "format.h"
+#include "jitter.h"
+#include "mix.h"
+#include "net.h"
+#include "notice.h"
+#include "ptt.h"
+#include "report.h"
+#include "rtp.h"
+#include "source.h"
+#include "split.h"
+#include "stats.h"
+#include "tripwire.h"
+#include "trx-sched.h"
+
+#define STATS_INTERVAL 10 /* seconds */
+#define RECEIVE_BATCH 16 /* packets per system call */
+#define SEND_BATCH 8 /* frames per system call */
+#define SOURCE_TIMEOUT 5.0 /* seconds before a silent sender is dropped */
+#define MAX_POLL 8 /* descriptors per sound device */
+#define MAX_EVENTS 16
+
+unsigned int verbose = DEFAULT_VERBOSE;
+
+/*
+ * trx is a whole station, transmitter and receiver, in a single
+ * real-time thread. It sleeps in one epoll_wait() on everything which
+ * can need its attention: the sound devices, the sockets, the PTT
+ * input and a once a second timer. There are no rings or locks
+ * between stages; each is run to completion when its descriptor
+ * is ready
+ */
+
+enum {
+	TAG_CAPTURE,
+	TAG_PLAYBACK,
+	TAG_SOCKET,
+	TAG_REPORT,
+	TAG_PTT,
+	TAG_TIMER,
+};
+
+/*
+ * A sound device may have several descriptors, whose events ALSA
+ * must translate into its own
+ */
+
+struct pcm {
+	const char *device;
+	snd_pcm_t *snd;
+	struct pollfd pfd[MAX_POLL];
+	unsigned int npfd;
+
+	snd_pcm_format_t format;
+	bool mmap;
+	size_t frame_bytes;
+	unsigned char *buf; /* one frame or block */
+
+	atomic_ulong xruns, recovers;
+};
+
+struct packet {
+	unsigned char data[JITTER_MAX_PACKET];
+	char control[CMSG_SPACE(sizeof(struct timespec))];
+	struct sockaddr_storage from;
+	socklen_t from_len;
+};
+
+struct trx {
+	int epoll, sock, timer;
+	unsigned int rate, channels;
+	ptt_t *ptt;
+	unsigned long ticks;
+
+	/* Transmit */
+
+	struct pcm capture;
+	snd_pcm_uframes_t frame;
+	struct split encoder; /* without threads of its own */
+	size_t bytes_per_frame;
+	unsigned int ts_per_frame;
+	float *pcm;
+	bool dtx, in_dtx;
+	atomic_ulong suppressed;
+
+	/* Reports from those receiving us come back to the socket we
+	 * send from; they steer the bitrate and FEC */
+
+	bool adapting;
+	struct adapt adapt;
+	atomic_ulong reports;
+
+	struct rtp rtp;
+	uint32_t ts;
+	struct sockaddr_storage dest;
+	socklen_t dest_len;
+	struct batch batch;
+
+	bool keyed;
+	unsigned int preroll, npreroll, ppos;
+	struct preroll {
+		uint32_t ts;
+		float *pcm;
+	} *prerolled;
+
+	/* Receive */
+
+	struct pcm playback;
+	snd_pcm_uframes_t block;
+	struct packet packet[RECEIVE_BATCH];
+	struct source *source;
+	unsigned int nsource;
+	float *mix;
+	bool report;
+
+	atomic_ulong unrouted, packets, calls;
+
+	struct hist wakeup, encode, send, keying, arrival_jitter, depth,
+		decode, alsa_delay;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int watch(struct trx *trx, int fd, unsigned int events,
+		unsigned int tag, unsigned int index)
+{
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.u64 = (uint64_t)tag << 32 | index;
+
+	if (epoll_ctl(trx->epoll, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Open a sound device for non-blocking use and add its descriptors
+ * to the event loop
+ */
+
+static int open_pcm(struct trx *trx, struct pcm *p, const char *device,
+		snd_pcm_stream_t stream, struct alsa_config *ac,
+		unsigned int tag)
+{
+	int r;
+	unsigned int n;
+	snd_pcm_uframes_t frames = ac->period;
+
+	p->device = device;
+
+	r = snd_pcm_open(&p->snd, device, stream, SND_PCM_NONBLOCK);
+	if (r < 0) {
+		aerror("snd_pcm_open", r);
+		return -1;
+	}
+
+	if (set_alsa_hw(p->snd, ac) == -1)
+		return -1;
+	if (set_alsa_sw(p->snd) == -1)
+		return -1;
+	if (verbose > 0)
+		print_alsa_config(device, ac);
+
+	p->format = ac->format;
+	p->mmap = ac->mmap;
+	p->frame_bytes = format_bytes(p->format) * ac->channels;
+
+	p->buf = malloc(frames * p->frame_bytes);
+	if (p->buf == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	r = snd_pcm_poll_descriptors_count(p->snd);
+	if (r < 0 || r > MAX_POLL) {
+		fprintf(stderr, "%s: %d poll descriptors\n", device, r);
+		return -1;
+	}
+
+	r = snd_pcm_poll_descriptors(p->snd, p->pfd, r);
+	if (r < 0) {
+		aerror("snd_pcm_poll_descriptors", r);
+		return -1;
+	}
+	p->npfd = r;
+
+	for (n = 0; n < p->npfd; n++) {
+		if (watch(trx, p->pfd[n].fd, p->pfd[n].events, tag, n) == -1)
+			return -1;
+	}
+
+	atomic_init(&p->xruns, 0);
+	atomic_init(&p->recovers, 0);
+
+	return 0;
+}
+
+static void close_pcm(struct pcm *p)
+{
+	if (snd_pcm_close(p->snd) < 0)
+		abort();
+	free(p->buf);
+}
+
+/*
+ * The events of one descriptor, as ALSA sees the device
+ */
+
+static unsigned short pcm_revents(struct pcm *p, unsigned int index,
+		unsigned int events)
+{
+	int r;
+	unsigned int n;
+	unsigned short revents;
+
+	for (n = 0; n < p->npfd; n++)
+		p->pfd[n].revents = n == index ? events : 0;
+
+	r = snd_pcm_poll_descriptors_revents(p->snd, p->pfd, p->npfd,
+			&revents);
+	if (r < 0) {
+		aerror("snd_pcm_poll_descriptors_revents", r);
+		return POLLERR;
+	}
+
+	return revents;
+}
+
+/*
+ * Recover from an error on the device; capture must be started again
+ * explicitly, playback starts once its buffer is full
+ */
+
+static int recover(struct pcm *p, int err)
+{
+	if (err == -EPIPE)
+		atomic_fetch_add_explicit(&p->xruns, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&p->recovers, 1, memory_order_relaxed);
+
+	err = snd_pcm_recover(p->snd, err, 0);
+	if (err < 0) {
+		aerror("snd_pcm_recover", err);
+		return -1;
+	}
+
+	if (snd_pcm_stream(p->snd) == SND_PCM_STREAM_CAPTURE) {
+		err = snd_pcm_start(p->snd);
+		if (err < 0) {
+			aerror("snd_pcm_start", err);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Recover from an error reported by poll, rather than by a call
+ */
+
+static int recover_state(struct pcm *p)
+{
+	if (snd_pcm_state(p->snd) == SND_PCM_STATE_SUSPENDED)
+		return recover(p, -ESTRPIPE);
+	else
+		return recover(p, -EPIPE);
+}
+
+static int encode_frame(struct trx *trx, const float *pcm, uint32_t ts)
+{
+	ssize_t z;
+	unsigned char *buf;
+	uint64_t t;
+
+	buf = batch_next(&trx->batch);
+
+	t = stats_now();
+	z = split_encode(&trx->encoder, pcm, buf + RTP_HEADER_SIZE,
+			trx->bytes_per_frame);
+	if (z < 0) {
+		fprintf(stderr, "opus_encode_float: %s\n", opus_strerror(z));
+		return -1;
+	}
+	hist_add(&trx->encode, stats_now() - t);
+
+	/* In DTX only the first of a run of silent frames is sent, so
+	 * the receiver knows that the gap which follows is intended */
+
+	if (trx->dtx && split_silent(&trx->encoder)) {
+		if (trx->in_dtx) {
+			atomic_fetch_add_explicit(&trx->suppressed, 1,
+					memory_order_relaxed);
+			trx->rtp.marker = 1;
+			return 0;
+		}
+		trx->in_dtx = true;
+	} else {
+		trx->in_dtx = false;
+	}
+
+	trx->rtp.ts = ts;
+	rtp_write_header(buf, &trx->rtp);
+	batch_commit(&trx->batch, &trx->dest, trx->dest_len,
+		RTP_HEADER_SIZE + z);
+
+	trx->rtp.seq++;
+	trx->rtp.marker = 0;
+
+	if (verbose > 1)
+		fputc('>', stderr);
+
+	return 0;
+}
+
+/*
+ * Keep a frame captured while the key is up, replacing the oldest
+ */
+
+static void keep_preroll(struct trx *trx, const float *pcm)
+{
+	struct preroll *p;
+
+	if (trx->preroll == 0)
+		return;
+
+	p = &trx->prerolled[trx->ppos];
+	p->ts = trx->ts;
+	memcpy(p->pcm, pcm, sizeof(*pcm) * trx->frame * trx->channels);
+
+	trx->ppos = (trx->ppos + 1) % trx->preroll;
+	if (trx->npreroll < trx->preroll)
+		trx->npreroll++;
+}
+
+static int send_preroll(struct trx *trx)
+{
+	unsigned int n, i;
+
+	for (n = 0; n < trx->npreroll; n++) {
+		i = (trx->ppos + trx->preroll - trx->npreroll + n)
+			% trx->preroll;
+		if (encode_frame(trx, trx->prerolled[i].pcm,
+				trx->prerolled[i].ts) == -1)
+		{
+			return -1;
+		}
+	}
+
+	trx->npreroll = 0;
+
+	return 0;
+}
+
+/*
+ * Encode a frame into the next packet of the batch; while the PTT
+ * key is up, time moves on but nothing is sent, and the next packet
+ * (the first of the pre-roll) starts a talkspurt
+ */
+
+static int send_frame(struct trx *trx, const void *pcm)
+{
+	uint64_t pressed, t;
+
+	format_extract(trx->pcm, pcm, trx->capture.format, trx->channels,
+		0, trx->channels, trx->frame);
+
+	if (trx->ptt != NULL && !ptt_is_pressed(trx->ptt)) {
+		keep_preroll(trx, trx->pcm);
+		trx->keyed = false;
+		trx->rtp.marker = 1;
+		trx->ts += trx->ts_per_frame;
+		return 0;
+	}
+
+	if (trx->ptt != NULL && !trx->keyed) {
+		trx->keyed = true;
+		if (send_preroll(trx) == -1)
+			return -1;
+
+		/* From the edge to the talkspurt being ready to send */
+
+		t = stats_now();
+		pressed = ptt_pressed_at(trx->ptt);
+		if (t > pressed) {
+			hist_add(&trx->keying, t - pressed);
+			if (verbose > 0)
+				fprintf(stderr, "keyed in %.1fms\n", (t - pressed) / 1e6);
+		}
+	}
+
+	if (encode_frame(trx, trx->pcm, trx->ts) == -1)
+		return -1;
+
+	trx->ts += trx->ts_per_frame;
+
+	return 0;
+}
+
+/*
+ * Take one frame from the device; with mmap access it is read in
+ * place, unless it wraps around the end of the buffer
+ */
+
+static int capture_frame(struct trx *trx)
+{
+	int r;
+	struct pcm *p = &trx->capture;
+	snd_pcm_sframes_t f;
+	snd_pcm_uframes_t offset, frames, done = 0;
+	const snd_pcm_channel_area_t *area;
+	const unsigned char *pcm;
+	bool wrapped = false;
+
+	if (!p->mmap) {
+		f = snd_pcm_readi(p->snd, p->buf, trx->frame);
+		if (f < 0)
+			return recover(p, f);
+		if ((snd_pcm_uframes_t)f < trx->frame) {
+			fprintf(stderr, "Short read, %ld\n", f);
+			return 0;
+		}
+		return send_frame(trx, p->buf);
+	}
+
+	while (done < trx->frame) {
+		frames = trx->frame - done;
+		r = snd_pcm_mmap_begin(p->snd, &area, &offset, &frames);
+		if (r < 0)
+			return recover(p, r);
+
+		pcm = (const unsigned char*)area[0].addr
+			+ (area[0].first + offset * area[0].step) / 8;
+
+		if (frames == trx->frame) {
+			r = send_frame(trx, pcm);
+			if (r == -1)
+				return -1;
+		} else {
+			memcpy(p->buf + done * p->frame_bytes, pcm,
+				frames * p->frame_bytes);
+			wrapped = true;
+		}
+
+		f = snd_pcm_mmap_commit(p->snd, offset, frames);
+		if (f < 0 || (snd_pcm_uframes_t)f != frames)
+			return recover(p, f >= 0 ? -EPIPE : f);
+
+		done += frames;
+	}
+
+	if (wrapped)
+		return send_frame(trx, p->buf);
+
+	return 0;
+}
+
+/*
+ * Encode every complete frame the device has, and send them together
+ */
+
+static int capture_ready(struct trx *trx, unsigned int index,
+		unsigned int events)
+{
+	snd_pcm_sframes_t avail;
+	unsigned short revents;
+	uint64_t t;
+
+	revents = pcm_revents(&trx->capture, index, events);
+	if ((revents & POLLERR) && recover_state(&trx->capture) == -1)
+		return -1;
+	if (!(revents & POLLIN))
+		return 0;
+
+	for (;;) {
+		avail = snd_pcm_avail_update(trx->capture.snd);
+		if (avail < 0) {
+			if (recover(&trx->capture, avail) == -1)
+				return -1;
+			break;
+		}
+		if ((snd_pcm_uframes_t)avail < trx->frame)
+			break;
+
+		if (capture_frame(trx) == -1)
+			return -1;
+	}
+
+	if (trx->batch.n > 0) {
+		t = stats_now();
+		batch_flush(&trx->batch);
+		hist_add(&trx->send, stats_now() - t);
+	}
+
+	return 0;
+}
+
+/*
+ * Find the source for a packet, taking on a new sender if there is
+ * room
+ */
+
+static struct source* route(struct trx *trx, const struct packet *p,
+		uint32_t ssrc, double arrival)
+{
+	unsigned int n;
+	struct source *s, *spare = NULL;
+
+	for (n = 0; n < trx->nsource; n++) {
+		s = &trx->source[n];
+
+		if (!s->active) {
+			if (spare == NULL)
+				spare = s;
+			continue;
+		}
+
+		if (s->ssrc == ssrc) {
+			s->seen = arrival;
+			return s;
+		}
+	}
+
+	if (spare == NULL)
+		return NULL;
+
+	source_reset(spare);
+	spare->active = true;
+	spare->port = 0;
+	spare->ssrc = ssrc;
+	spare->seen = arrival;
+	spare->reported = arrival;
+	spare->gain = 1.0f;
+	spare->last = trx->block;
+
+	memcpy(&spare->from, &p->from, p->from_len);
+	spare->from_len = p->from_len;
+
+	if (verbose > 0)
+		fprintf(stderr, "source %08x\n", ssrc);
+
+	return spare;
+}
+
+/*
+ * Take every packet waiting on the socket straight into the jitter
+ * buffers, a batch at a time; our own packets come back to us from a
+ * multicast group, and are ignored
+ */
+
+static int receive(struct trx *trx)
+{
+	int z, n;
+	struct mmsghdr msg[RECEIVE_BATCH];
+	struct iovec iov[RECEIVE_BATCH];
+	struct timespec real;
+	double mono, wait;
+
+	do {
+		memset(msg, 0, sizeof msg);
+		for (n = 0; n < RECEIVE_BATCH; n++) {
+			struct packet *p = &trx->packet[n];
+
+			iov[n].iov_base = p->data;
+			iov[n].iov_len = sizeof p->data;
+			msg[n].msg_hdr.msg_name = &p->from;
+			msg[n].msg_hdr.msg_namelen = sizeof p->from;
+			msg[n].msg_hdr.msg_iov = &iov[n];
+			msg[n].msg_hdr.msg_iovlen = 1;
+			msg[n].msg_hdr.msg_control = p->control;
+			msg[n].msg_hdr.msg_controllen = sizeof p->control;
+		}
+
+		z = recvmmsg(trx->sock, msg, RECEIVE_BATCH, MSG_DONTWAIT, NULL);
+		if (z == -1) {
+			if (errno == EINTR || errno == EAGAIN)
+				return 0;
+			perror("recvmmsg");
+			return -1;
+		}
+
+		clock_gettime(CLOCK_REALTIME, &real);
+		mono = now();
+
+		for (n = 0; n < z; n++) {
+			struct packet *p = &trx->packet[n];
+			struct rtp h;
+			struct source *s;
+			double arrival = mono;
+
+			if (rtp_parse(&h, p->data, msg[n].msg_len) == -1)
+				continue;
+			if (h.ssrc == trx->rtp.ssrc)
+				continue;
+
+			wait = net_waited(&msg[n].msg_hdr, &real);
+			if (wait > 0.0)
+				arrival -= wait;
+
+			p->from_len = msg[n].msg_hdr.msg_namelen;
+			s = route(trx, p, h.ssrc, arrival);
+			if (s == NULL) {
+				atomic_fetch_add_explicit(&trx->unrouted, 1,
+						memory_order_relaxed);
+				continue;
+			}
+
+			source_put(s, &h, arrival);
+		}
+
+		atomic_fetch_add_explicit(&trx->packets, z,
+				memory_order_relaxed);
+		atomic_fetch_add_explicit(&trx->calls, 1,
+				memory_order_relaxed);
+
+	} while (z == RECEIVE_BATCH);
+
+	return 0;
+}
+
+/*
+ * Take the reports from those receiving us, and adapt the encoder
+ */
+
+static int take_reports(struct trx *trx)
+{
+	unsigned char buf[REPORT_SIZE * 4];
+	ssize_t z;
+	struct report r;
+	unsigned int kbps;
+
+	for (;;) {
+		z = recv(trx->batch.fd, buf, sizeof buf, MSG_DONTWAIT);
+		if (z == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				return 0;
+			perror("recv");
+			return -1;
+		}
+
+		if (report_parse(&r, buf, z) == -1 || r.ssrc != trx->rtp.ssrc)
+			continue;
+
+		atomic_fetch_add_explicit(&trx->reports, 1,
+				memory_order_relaxed);
+
+		if (verbose > 1) {
+			fprintf(stderr, "%08x reports %.1f%% loss, "
+				"jitter %.1fms, depth %.1fms\n",
+				r.from, r.loss * 100.0, r.jitter * 1000.0,
+				r.depth * 1000.0);
+		}
+
+		if (!trx->adapting)
+			continue;
+
+		kbps = adapt_kbps(&trx->adapt);
+		adapt_report(&trx->adapt, &r, now());
+
+		if (adapt_kbps(&trx->adapt) != kbps) {
+			split_ctl(&trx->encoder,
+				OPUS_SET_BITRATE(adapt_kbps(&trx->adapt) * 1000));
+			if (verbose > 0) {
+				fprintf(stderr, "%ukbps, loss hint %u%%\n",
+					adapt_kbps(&trx->adapt),
+					adapt_loss(&trx->adapt));
+			}
+		}
+		split_ctl(&trx->encoder,
+			OPUS_SET_PACKET_LOSS_PERC(adapt_loss(&trx->adapt)));
+	}
+}
+
+/*
+ * Tell each sender how its packets are arriving; sent from our own
+ * sending socket, where their reports to us arrive
+ */
+
+static void send_reports(struct trx *trx, double t)
+{
+	unsigned int n;
+	unsigned char *buf;
+	ssize_t z;
+	struct report r;
+
+	for (n = 0; n < trx->nsource; n++) {
+		struct source *s = &trx->source[n];
+
+		if (!s->active || t - s->reported < REPORT_INTERVAL)
+			continue;
+		if (s->from_len == 0 || s->from.ss_family != trx->batch.family)
+			continue;
+
+		s->reported = t;
+		source_report(s, &r);
+		r.from = trx->rtp.ssrc;
+
+		buf = batch_next(&trx->batch);
+		z = report_write(buf, trx->batch.size, &r);
+		if (z != -1)
+			batch_commit(&trx->batch, &s->from, s->from_len, z);
+	}
+
+	if (trx->batch.n > 0)
+		batch_flush(&trx->batch);
+}
+
+static int mix_block(struct trx *trx)
+{
+	unsigned int n;
+	double device = 0.0;
+	snd_pcm_sframes_t delay;
+
+	if (snd_pcm_delay(trx->playback.snd, &delay) == 0) {
+		device = (double)delay / trx->rate;
+		hist_add(&trx->alsa_delay, device * 1e9);
+	}
+
+	memset(trx->mix, 0, sizeof(*trx->mix) * trx->block * trx->channels);
+
+	for (n = 0; n < trx->nsource; n++) {
+		struct source *s = &trx->source[n];
+
+		if (!s->active)
+			continue;
+
+		if (source_fill(s, trx->block, device) == -1)
+			return -1;
+
+		if (s->jb.playing)
+			hist_add(&trx->depth, s->jb.level * 1e9);
+
+		source_mix(s, trx->mix, trx->block);
+	}
+
+	mix_limit(trx->mix, trx->block * trx->channels);
+
+	return 0;
+}
+
+/*
+ * Write the mix into space the device is known to have; with mmap
+ * access it is converted in place, in two parts if it wraps
+ */
+
+static int write_block(struct trx *trx)
+{
+	int r;
+	struct pcm *p = &trx->playback;
+	const float *in = trx->mix;
+	snd_pcm_uframes_t left = trx->block;
+	snd_pcm_sframes_t f;
+
+	if (!p->mmap) {
+		format_store(p->buf, p->format, trx->mix,
+			trx->block * trx->channels);
+
+		f = snd_pcm_writei(p->snd, p->buf, trx->block);
+		if (f < 0)
+			return recover(p, f);
+		if ((snd_pcm_uframes_t)f < trx->block)
+			fprintf(stderr, "Short write %ld\n", f);
+		return 0;
+	}
+
+	while (left > 0) {
+		const snd_pcm_channel_area_t *area;
+		snd_pcm_uframes_t offset, frames;
+		char *out;
+
+		frames = left;
+		r = snd_pcm_mmap_begin(p->snd, &area, &offset, &frames);
+		if (r < 0)
+			return recover(p, r);
+
+		out = (char*)area[0].addr
+			+ (area[0].first + offset * area[0].step) / 8;
+		format_store(out, p->format, in, frames * trx->channels);
+
+		f = snd_pcm_mmap_commit(p->snd, offset, frames);
+		if (f < 0 || (snd_pcm_uframes_t)f != frames)
+			return recover(p, f >= 0 ? -EPIPE : f);
+
+		in += frames * trx->channels;
+		left -= frames;
+	}
+
+	return 0;
+}
+
+/*
+ * Mix as many blocks as the device has space for; once its buffer
+ * is full for the first time (or after an xrun) it is started
+ */
+
+static int playback_ready(struct trx *trx, unsigned int index,
+		unsigned int events)
+{
+	int r;
+	snd_pcm_sframes_t avail;
+	unsigned short revents;
+	struct pcm *p = &trx->playback;
+
+	revents = pcm_revents(p, index, events);
+	if ((revents & POLLERR) && recover_state(p) == -1)
+		return -1;
+
+	for (;;) {
+		avail = snd_pcm_avail_update(p->snd);
+		if (avail < 0) {
+			if (recover(p, avail) == -1)
+				return -1;
+			continue;
+		}
+
+		if ((snd_pcm_uframes_t)avail < trx->block) {
+			if (snd_pcm_state(p->snd) == SND_PCM_STATE_PREPARED) {
+				r = snd_pcm_start(p->snd);
+				if (r < 0 && recover(p, r) == -1)
+					return -1;
+			}
+			return 0;
+		}
+
+		if (mix_block(trx) == -1)
+			return -1;
+		if (write_block(trx) == -1)
+			return -1;
+	}
+}
+
+static void print_stats(struct trx *trx)
+{
+	unsigned int n;
+
+	for (n = 0; n < trx->nsource; n++) {
+		struct source *src = &trx->source[n];
+		struct jitter_stats *s = &src->jb.stats;
+
+		if (!src->active)
+			continue;
+
+		fprintf(stderr, "source %08x: depth %.1fms, target %.1fms "
+			"(jitter %.1fms), "
+			"%lu received, %lu lost, %lu late, "
+			"%lu fec, %lu plc, %lu dtx, drift %+.1fppm\n",
+			src->ssrc,
+			atomic_load(&s->depth_us) / 1000.0,
+			atomic_load(&s->target_us) / 1000.0,
+			atomic_load(&s->jitter_us) / 1000.0,
+			atomic_load(&s->received), atomic_load(&s->lost),
+			atomic_load(&s->late), atomic_load(&src->fec),
+			atomic_load(&src->plc), atomic_load(&s->dtx),
+			atomic_load(&src->drift_ppb) / 1000.0);
+	}
+
+	fprintf(stderr, "send: %lu packets in %lu sends, %lu dropped, "
+		"%lu reports; "
+		"receive: %lu packets in %lu calls, "
+		"%lu from too many senders; "
+		"capture: %lu xruns; playback: %lu xruns\n",
+		atomic_load(&trx->batch.packets),
+		atomic_load(&trx->batch.calls),
+		atomic_load(&trx->batch.dropped),
+		atomic_load(&trx->reports),
+		atomic_load(&trx->packets), atomic_load(&trx->calls),
+		atomic_load(&trx->unrouted),
+		atomic_load(&trx->capture.xruns),
+		atomic_load(&trx->playback.xruns));
+}
+
+/*
+ * Once a second: report to the senders and on the pipeline, and let
+ * go of senders which have stopped
+ */
+
+static int tick(struct trx *trx)
+{
+	unsigned int n;
+	uint64_t expired;
+	double t;
+
+	if (read(trx->timer, &expired, sizeof expired) != sizeof expired) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		perror("read");
+		return -1;
+	}
+
+	t = now();
+
+	for (n = 0; n < trx->nsource; n++) {
+		struct source *s = &trx->source[n];
+
+		if (!s->active || t - s->seen <= SOURCE_TIMEOUT)
+			continue;
+		if (s->jb.started && !s->jb.dtx)
+			continue;
+
+		if (verbose > 0)
+			fprintf(stderr, "source %08x gone\n", s->ssrc);
+		source_reset(s);
+	}
+
+	if (trx->report)
+		send_reports(trx, t);
+
+	trx->ticks += expired;
+	if (verbose > 0 && trx->ticks % STATS_INTERVAL < expired)
+		print_stats(trx);
+
+	return 0;
+}
+
+static int dispatch(struct trx *trx, const struct epoll_event *ev)
+{
+	unsigned int tag, index;
+
+	tag = ev->data.u64 >> 32;
+	index = ev->data.u64 & 0xffffffff;
+
+	switch (tag) {
+	case TAG_CAPTURE:
+		return capture_ready(trx, index, ev->events);
+	case TAG_PLAYBACK:
+		return playback_ready(trx, index, ev->events);
+	case TAG_SOCKET:
+		return receive(trx);
+	case TAG_REPORT:
+		return take_reports(trx);
+	case TAG_PTT:
+		return ptt_read(trx->ptt);
+	case TAG_TIMER:
+		return tick(trx);
+	default:
+		abort();
+	}
+}
+
+static int run_trx(struct trx *trx)
+{
+	int r, n, i;
+	struct epoll_event ev[MAX_EVENTS];
+	uint64_t t;
+
+	r = snd_pcm_start(trx->capture.snd);
+	if (r < 0) {
+		aerror("snd_pcm_start", r);
+		return -1;
+	}
+
+	for (;;) {
+		tripwire_step();
+
+		n = epoll_wait(trx->epoll, ev, MAX_EVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		t = stats_now();
+
+		for (i = 0; i < n; i++) {
+			if (dispatch(trx, &ev[i]) == -1)
+				goto done;
+		}
+
+		hist_add(&trx->wakeup, stats_now() - t);
+	}
+
+done:
+	tripwire_disarm();
+
+	if (verbose > 0)
+		print_stats(trx);
+
+	return -1;
+}
+
+static int start_timer(struct trx *trx)
+{
+	struct itimerspec its;
+
+	trx->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (trx->timer == -1) {
+		perror("timerfd_create");
+		return -1;
+	}
+
+	its.it_value.tv_sec = 1;
+	its.it_value.tv_nsec = 0;
+	its.it_interval = its.it_value;
+
+	if (timerfd_settime(trx->timer, 0, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		return -1;
+	}
+
+	trx->ticks = 0;
+
+	return watch(trx, trx->timer, EPOLLIN, TAG_TIMER, 0);
+}
+
+/*
+ * Make the loop's timings and counters available to stats_serve()
+ */
+
+static int register_stats(struct trx *trx)
+{
+	unsigned int n;
+	char name[32];
+
+	atomic_init(&trx->unrouted, 0);
+	atomic_init(&trx->packets, 0);
+	atomic_init(&trx->calls, 0);
+
+	hist_init(&trx->wakeup);
+	hist_init(&trx->encode);
+	hist_init(&trx->send);
+	hist_init(&trx->keying);
+	hist_init(&trx->arrival_jitter);
+	hist_init(&trx->depth);
+	hist_init(&trx->decode);
+	hist_init(&trx->alsa_delay);
+
+	if (stats_add_hist("trx.wakeup", &trx->wakeup) == -1
+		|| stats_add_hist("trx.encode", &trx->encode) == -1
+		|| stats_add_hist("trx.send", &trx->send) == -1
+		|| stats_add_hist("trx.keying", &trx->keying) == -1
+		|| stats_add_hist("trx.arrival_jitter", &trx->arrival_jitter) == -1
+		|| stats_add_hist("trx.buffer_depth", &trx->depth) == -1
+		|| stats_add_hist("trx.decode", &trx->decode) == -1
+		|| stats_add_hist("trx.alsa_delay", &trx->alsa_delay) == -1
+		|| stats_add_counter("trx.capture_xruns", &trx->capture.xruns) == -1
+		|| stats_add_counter("trx.playback_xruns", &trx->playback.xruns) == -1
+		|| stats_add_counter("trx.dropped", &trx->batch.dropped) == -1
+		|| stats_add_counter("trx.suppressed", &trx->suppressed) == -1
+		|| stats_add_counter("trx.reports", &trx->reports) == -1
+		|| stats_add_counter("trx.unrouted", &trx->unrouted) == -1)
+	{
+		return -1;
+	}
+
+	for (n = 0; n < trx->nsource; n++) {
+		struct source *s = &trx->source[n];
+
+		snprintf(name, sizeof name, "source%u.fec", n);
+		if (stats_add_counter(name, &s->fec) == -1)
+			return -1;
+		snprintf(name, sizeof name, "source%u.plc", n);
+		if (stats_add_counter(name, &s->plc) == -1)
+			return -1;
+		snprintf(name, sizeof name, "source%u.lost", n);
+		if (stats_add_counter(name, &s->jb.stats.lost) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int parse_port(const char *s, unsigned int *v)
+{
+	char *end;
+	unsigned long n;
+
+	errno = 0;
+	n = strtoul(s, &end, 10);
+	if (errno || end == s || *end != '\0' || n < 1 || n > 65535)
+		return -1;
+
+	*v = n;
+	return 0;
+}
+
+static void usage(FILE *fd)
+{
+	fprintf(fd, "Usage: trx [<parameters>]\n"
+		"Real-time audio transmitter and receiver over IP\n");
+
+	fprintf(fd, "\nAudio device (ALSA) parameters:\n");
+	fprintf(fd, "  -d <dev>    Device name for both directions (default '%s')\n",
+		DEFAULT_DEVICE);
+	fprintf(fd, "  -i <dev>    Capture device, if different\n");
+	fprintf(fd, "  -o <dev>    Playback device, if different\n");
+	fprintf(fd, "  -m <ms>     Buffer time (default %d milliseconds)\n",
+		DEFAULT_BUFFER);
+	fprintf(fd, "  -z          Access the device buffers directly (mmap)\n");
+	fprintf(fd, "  -F <fmt>    Sample format: S16_LE, S24_3LE, S32_LE or FLOAT_LE\n"
+		"              (default is the device's own)\n");
+
+	fprintf(fd, "\nNetwork parameters:\n");
+	fprintf(fd, "  -h <addr>   IP address to send to (default %s)\n",
+		DEFAULT_ADDR);
+	fprintf(fd, "  -p <port>   UDP port number to send to (default %d)\n",
+		DEFAULT_PORT);
+	fprintf(fd, "  -L <addr>   IP address to listen on (default the same as -h)\n");
+	fprintf(fd, "  -P <port>   UDP port number to listen on (default the same as -p)\n");
+	fprintf(fd, "  -j <ms>     Initial playout delay (default %d milliseconds)\n",
+		DEFAULT_JITTER);
+	fprintf(fd, "  -J <pct>    Percentile of jitter to absorb (default %d)\n",
+		DEFAULT_JITTER_PERCENTILE);
+	fprintf(fd, "  -g <ms>     Safety margin added to the jitter (default %d milliseconds)\n",
+		DEFAULT_JITTER_MARGIN);
+	fprintf(fd, "  -n          No compensation for sender clock drift\n");
+	fprintf(fd, "  -S <n>      Most senders to mix at once (default %d)\n",
+		DEFAULT_SOURCES);
+
+	fprintf(fd, "\nEncoding parameters:\n");
+	fprintf(fd, "  -r <rate>   Sample rate (default %dHz)\n",
+		DEFAULT_RATE);
+	fprintf(fd, "  -c <n>      Number of channels (default %d)\n",
+		DEFAULT_CHANNELS);
+	fprintf(fd, "  -u <map>    Layout of channels as Opus streams: pairs, mono or\n"
+		"              <coupled>:<stream channel>,... (default pairs)\n");
+	fprintf(fd, "  -f <n>      Frame size (default %d samples)\n",
+		DEFAULT_FRAME);
+	fprintf(fd, "  -b <kbps>   Bitrate (approx., default %d)\n",
+		DEFAULT_BITRATE);
+	fprintf(fd, "  -l <pct>    Expected packet loss, enables in-band FEC (default %d)\n",
+		DEFAULT_LOSS);
+	fprintf(fd, "  -x <n>      Encoder complexity, 0 to 10 (default %d)\n",
+		DEFAULT_COMPLEXITY);
+	fprintf(fd, "  -s          Suppress silence (DTX)\n");
+	fprintf(fd, "  -a <kbps>   Adapt the bitrate and FEC to receivers' reports,\n"
+		"              down to no less than <kbps>\n");
+	fprintf(fd, "  -Q          Send no reception reports to the senders\n");
+
+	fprintf(fd, "\nProgram parameters:\n");
+	fprintf(fd, "  -t          Push to talk, from %s\n",
+		DEFAULT_PTT_DEV_INPUT_DEVICE);
+	fprintf(fd, "  -k <n>      Keycode in hex to use as the PTT key (default %04x)\n",
+		DEFAULT_PTT_DEV_INPUT_KEYCODE);
+	fprintf(fd, "  -G <n>      Push to talk from GPIO line <n> of %s instead\n",
+		DEFAULT_PTT_GPIO_DEVICE);
+	fprintf(fd, "  -T <ms>     Audio kept while the key is up, sent when pressed (default %d)\n",
+		DEFAULT_PREROLL);
+	fprintf(fd, "  -v <n>      Verbosity level (default %d)\n",
+		DEFAULT_VERBOSE);
+	fprintf(fd, "  -D <file>   Run as a daemon, writing process ID to the given file\n");
+	fprintf(fd, "  -M <path>   Serve latency statistics on a UNIX socket\n");
+	fprintf(fd, "  -A <cpu>[:<pri>]  Thread CPU and priority (default any:%d)\n",
+		DEFAULT_TRX_PRIORITY);
+	fprintf(fd, "  -e <pct>    Use SCHED_DEADLINE, reserving <pct> of each block period\n");
+	fprintf(fd, "  -w <ms>     Measure wakeup latency at startup (default %d, 0 to skip)\n",
+		DEFAULT_PROBE);
+}
+
+int main(int argc, char *argv[])
+{
+	int r;
+	unsigned int n;
+	size_t size;
+	struct trx trx;
+	struct alsa_config ac;
+	struct codec_layout layout;
+
+	/* command-line options */
+	const char *device = DEFAULT_DEVICE,
+		*capture = NULL,
+		*playback = NULL,
+		*addr = DEFAULT_ADDR,
+		*listen_addr = NULL,
+		*pid = NULL,
+		*metrics = NULL,
+		*map = NULL;
+	unsigned int buffer = DEFAULT_BUFFER,
+		rate = DEFAULT_RATE,
+		channels = DEFAULT_CHANNELS,
+		frame = DEFAULT_FRAME,
+		kbps = DEFAULT_BITRATE,
+		port = DEFAULT_PORT,
+		listen_port = 0,
+		loss = DEFAULT_LOSS,
+		complexity = DEFAULT_COMPLEXITY,
+		jitter = DEFAULT_JITTER,
+		percentile = DEFAULT_JITTER_PERCENTILE,
+		margin = DEFAULT_JITTER_MARGIN,
+		sources = DEFAULT_SOURCES,
+		preroll = DEFAULT_PREROLL,
+		adapt = 0,
+		deadline = 0,
+		probe = DEFAULT_PROBE;
+	int cpu = -1, priority = DEFAULT_TRX_PRIORITY,
+		keycode = DEFAULT_PTT_DEV_INPUT_KEYCODE, gpio = -1;
+	bool drift_comp = true, mmap = false, ptt = false, dtx = false,
+		report = true;
+	snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
+
+	fputs(COPYRIGHT "\n", stderr);
+
+	for (;;) {
+		int c;
+
+		c = getopt(argc, argv, "a:b:c:d:e:f:g:h:i:j:k:l:m:no:p:r:stu:v:w:x:zA:D:F:G:J:L:M:P:QS:T:");
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'a':
+			adapt = atoi(optarg);
+			break;
+		case 'b':
+			kbps = atoi(optarg);
+			break;
+		case 'c':
+			channels = atoi(optarg);
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 'e':
+			deadline = atoi(optarg);
+			break;
+		case 'f':
+			frame = atol(optarg);
+			break;
+		case 'g':
+			margin = atoi(optarg);
+			break;
+		case 'h':
+			addr = optarg;
+			break;
+		case 'i':
+			capture = optarg;
+			break;
+		case 'j':
+			jitter = atoi(optarg);
+			break;
+		case 'k':
+			keycode = strtol(optarg, NULL, 16);
+			break;
+		case 'l':
+			loss = atoi(optarg);
+			break;
+		case 'm':
+			buffer = atoi(optarg);
+			break;
+		case 'n':
+			drift_comp = false;
+			break;
+		case 'o':
+			playback = optarg;
+			break;
+		case 'p':
+			if (parse_port(optarg, &port) == -1) {
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'r':
+			rate = atoi(optarg);
+			break;
+		case 's':
+			dtx = true;
+			break;
+		case 't':
+			ptt = true;
+			break;
+		case 'u':
+			map = optarg;
+			break;
+		case 'v':
+			verbose = atoi(optarg);
+			break;
+		case 'w':
+			probe = atoi(optarg);
+			break;
+		case 'x':
+			complexity = atoi(optarg);
+			break;
+		case 'z':
+			mmap = true;
+			break;
+		case 'A':
+			if (parse_thread_opt(optarg, &cpu, &priority) == -1) {
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'D':
+			pid = optarg;
+			break;
+		case 'F':
+			format = format_parse(optarg);
+			if (format == SND_PCM_FORMAT_UNKNOWN) {
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'G':
+			gpio = atoi(optarg);
+			ptt = true;
+			break;
+		case 'J':
+			percentile = atoi(optarg);
+			break;
+		case 'L':
+			listen_addr = optarg;
+			break;
+		case 'M':
+			metrics = optarg;
+			break;
+		case 'P':
+			if (parse_port(optarg, &listen_port) == -1) {
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'Q':
+			report = false;
+			break;
+		case 'S':
+			sources = atoi(optarg);
+			break;
+		case 'T':
+			preroll = atoi(optarg);
+			break;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (sources < 1) {
+		fprintf(stderr, "At least one source is required\n");
+		return -1;
+	}
+
+	if (percentile > 100) {
+		fprintf(stderr, "Jitter percentile must be 0 to 100\n");
+		return -1;
+	}
+
+	if (capture == NULL)
+		capture = device;
+	if (playback == NULL)
+		playback = device;
+	if (listen_addr == NULL)
+		listen_addr = addr;
+	if (listen_port == 0)
+		listen_port = port;
+
+	trx.rate = rate;
+	trx.channels = channels;
+	trx.frame = frame;
+	trx.block = rate / 400; /* smallest Opus frame */
+
+	trx.epoll = epoll_create1(EPOLL_CLOEXEC);
+	if (trx.epoll == -1) {
+		perror("epoll_create1");
+		return -1;
+	}
+
+	/* Transmit */
+
+	if (codec_layout(&layout, channels, map) == -1)
+		return -1;
+
+	trx.bytes_per_frame = codec_bytes_per_frame(kbps, frame, rate);
+	trx.ts_per_frame = frame * RTP_TS_RATE / rate;
+
+	if (split_init(&trx.encoder, &layout, rate, frame, trx.bytes_per_frame,
+			loss, complexity) == -1)
+	{
+		return -1;
+	}
+
+	trx.dtx = dtx;
+	trx.in_dtx = false;
+	atomic_init(&trx.suppressed, 0);
+	if (dtx)
+		split_ctl(&trx.encoder, OPUS_SET_DTX(1));
+
+	/* When adapting, the bitrate is set outright, below the limit
+	 * on the size of each packet */
+
+	trx.adapting = adapt > 0;
+	atomic_init(&trx.reports, 0);
+	if (trx.adapting) {
+		adapt_init(&trx.adapt, adapt, kbps, loss);
+		split_ctl(&trx.encoder, OPUS_SET_BITRATE(kbps * 1000));
+		split_ctl(&trx.encoder, OPUS_SET_INBAND_FEC(1));
+	}
+
+	/* The same batch carries our reports to other senders */
+
+	size = RTP_HEADER_SIZE + trx.bytes_per_frame;
+	if (size < REPORT_SIZE)
+		size = REPORT_SIZE;
+
+	if (net_resolve(addr, port, &trx.dest, &trx.dest_len) == -1)
+		return -1;
+	if (batch_init(&trx.batch, trx.dest.ss_family,
+			SEND_BATCH + sources, size) == -1)
+	{
+		return -1;
+	}
+	if (watch(&trx, trx.batch.fd, EPOLLIN, TAG_REPORT, 0) == -1)
+		return -1;
+
+	/* Random initial sequence and SSRC, as RFC 3550 */
+
+	if (getrandom(&trx.rtp.ssrc, sizeof trx.rtp.ssrc, 0) == -1
+		|| getrandom(&trx.rtp.seq, sizeof trx.rtp.seq, 0) == -1)
+	{
+		perror("getrandom");
+		return -1;
+	}
+
+	trx.rtp.pt = RTP_PT_OPUS;
+	trx.rtp.marker = 1;
+	trx.rtp.stamped = false;
+	trx.rtp.ts = 0;
+	trx.ts = 0;
+
+	/* Pre-roll in whole frames, rounded up; a key held at startup
+	 * is not a press */
+
+	trx.keyed = true;
+	trx.preroll = (preroll * rate / 1000 + frame - 1) / frame;
+	trx.npreroll = 0;
+	trx.ppos = 0;
+	trx.prerolled = calloc(trx.preroll, sizeof *trx.prerolled);
+	if (trx.prerolled == NULL && trx.preroll > 0) {
+		perror("calloc");
+		return -1;
+	}
+	for (n = 0; n < trx.preroll; n++) {
+		trx.prerolled[n].pcm = malloc(sizeof(float) * frame * channels);
+		if (trx.prerolled[n].pcm == NULL) {
+			perror("malloc");
+			return -1;
+		}
+	}
+
+	trx.pcm = malloc(sizeof(*trx.pcm) * frame * channels);
+	if (trx.pcm == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	ac.rate = rate;
+	ac.channels = channels;
+	ac.buffer = buffer * 1000;
+	ac.period = frame;
+	ac.format = format;
+	ac.mmap = mmap;
+
+	if (open_pcm(&trx, &trx.capture, capture, SND_PCM_STREAM_CAPTURE,
+			&ac, TAG_CAPTURE) == -1)
+	{
+		return -1;
+	}
+
+	/* Receive */
+
+	trx.sock = net_listen(listen_addr, listen_port);
+	if (trx.sock == -1)
+		return -1;
+	if (net_timestamp(trx.sock) == -1)
+		return -1;
+	if (watch(&trx, trx.sock, EPOLLIN, TAG_SOCKET, 0) == -1)
+		return -1;
+
+	trx.nsource = sources;
+	trx.report = report;
+	trx.source = calloc(sources, sizeof *trx.source);
+	if (trx.source == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (n = 0; n < trx.nsource; n++) {
+		struct source *s = &trx.source[n];
+
+		if (source_init(s, rate, &layout, trx.block, drift_comp,
+				jitter / 1000.0, percentile,
+				margin / 1000.0) == -1)
+		{
+			return -1;
+		}
+
+		s->arrival_jitter = &trx.arrival_jitter;
+		s->decode = &trx.decode;
+	}
+
+	trx.mix = malloc(sizeof(*trx.mix) * trx.block * channels);
+	if (trx.mix == NULL) {
+		perror("malloc");
+		return -1;
+	}
+
+	ac.rate = rate;
+	ac.channels = channels;
+	ac.buffer = buffer * 1000;
+	ac.period = trx.block;
+	ac.format = format;
+	ac.mmap = mmap;
+
+	if (open_pcm(&trx, &trx.playback, playback, SND_PCM_STREAM_PLAYBACK,
+			&ac, TAG_PLAYBACK) == -1)
+	{
+		return -1;
+	}
+
+	/* Everything else */
+
+	trx.ptt = NULL;
+	if (ptt) {
+		if (gpio >= 0)
+			trx.ptt = ptt_open_gpio(DEFAULT_PTT_GPIO_DEVICE, gpio);
+		else
+			trx.ptt = ptt_open_dev_input(DEFAULT_PTT_DEV_INPUT_DEVICE,
+					keycode);
+		if (trx.ptt == NULL)
+			return -1;
+		if (watch(&trx, ptt_fd(trx.ptt), EPOLLIN, TAG_PTT, 0) == -1)
+			return -1;
+	}
+
+	if (start_timer(&trx) == -1)
+		return -1;
+	if (register_stats(&trx) == -1)
+		return -1;
+
+	/* The loop wakes at least once for every block */
+
+	if (deadline && go_deadline((double)trx.block / rate, deadline) == -1)
+		return -1;
+
+	if (pid)
+		go_daemon(pid);
+
+	/* Not before, as memory locks do not pass to a child */
+
+	if (go_locked() == -1)
+		return -1;
+
+	if (metrics && stats_serve(metrics) == -1)
+		return -1;
+
+	if (probe) {
+		probe_wakeup(priority, cpu, (double)trx.block / rate,
+			probe / 1000.0, verbose > 0);
+	}
+
+	/* Only now, so that the statistics thread is not real-time */
+
+	if (go_realtime_thread(priority, cpu) == -1)
+		return -1;
+
+	r = run_trx(&trx);
+
+	stats_stop();
+
+	close_pcm(&trx.capture);
+	close_pcm(&trx.playback);
+	close(trx.sock);
+	close(trx.timer);
+	close(trx.epoll);
+
+	if (trx.ptt)
+		ptt_destroy(trx.ptt);
+
+	for (n = 0; n < trx.nsource; n++)
+		source_clear(&trx.source[n]);
+	free(trx.source);
+	batch_clear(&trx.batch);
+	split_clear(&trx.encoder);
+	for (n = 0; n < trx.preroll; n++)
+		free(trx.prerolled[n].pcm);
+	free(trx.prerolled);
+	free(trx.pcm);
+	free(trx.mix);
+
+	return r;
+}
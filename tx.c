@@ -17,126 +17,1580 @@
  *
  */
 
+#include <math.h>
 #include <netdb.h>
+#include <poll.h>
 #include <string.h>
 #include <alsa/asoundlib.h>
 #include <opus/opus.h>
-#include <ortp/ortp.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
 
+#include "adapt.h"
+#include "batch.h"
+#include "codec.h"
 #include "defaults.h"
+#include "config.h"
 #include "device.h"
+#include "format.h"
+#include "net.h"
 #include "notice.h"
-#include "trx-sched.h"
+#include "pcap.h"
 #include "ptt.h"
+#include "red.h"
+#include "report.h"
+#include "ring.h"
+#include "rtp.h"
+#include "split.h"
+#include "stats.h"
+#include "tripwire.h"
+#include "trx-sched.h"
+#include "wallclock.h"
+#include "wav.h"
+
+#define STATS_INTERVAL 10 /* seconds */
+#define FILE_PAUSE 100000 /* ns, waiting on the encoders */
+
+unsigned int verbose = DEFAULT_VERBOSE;
+bool ptt_is_enabled = DEFAULT_PTT_ENABLED;
+
+/*
+ * The transmitter is split into capture threads (one per sound
+ * device) and a pool of encode workers, joined by a ring of complete
+ * frames per stream: capture only drains ALSA, so a stall in an
+ * encoder or the network turns into ring occupancy, not an overrun
+ * of the sound card
+ */
+
+#define FRAME_RESET 0x1 /* discontinuity, restart timestamps */
+
+struct frame {
+	unsigned int flags;
+	uint64_t stamp; /* capture time, NTP format */
+	float pcm[];
+};
+
+struct worker;
+
+/*
+ * Each stream is aligned to a cache line, so that workers encoding
+ * neighbouring streams on different cores do not share lines
+ */
+
+struct stream {
+	/* Written by the capture thread */
+
+	struct ring ring;
+	unsigned int first, channels, flags;
+	struct worker *worker;
+
+	/* Owned by the worker; a link of more than two channels is
+	 * several Opus streams, which may be encoded in parallel */
+
+	struct split split;
+	unsigned int threads;
+	snd_pcm_uframes_t frame;
+	size_t bytes_per_frame;
+	unsigned int ts_per_frame, ts;
+	unsigned char *packet;
+
+	/* Silence suppression (DTX) */
+
+	bool dtx, in_dtx;
+	atomic_ulong suppressed;
+
+	/* Bitrate and loss hint from receivers' reports; set by the
+	 * main thread, taken up by the worker */
+
+	bool adapting;
+	struct adapt adapt;
+	atomic_ulong kbps, loss, reports;
+	unsigned long set_kbps, set_loss;
+
+	/* Packets are built in place in the worker's batch */
+
+	struct rtp rtp;
+	struct sockaddr_storage dest;
+	socklen_t dest_len;
+	struct batch *batch;
+
+	/* Recent audio while the PTT key is up, sent when it goes
+	 * down so the first syllable is not lost */
+
+	bool keyed;
+	unsigned int preroll, npreroll, ppos;
+	struct preroll {
+		uint32_t ts;
+		uint64_t stamp;
+		float *pcm;
+	} *prerolled;
+
+	/* Previous frames, for redundancy */
+
+	unsigned int redundancy, nhistory, hpos;
+	struct history {
+		uint32_t ts;
+		size_t len;
+		unsigned char *data;
+	} *history;
+} __attribute__((aligned(RING_CACHELINE)));
+
+struct capture {
+	char *device;
+	snd_pcm_t *snd;
+	unsigned int channels;
+	snd_pcm_uframes_t frame;
+	snd_pcm_format_t format;
+	size_t frame_bytes;
+	unsigned char *buf;
+	bool mmap;
+
+	/* Or a file in place of the device, read in time with the
+	 * clock unless unpaced */
+
+	bool from_file, unpaced;
+	struct wav file;
+	unsigned int rate;
+	uint64_t epoch;
+	unsigned long nread;
+
+	atomic_ulong xruns, recovers;
+
+	struct stream **stream;
+	size_t nstream;
+	struct worker **worker;
+	size_t nworker;
+
+	pthread_t thread;
+	struct tx *tx;
+};
+
+/*
+ * A worker sends everything it encoded on one wakeup in a single
+ * system call per address family
+ */
+
+#define MAX_FAMILIES 2 /* IPv4 and IPv6 */
+
+struct worker {
+	sem_t ready;
+	int cpu, priority;
+
+	struct stream **stream;
+	size_t nstream;
+
+	struct batch batch[MAX_FAMILIES];
+	size_t nbatch;
+
+	pthread_t thread;
+	struct tx *tx;
+} __attribute__((aligned(RING_CACHELINE)));
+
+struct tx {
+	struct stream *stream;
+	size_t nstream;
+	struct capture *capture;
+	size_t ncapture;
+	struct worker *worker;
+	size_t nworker;
+
+	ptt_t *ptt;
+	atomic_int failed;
+	atomic_size_t ended; /* captures at the end of a file */
+
+	bool teeing;
+	struct pcap_tee tee;
+
+	/* Packets carry the time of capture on this clock */
+
+	bool stamping;
+	struct wallclock clock;
+
+	int capture_cpu, capture_priority;
+
+	struct hist capture_wait, encode, send, keying;
+};
+
+static void fail(struct tx *tx)
+{
+	size_t n;
+
+	atomic_store(&tx->failed, 1);
+	for (n = 0; n < tx->nworker; n++)
+		sem_post(&tx->worker[n].ready);
+}
+
+/*
+ * Recover from an error on the device; a suspend loses the stream's
+ * timing, so timestamps start again
+ */
+
+static int recover(struct capture *c, int err)
+{
+	size_t n;
+
+	if (err == -EPIPE)
+		atomic_fetch_add_explicit(&c->xruns, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&c->recovers, 1, memory_order_relaxed);
+
+	if (err == -ESTRPIPE) {
+		for (n = 0; n < c->nstream; n++)
+			c->stream[n]->flags |= FRAME_RESET;
+	}
+
+	err = snd_pcm_recover(c->snd, err, 0);
+	if (err < 0) {
+		aerror("snd_pcm_recover", err);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Hand a complete frame of interleaved audio out to the streams,
+ * each taking its own channels as floating point
+ */
+
+static void distribute(struct capture *c, const void *pcm, uint64_t stamp)
+{
+	size_t n;
+
+	for (n = 0; n < c->nstream; n++) {
+		struct stream *s = c->stream[n];
+		struct frame *fr;
+
+		/* If the ring is full the audio is lost (and counted) */
+
+		fr = ring_write_slot(&s->ring);
+		if (fr == NULL)
+			continue;
+
+		fr->flags = s->flags;
+		fr->stamp = stamp;
+		s->flags = 0;
+		format_extract(fr->pcm, pcm, c->format, c->channels,
+			s->first, s->channels, c->frame);
+
+		ring_commit(&s->ring);
+	}
+
+	for (n = 0; n < c->nworker; n++)
+		sem_post(&c->worker[n]->ready);
+}
+
+/*
+ * When the first sample of a frame was captured, on the wall clock:
+ * the device's timestamp, less the audio in its buffer at that time
+ * and any of the frame already taken from it
+ */
+
+static uint64_t stamp_frame(struct capture *c, snd_pcm_uframes_t taken)
+{
+	snd_pcm_status_t *status;
+	snd_htimestamp_t ts;
+	double t, now;
+
+	if (!c->tx->stamping)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec + ts.tv_nsec * 1e-9;
+	t = now - (double)taken / c->rate;
+
+	/* A device which does not keep the monotonic timestamps asked
+	 * of it is timed by when it is read */
+
+	if (!c->from_file) {
+		snd_pcm_status_alloca(&status);
+		if (snd_pcm_status(c->snd, status) == 0) {
+			snd_pcm_status_get_htstamp(status, &ts);
+			if (fabs(ts.tv_sec + ts.tv_nsec * 1e-9 - now) < 1.0) {
+				t = ts.tv_sec + ts.tv_nsec * 1e-9
+					- (double)(snd_pcm_status_get_delay(status)
+						+ taken) / c->rate;
+			}
+		}
+	}
+
+	return rtp_ntp(t + wallclock_offset(&c->tx->clock));
+}
+
+static int capture_one_frame(struct capture *c)
+{
+	snd_pcm_sframes_t f;
+	uint64_t t;
+
+	t = stats_now();
+	f = snd_pcm_readi(c->snd, c->buf, c->frame);
+	hist_add(&c->tx->capture_wait, stats_now() - t);
+
+	if (f < 0)
+		return recover(c, f);
+
+	/* Opus encoder requires a complete frame, so if we xrun
+	 * mid-frame then we discard the incomplete audio. The next
+	 * read will catch the error condition and recover */
+
+	if (f < c->frame) {
+		fprintf(stderr, "Short read, %ld\n", f);
+		return 0;
+	}
+
+	distribute(c, c->buf, stamp_frame(c, c->frame));
+
+	return 0;
+}
+
+/*
+ * With mmap access, streams take their channels straight from the
+ * device's buffer; only a frame which wraps around the end of the
+ * buffer is copied
+ */
+
+static int capture_mmap(struct capture *c)
+{
+	int r;
+	snd_pcm_sframes_t avail;
+	snd_pcm_uframes_t offset, frames, done = 0;
+	const snd_pcm_channel_area_t *area;
+	const unsigned char *pcm;
+	bool wrapped = false;
+	uint64_t t, stamp;
+
+	if (snd_pcm_state(c->snd) == SND_PCM_STATE_PREPARED) {
+		r = snd_pcm_start(c->snd);
+		if (r < 0)
+			return recover(c, r);
+	}
+
+	avail = snd_pcm_avail_update(c->snd);
+	if (avail < 0)
+		return recover(c, avail);
+
+	if ((snd_pcm_uframes_t)avail < c->frame) {
+		t = stats_now();
+		r = snd_pcm_wait(c->snd, -1);
+		hist_add(&c->tx->capture_wait, stats_now() - t);
+		if (r < 0)
+			return recover(c, r);
+		return 0;
+	}
+
+	stamp = stamp_frame(c, 0);
+
+	while (done < c->frame) {
+		frames = c->frame - done;
+		r = snd_pcm_mmap_begin(c->snd, &area, &offset, &frames);
+		if (r < 0)
+			return recover(c, r);
+
+		pcm = (const unsigned char*)area[0].addr
+			+ (area[0].first + offset * area[0].step) / 8;
+
+		if (frames == c->frame) {
+			distribute(c, pcm, stamp);
+		} else {
+			memcpy(c->buf + done * c->frame_bytes, pcm,
+				frames * c->frame_bytes);
+			wrapped = true;
+		}
+
+		avail = snd_pcm_mmap_commit(c->snd, offset, frames);
+		if (avail < 0 || (snd_pcm_uframes_t)avail != frames)
+			return recover(c, avail >= 0 ? -EPIPE : avail);
+
+		done += frames;
+	}
+
+	if (wrapped)
+		distribute(c, c->buf, stamp);
+
+	return 0;
+}
+
+/*
+ * Read a frame from a file. Unpaced there is no hurry, so wait for
+ * room in the rings rather than lose audio. Return 1 at the end
+ */
+
+static int capture_file(struct capture *c)
+{
+	size_t n;
+	ssize_t f;
+	uint64_t t;
+	struct timespec ts, pause = { 0, FILE_PAUSE };
+
+	if (c->unpaced) {
+		for (n = 0; n < c->nstream; n++) {
+			struct ring *r = &c->stream[n]->ring;
+
+			while (ring_occupancy(r) == r->slots) {
+				if (atomic_load(&c->tx->failed))
+					return 0;
+				nanosleep(&pause, NULL);
+			}
+		}
+	} else {
+		if (c->nread == 0)
+			c->epoch = stats_now();
+
+		t = c->epoch + (uint64_t)c->nread * 1000000000 / c->rate;
+		ts.tv_sec = t / 1000000000;
+		ts.tv_nsec = t % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				&ts, NULL) == EINTR);
+	}
+
+	f = wav_read(&c->file, c->buf, c->frame);
+	if (f == -1)
+		return -1;
+	if (f == 0)
+		return 1;
+
+	/* The last frame is padded out with silence */
+
+	if ((snd_pcm_uframes_t)f < c->frame) {
+		memset(c->buf + f * c->frame_bytes, 0,
+			(c->frame - f) * c->frame_bytes);
+	}
+
+	c->nread += c->frame;
+	distribute(c, c->buf, stamp_frame(c, 0));
+
+	return 0;
+}
+
+/*
+ * At the end of a file, let the workers send what is in the rings;
+ * once every capture has ended, the pipeline is stopped
+ */
+
+static void finish(struct capture *c)
+{
+	size_t n;
+	struct tx *tx = c->tx;
+	struct timespec pause = { 0, FILE_PAUSE };
+
+	for (n = 0; n < c->nstream; n++) {
+		while (ring_occupancy(&c->stream[n]->ring) > 0
+			&& !atomic_load(&tx->failed))
+		{
+			nanosleep(&pause, NULL);
+		}
+	}
+
+	if (atomic_fetch_add(&tx->ended, 1) + 1 == tx->ncapture)
+		fail(tx);
+}
+
+static void* capture_main(void *arg)
+{
+	struct capture *c = arg;
+	struct tx *tx = c->tx;
+
+	go_realtime_thread(tx->capture_priority, tx->capture_cpu);
+
+	while (!atomic_load(&tx->failed)) {
+		int r;
+
+		tripwire_step();
+
+		if (c->from_file)
+			r = capture_file(c);
+		else if (c->mmap)
+			r = capture_mmap(c);
+		else
+			r = capture_one_frame(c);
+
+		if (r == -1) {
+			fail(tx);
+			break;
+		}
+		if (r == 1) {
+			finish(c);
+			break;
+		}
+	}
+
+	tripwire_disarm();
+
+	return NULL;
+}
+
+/*
+ * Prefix the packet with copies of earlier frames, RFC 2198 style,
+ * into the payload to send, and then remember it
+ */
+
+static ssize_t add_redundancy(struct stream *s, const unsigned char *packet,
+		size_t len, uint32_t ts, unsigned char *out, size_t size)
+{
+	unsigned int n, i;
+	ssize_t z;
+	struct history *h;
+	struct red_block block[RED_MAX_BLOCKS];
+
+	for (n = 0; n < s->nhistory; n++) {
+		i = (s->hpos + s->redundancy - s->nhistory + n)
+			% s->redundancy;
+		h = &s->history[i];
+
+		block[n].pt = RTP_PT_OPUS;
+		block[n].offset = ts - h->ts;
+		block[n].data = h->data;
+		block[n].len = h->len;
+	}
+
+	block[n].pt = RTP_PT_OPUS;
+	block[n].data = packet;
+	block[n].len = len;
+
+	z = red_encode(out, size, block, n + 1);
+	if (z == -1) {
+		/* Too large to carry (eg. a long gap); send the
+		 * primary alone */
+
+		z = red_encode(out, size, &block[n], 1);
+	}
+
+	h = &s->history[s->hpos];
+	h->ts = ts;
+	h->len = len;
+	memcpy(h->data, packet, len);
+
+	s->hpos = (s->hpos + 1) % s->redundancy;
+	if (s->nhistory < s->redundancy)
+		s->nhistory++;
+
+	return z;
+}
+
+/*
+ * Encode a frame straight into the next packet of the batch, behind
+ * space for the RTP header; nothing is sent until the batch is
+ * flushed
+ */
+
+static int encode_frame(struct stream *s, const float *pcm, uint32_t ts,
+		uint64_t stamp, struct tx *tx)
+{
+	ssize_t z;
+	unsigned char *buf, *payload;
+	size_t size, header;
+	uint64_t t;
+
+	header = rtp_header_size(&s->rtp);
+	buf = batch_next(s->batch);
+	payload = buf + header;
+	size = s->batch->size - header;
+
+	t = stats_now();
+	if (s->redundancy > 0) {
+		z = split_encode(&s->split, pcm, s->packet,
+				s->bytes_per_frame);
+	} else {
+		z = split_encode(&s->split, pcm, payload,
+				s->bytes_per_frame);
+	}
+	if (z < 0) {
+		fprintf(stderr, "opus_encode_float: %s\n", opus_strerror(z));
+		return -1;
+	}
+	hist_add(&tx->encode, stats_now() - t);
+
+	/* In DTX the encoder gives a packet of a byte or two for each
+	 * frame it finds silent. Only the first of a run is sent, which
+	 * tells the receiver that the gap which follows is intended */
+
+	if (s->dtx && split_silent(&s->split)) {
+		if (s->in_dtx) {
+			atomic_fetch_add_explicit(&s->suppressed, 1,
+					memory_order_relaxed);
+			s->nhistory = 0;
+			s->rtp.marker = 1;
+			return 0;
+		}
+		s->in_dtx = true;
+	} else {
+		s->in_dtx = false;
+	}
+
+	if (s->redundancy > 0)
+		z = add_redundancy(s, s->packet, z, ts, payload, size);
+
+	/* The marker bit is the start of a talkspurt */
+
+	s->rtp.ts = ts;
+	s->rtp.stamp = stamp;
+	rtp_write_header(buf, &s->rtp);
+	batch_commit(s->batch, &s->dest, s->dest_len, header + z);
+
+	s->rtp.seq++;
+	s->rtp.marker = 0;
+
+	return 0;
+}
+
+/*
+ * Keep a frame captured while the key is up, replacing the oldest
+ */
+
+static void keep_preroll(struct stream *s, const struct frame *fr)
+{
+	struct preroll *p;
+
+	if (s->preroll == 0)
+		return;
+
+	p = &s->prerolled[s->ppos];
+	p->ts = s->ts;
+	p->stamp = fr->stamp;
+	memcpy(p->pcm, fr->pcm, sizeof(*fr->pcm) * s->frame * s->channels);
+
+	s->ppos = (s->ppos + 1) % s->preroll;
+	if (s->npreroll < s->preroll)
+		s->npreroll++;
+}
+
+static int send_preroll(struct stream *s, struct tx *tx)
+{
+	unsigned int n, i;
+
+	for (n = 0; n < s->npreroll; n++) {
+		i = (s->ppos + s->preroll - s->npreroll + n) % s->preroll;
+		if (encode_frame(s, s->prerolled[i].pcm, s->prerolled[i].ts,
+				s->prerolled[i].stamp, tx) == -1)
+		{
+			return -1;
+		}
+	}
+
+	s->npreroll = 0;
+
+	return 0;
+}
+
+/*
+ * Take up the bitrate and loss hint most recently set from the
+ * receivers' reports; the loss hint sets the strength of the FEC
+ */
+
+static void follow_reports(struct stream *s)
+{
+	unsigned long kbps, loss;
+
+	kbps = atomic_load_explicit(&s->kbps, memory_order_relaxed);
+	if (kbps != s->set_kbps) {
+		split_ctl(&s->split, OPUS_SET_BITRATE(kbps * 1000));
+		s->set_kbps = kbps;
+	}
+
+	loss = atomic_load_explicit(&s->loss, memory_order_relaxed);
+	if (loss != s->set_loss) {
+		split_ctl(&s->split, OPUS_SET_PACKET_LOSS_PERC(loss));
+		s->set_loss = loss;
+	}
+}
+
+/*
+ * With PTT, nothing is sent while the key is up but time moves on;
+ * the next packet (the first of the pre-roll) starts a talkspurt
+ */
+
+static int send_one_frame(struct stream *s, const struct frame *fr,
+		struct tx *tx)
+{
+	uint64_t pressed, t;
+
+	if (fr->flags & FRAME_RESET) {
+		s->ts = 0;
+		s->nhistory = 0;
+		s->npreroll = 0;
+		s->rtp.marker = 1;
+	}
+
+	if (s->adapting)
+		follow_reports(s);
+
+	if (ptt_is_enabled && !ptt_is_pressed(tx->ptt)) {
+		keep_preroll(s, fr);
+		s->keyed = false;
+		s->nhistory = 0;
+		s->rtp.marker = 1;
+		s->ts += s->ts_per_frame;
+		return 0;
+	}
+
+	if (ptt_is_enabled && !s->keyed) {
+		s->keyed = true;
+		if (send_preroll(s, tx) == -1)
+			return -1;
+
+		/* From the edge to the talkspurt being ready to send */
+
+		t = stats_now();
+		pressed = ptt_pressed_at(tx->ptt);
+		if (t > pressed) {
+			hist_add(&tx->keying, t - pressed);
+			if (verbose > 0)
+				fprintf(stderr, "keyed in %.1fms\n", (t - pressed) / 1e6);
+		}
+	}
+
+	if (encode_frame(s, fr->pcm, s->ts, fr->stamp, tx) == -1)
+		return -1;
+
+	s->ts += s->ts_per_frame;
+
+	return 0;
+}
+
+static void* worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct tx *tx = w->tx;
+
+	go_realtime_thread(w->priority, w->cpu);
+
+	for (;;) {
+		size_t n;
+
+		while (sem_wait(&w->ready) == -1 && errno == EINTR);
+		if (atomic_load(&tx->failed))
+			break;
+
+		tripwire_step();
+
+		for (n = 0; n < w->nstream; n++) {
+			struct stream *s = w->stream[n];
+			struct frame *fr;
+
+			while ((fr = ring_read_slot(&s->ring)) != NULL) {
+				int r;
+
+				r = send_one_frame(s, fr, tx);
+				ring_release(&s->ring);
+				if (r == -1) {
+					fail(tx);
+					tripwire_disarm();
+					return NULL;
+				}
+
+				if (verbose > 1)
+					fputc('>', stderr);
+			}
+		}
+
+		for (n = 0; n < w->nbatch; n++) {
+			struct batch *b = &w->batch[n];
+			uint64_t t;
+
+			if (b->n == 0)
+				continue;
+
+			t = stats_now();
+			batch_flush(b);
+			hist_add(&tx->send, stats_now() - t);
+		}
+	}
+
+	tripwire_disarm();
+
+	return NULL;
+}
+
+static void print_stats(struct tx *tx)
+{
+	size_t n, i;
+
+	for (n = 0; n < tx->ncapture; n++) {
+		struct capture *c = &tx->capture[n];
+
+		fprintf(stderr, "capture %s: %lu xruns, %lu recoveries\n",
+			c->device, atomic_load(&c->xruns),
+			atomic_load(&c->recovers));
+	}
+
+	for (n = 0; n < tx->nstream; n++) {
+		struct ring *r = &tx->stream[n].ring;
+
+		fprintf(stderr, "stream %zu: ring %zu/%zu frames, "
+			"high-water %zu, %lu overruns, %lu suppressed, "
+			"%lu reports, %lukbps, loss hint %lu%%\n",
+			n, ring_occupancy(r), r->slots,
+			atomic_load(&r->high_water),
+			atomic_load(&r->overruns),
+			atomic_load(&tx->stream[n].suppressed),
+			atomic_load(&tx->stream[n].reports),
+			atomic_load(&tx->stream[n].kbps),
+			atomic_load(&tx->stream[n].loss));
+	}
+
+	for (n = 0; n < tx->nworker; n++) {
+		struct worker *w = &tx->worker[n];
+
+		for (i = 0; i < w->nbatch; i++) {
+			struct batch *b = &w->batch[i];
+
+			fprintf(stderr, "worker %zu: %lu packets in %lu "
+				"sends, %lu dropped\n",
+				n, atomic_load(&b->packets),
+				atomic_load(&b->calls),
+				atomic_load(&b->dropped));
+		}
+	}
+}
+
+static struct stream* find_stream(struct tx *tx, uint32_t ssrc)
+{
+	size_t n;
+
+	for (n = 0; n < tx->nstream; n++) {
+		if (tx->stream[n].rtp.ssrc == ssrc)
+			return &tx->stream[n];
+	}
+
+	return NULL;
+}
+
+/*
+ * Take the reports waiting on a socket, and adapt the streams they
+ * are about
+ */
+
+static void read_reports(struct tx *tx, int fd)
+{
+	unsigned char buf[REPORT_SIZE * 4];
+	ssize_t z;
+	struct report r;
+	struct stream *s;
+	double t;
+
+	for (;;) {
+		z = recv(fd, buf, sizeof buf, MSG_DONTWAIT);
+		if (z == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				perror("recv");
+			return;
+		}
+
+		if (report_parse(&r, buf, z) == -1)
+			continue;
+		s = find_stream(tx, r.ssrc);
+		if (s == NULL)
+			continue;
+
+		atomic_fetch_add_explicit(&s->reports, 1, memory_order_relaxed);
+
+		if (verbose > 1) {
+			fprintf(stderr, "%08x reports %.1f%% loss, "
+				"jitter %.1fms, depth %.1fms\n",
+				r.from, r.loss * 100.0, r.jitter * 1000.0,
+				r.depth * 1000.0);
+		}
+
+		if (!s->adapting)
+			continue;
+
+		t = stats_now() * 1e-9;
+		adapt_report(&s->adapt, &r, t);
+
+		if (adapt_kbps(&s->adapt) != atomic_load(&s->kbps)
+			&& verbose > 0)
+		{
+			fprintf(stderr, "stream %zu: %ukbps, loss hint %u%%\n",
+				(size_t)(s - tx->stream), adapt_kbps(&s->adapt),
+				adapt_loss(&s->adapt));
+		}
+
+		atomic_store(&s->kbps, adapt_kbps(&s->adapt));
+		atomic_store(&s->loss, adapt_loss(&s->adapt));
+	}
+}
+
+/*
+ * Wait for a second, taking receivers' reports as they arrive on the
+ * sockets the streams are sent from
+ */
+
+static void take_reports(struct tx *tx, struct pollfd *pfd, size_t npfd)
+{
+	size_t n;
+	uint64_t t, end;
+
+	end = stats_now() + 1000000000;
+
+	while ((t = stats_now()) < end && !atomic_load(&tx->failed)) {
+		if (poll(pfd, npfd, (end - t) / 1000000 + 1) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			sleep(1);
+			return;
+		}
+
+		for (n = 0; n < npfd; n++) {
+			if (pfd[n].revents & POLLIN)
+				read_reports(tx, pfd[n].fd);
+		}
+	}
+}
+
+static int run_tx(struct tx *tx)
+{
+	int r;
+	size_t n, i, npfd = 0, started_workers = 0, started_captures = 0;
+	unsigned int t;
+	struct pollfd pfd[tx->nworker * MAX_FAMILIES];
+
+	atomic_init(&tx->failed, 0);
+	atomic_init(&tx->ended, 0);
+
+	for (n = 0; n < tx->nworker; n++) {
+		for (i = 0; i < tx->worker[n].nbatch; i++) {
+			pfd[npfd].fd = tx->worker[n].batch[i].fd;
+			pfd[npfd].events = POLLIN;
+			npfd++;
+		}
+	}
+
+	/* Encode helpers run alongside their stream's worker; they are
+	 * only started here, as threads do not survive daemonising */
+
+	for (n = 0; n < tx->nstream; n++) {
+		struct stream *s = &tx->stream[n];
+
+		if (split_start(&s->split, s->threads, s->worker->cpu,
+				s->worker->priority) == -1)
+		{
+			fail(tx);
+			goto join;
+		}
+	}
+
+	for (n = 0; n < tx->nworker; n++) {
+		struct worker *w = &tx->worker[n];
+
+		r = pthread_create(&w->thread, NULL, worker_main, w);
+		if (r != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(r));
+			fail(tx);
+			goto join;
+		}
+		started_workers++;
+	}
+
+	for (n = 0; n < tx->ncapture; n++) {
+		struct capture *c = &tx->capture[n];
+
+		r = pthread_create(&c->thread, NULL, capture_main, c);
+		if (r != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(r));
+			fail(tx);
+			goto join;
+		}
+		started_captures++;
+	}
+
+	/* The main thread is left to take reports from receivers, and
+	 * to report on the pipeline */
+
+	for (t = 1; !atomic_load(&tx->failed); t++) {
+		take_reports(tx, pfd, npfd);
+		if (verbose > 0 && t % STATS_INTERVAL == 0)
+			print_stats(tx);
+	}
+
+join:
+	for (n = 0; n < started_captures; n++)
+		pthread_join(tx->capture[n].thread, NULL);
+	for (n = 0; n < started_workers; n++)
+		pthread_join(tx->worker[n].thread, NULL);
+
+	if (verbose > 0)
+		print_stats(tx);
+
+	return atomic_load(&tx->ended) == tx->ncapture ? 0 : -1;
+}
+
+static int start_stream(struct stream *s, const struct stream_config *c,
+		unsigned int rate, unsigned int queue, unsigned int preroll)
+{
+	unsigned int n;
+	struct codec_layout layout;
+
+	s->first = c->first;
+	s->channels = c->channels;
+	s->flags = 0;
+	s->frame = c->frame;
+	s->ts = 0;
+
+	s->bytes_per_frame = codec_bytes_per_frame(c->kbps, c->frame, rate);
+
+	if (codec_layout(&layout, c->channels, c->layout) == -1)
+		return -1;
+	if (split_init(&s->split, &layout, rate, c->frame, s->bytes_per_frame,
+			c->loss, c->complexity) == -1)
+	{
+		return -1;
+	}
+	s->threads = c->threads;
+
+	s->dtx = c->dtx;
+	s->in_dtx = false;
+	atomic_init(&s->suppressed, 0);
+	if (s->dtx)
+		split_ctl(&s->split, OPUS_SET_DTX(1));
+
+	/* When adapting, the bitrate is set outright, below the limit
+	 * on the size of each packet */
+
+	s->adapting = c->adapt > 0;
+	s->set_kbps = c->kbps;
+	s->set_loss = c->loss;
+	atomic_init(&s->kbps, c->kbps);
+	atomic_init(&s->loss, c->loss);
+	atomic_init(&s->reports, 0);
+	if (s->adapting) {
+		adapt_init(&s->adapt, c->adapt, c->kbps, c->loss);
+		split_ctl(&s->split, OPUS_SET_BITRATE(c->kbps * 1000));
+		split_ctl(&s->split, OPUS_SET_INBAND_FEC(1));
+	}
+
+	/* Follow the RFC, payload 0 has 8kHz reference rate */
+
+	s->ts_per_frame = c->frame * RTP_TS_RATE / rate;
+
+	if (net_resolve(c->addr, c->port, &s->dest, &s->dest_len) == -1)
+		return -1;
+
+	/* Random initial sequence and SSRC, as RFC 3550 */
+
+	if (getrandom(&s->rtp.ssrc, sizeof s->rtp.ssrc, 0) == -1
+		|| getrandom(&s->rtp.seq, sizeof s->rtp.seq, 0) == -1)
+	{
+		perror("getrandom");
+		return -1;
+	}
+
+	s->rtp.pt = c->redundancy > 0 ? RTP_PT_RED : RTP_PT_OPUS;
+	s->rtp.marker = 1;
+	s->rtp.stamped = false;
+	s->batch = NULL;
+
+	s->packet = malloc(s->bytes_per_frame);
+	if (s->packet == NULL) {
+		perror("malloc");
+		return -1;
+	}
 
-unsigned int verbose = DEFAULT_VERBOSE;
-bool ptt_is_enabled = DEFAULT_PTT_ENABLED;
+	s->keyed = true; /* a key held at startup is not a press */
+	s->preroll = preroll;
+	s->npreroll = 0;
+	s->ppos = 0;
+	if (s->preroll > 0) {
+		s->prerolled = calloc(s->preroll, sizeof *s->prerolled);
+		if (s->prerolled == NULL) {
+			perror("calloc");
+			return -1;
+		}
+		for (n = 0; n < s->preroll; n++) {
+			s->prerolled[n].pcm = malloc(sizeof(float)
+					* c->frame * c->channels);
+			if (s->prerolled[n].pcm == NULL) {
+				perror("malloc");
+				return -1;
+			}
+		}
+	}
+
+	s->redundancy = c->redundancy;
+	s->nhistory = 0;
+	s->hpos = 0;
+	if (s->redundancy > 0) {
+		s->history = calloc(s->redundancy, sizeof *s->history);
+		if (s->history == NULL) {
+			perror("calloc");
+			return -1;
+		}
+		for (n = 0; n < s->redundancy; n++) {
+			s->history[n].data = malloc(s->bytes_per_frame);
+			if (s->history[n].data == NULL) {
+				perror("malloc");
+				return -1;
+			}
+		}
+	}
+
+	return ring_init(&s->ring, queue,
+			sizeof(struct frame) + sizeof(float) * c->frame * c->channels);
+}
 
-static RtpSession* create_rtp_send(const char *addr_desc, const int port)
+static void stop_stream(struct stream *s)
 {
-	RtpSession *session;
+	unsigned int n;
+
+	ring_clear(&s->ring);
+
+	if (s->redundancy > 0) {
+		for (n = 0; n < s->redundancy; n++)
+			free(s->history[n].data);
+		free(s->history);
+	}
 
-	session = rtp_session_new(RTP_SESSION_SENDONLY);
-	assert(session != NULL);
+	if (s->preroll > 0) {
+		for (n = 0; n < s->preroll; n++)
+			free(s->prerolled[n].pcm);
+		free(s->prerolled);
+	}
+
+	free(s->packet);
+	split_clear(&s->split);
+}
+
+static struct capture* find_capture(struct tx *tx, const char *device)
+{
+	size_t n;
 
-	rtp_session_set_scheduling_mode(session, 0);
-	rtp_session_set_blocking_mode(session, 0);
-	rtp_session_set_connected_mode(session, FALSE);
-	if (rtp_session_set_remote_addr(session, addr_desc, port) != 0)
-		abort();
-	if (rtp_session_set_payload_type(session, 0) != 0)
-		abort();
-	if (rtp_session_set_multicast_ttl(session, 16) != 0)
-		abort();
-	if (rtp_session_set_dscp(session, 40) != 0)
-		abort();
+	for (n = 0; n < tx->ncapture; n++) {
+		if (!strcmp(tx->capture[n].device, device))
+			return &tx->capture[n];
+	}
 
-	return session;
+	return NULL;
 }
 
-static int send_one_frame(snd_pcm_t *snd,
-		const unsigned int channels,
-		const snd_pcm_uframes_t samples,
-		OpusEncoder *encoder,
-		const size_t bytes_per_frame,
-		const unsigned int ts_per_frame,
-		RtpSession *session,
-                ptt_t *ptt)
+static int open_device(struct capture *c, unsigned int rate,
+		unsigned int buffer, snd_pcm_format_t format, bool mmap)
 {
-	int16_t *pcm;
-	void *packet;
-	ssize_t z;
-	snd_pcm_sframes_t f;
-	static unsigned int ts = 0;
+	int r;
+	struct alsa_config ac;
+
+	r = snd_pcm_open(&c->snd, c->device, SND_PCM_STREAM_CAPTURE, 0);
+	if (r < 0) {
+		aerror("snd_pcm_open", r);
+		return -1;
+	}
+
+	ac.rate = rate;
+	ac.channels = c->channels;
+	ac.buffer = buffer * 1000;
+	ac.period = c->frame;
+	ac.format = format;
+	ac.mmap = mmap;
+
+	if (set_alsa_hw(c->snd, &ac) == -1)
+		return -1;
+	if (set_alsa_sw(c->snd) == -1)
+		return -1;
+	if (verbose > 0)
+		print_alsa_config(c->device, &ac);
+
+	c->from_file = false;
+	c->rate = ac.rate;
+	c->format = ac.format;
+	c->mmap = ac.mmap;
+
+	return 0;
+}
+
+/*
+ * Read from a file in place of a sound device; it must have at
+ * least the channels the streams take
+ */
+
+static int open_file(struct capture *c, const char *path, unsigned int rate,
+		snd_pcm_format_t format, bool unpaced)
+{
+	if (wav_open_read(&c->file, path, rate, c->channels, format) == -1)
+		return -1;
+
+	if (c->file.rate != rate) {
+		fprintf(stderr, "File '%s' is at %uHz; use -r %u\n",
+			path, c->file.rate, c->file.rate);
+		return -1;
+	}
+
+	if (c->file.channels < c->channels) {
+		fprintf(stderr, "File '%s' has only %u channels\n",
+			path, c->file.channels);
+		return -1;
+	}
+
+	if (verbose > 0) {
+		fprintf(stderr, "%s: %uHz, %u channels, %s%s\n", path,
+			c->file.rate, c->file.channels,
+			snd_pcm_format_name(c->file.format),
+			unpaced ? ", unpaced" : "");
+	}
+
+	c->from_file = true;
+	c->unpaced = unpaced;
+	c->rate = rate;
+	c->nread = 0;
+	c->channels = c->file.channels;
+	c->format = c->file.format;
+	c->mmap = false;
+
+	return 0;
+}
+
+/*
+ * Group the streams by sound device; each device is opened once,
+ * with enough channels for every stream that takes from it. Given a
+ * file, every stream takes from that instead
+ */
+
+static int open_captures(struct tx *tx, const struct stream_config *config,
+		unsigned int rate, unsigned int buffer, snd_pcm_format_t format,
+		bool mmap, const char *input, bool unpaced)
+{
+	size_t n;
+
+	tx->capture = calloc(tx->nstream, sizeof *tx->capture);
+	tx->ncapture = 0;
+	if (tx->capture == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (n = 0; n < tx->nstream; n++) {
+		struct capture *c;
+		const struct stream_config *sc = &config[n];
+		const char *device = input ? input : sc->device;
 
-	pcm = alloca(sizeof(*pcm) * samples * channels);
-	packet = alloca(bytes_per_frame);
+		c = find_capture(tx, device);
+		if (c == NULL) {
+			c = &tx->capture[tx->ncapture++];
+			c->device = (char*)device;
+			c->frame = sc->frame;
+			c->tx = tx;
+			c->stream = calloc(tx->nstream, sizeof *c->stream);
+			c->worker = calloc(tx->nworker, sizeof *c->worker);
+			if (c->stream == NULL || c->worker == NULL) {
+				perror("calloc");
+				return -1;
+			}
+		}
+
+		if (sc->frame != c->frame) {
+			fprintf(stderr, "Streams from device '%s' must have "
+				"the same frame size\n", c->device);
+			return -1;
+		}
+
+		if (sc->first + sc->channels > c->channels)
+			c->channels = sc->first + sc->channels;
+
+		c->stream[c->nstream++] = &tx->stream[n];
+	}
+
+	for (n = 0; n < tx->ncapture; n++) {
+		int r;
+		size_t i, j;
+		struct capture *c = &tx->capture[n];
+
+		/* Wake each worker once per frame, however many of
+		 * its streams this device feeds */
+
+		for (i = 0; i < c->nstream; i++) {
+			struct worker *w = c->stream[i]->worker;
+
+			for (j = 0; j < c->nworker; j++) {
+				if (c->worker[j] == w)
+					break;
+			}
+			if (j == c->nworker)
+				c->worker[c->nworker++] = w;
+		}
+
+		atomic_init(&c->xruns, 0);
+		atomic_init(&c->recovers, 0);
+
+		if (input)
+			r = open_file(c, input, rate, format, unpaced);
+		else
+			r = open_device(c, rate, buffer, format, mmap);
+		if (r == -1)
+			return -1;
 
-	f = snd_pcm_readi(snd, pcm, samples);
-	if (f < 0) {
-		if (f == -ESTRPIPE)
-			ts = 0;
+		c->frame_bytes = format_bytes(c->format) * c->channels;
 
-		f = snd_pcm_recover(snd, f, 0);
-		if (f < 0) {
-			aerror("snd_pcm_readi", f);
+		c->buf = malloc(c->frame * c->frame_bytes);
+		if (c->buf == NULL) {
+			perror("malloc");
 			return -1;
 		}
-		return 0;
 	}
 
-	/* Opus encoder requires a complete frame, so if we xrun
-	 * mid-frame then we discard the incomplete audio. The next
-	 * read will catch the error condition and recover */
+	return 0;
+}
 
-	if (f < samples) {
-		fprintf(stderr, "Short read, %ld\n", f);
-		return 0;
+static void close_captures(struct tx *tx)
+{
+	size_t n;
+
+	for (n = 0; n < tx->ncapture; n++) {
+		struct capture *c = &tx->capture[n];
+
+		if (c->from_file)
+			wav_close(&c->file);
+		else if (snd_pcm_close(c->snd) < 0)
+			abort();
+		free(c->buf);
+		free(c->stream);
+		free(c->worker);
 	}
 
-        // If PTT capability is enabled, only send packets when the
-        // PTT button is pressed.  Otherwise, unconditionally send the
-        // packet.
-        if(ptt_is_enabled && !ptt_is_pressed(ptt))
-          return 0;
+	free(tx->capture);
+}
 
-	z = opus_encode(encoder, pcm, samples, packet, bytes_per_frame);
-	if (z < 0) {
-		fprintf(stderr, "opus_encode_float: %s\n", opus_strerror(z));
+/*
+ * Largest packet a stream can produce, including the header
+ */
+
+static size_t max_packet(const struct stream *s)
+{
+	size_t z;
+
+	z = s->bytes_per_frame;
+	if (s->redundancy > 0)
+		z = z * (RED_MAX_BLOCKS + 1) + RED_MAX_BLOCKS * 4 + 1;
+
+	return RTP_HEADER_SIZE + RTP_EXT_SIZE + z;
+}
+
+/*
+ * Give each of the worker's streams a batch for its address family,
+ * big enough for every frame the worker could drain in one wakeup
+ */
+
+static int create_batches(struct worker *w, unsigned int queue)
+{
+	size_t n, i, size = 0;
+
+	for (n = 0; n < w->nstream; n++) {
+		size_t z = max_packet(w->stream[n]);
+
+		if (z > size)
+			size = z;
+	}
+
+	w->nbatch = 0;
+	for (n = 0; n < w->nstream; n++) {
+		struct stream *s = w->stream[n];
+		int family = s->dest.ss_family;
+
+		for (i = 0; i < w->nbatch; i++) {
+			if (w->batch[i].family == family)
+				break;
+		}
+
+		if (i == w->nbatch) {
+			assert(w->nbatch < MAX_FAMILIES);
+			if (batch_init(&w->batch[i], family,
+					w->nstream * queue, size) == -1)
+			{
+				return -1;
+			}
+			w->nbatch++;
+		}
+
+		s->batch = &w->batch[i];
+	}
+
+	return 0;
+}
+
+/*
+ * Create the worker pool, one per CPU given (or a single worker), and
+ * deal the streams out between them
+ */
+
+static int create_workers(struct tx *tx, const char *cpus,
+		int encode_cpu, int encode_priority, unsigned int queue)
+{
+	size_t n;
+
+	tx->nworker = 1;
+	if (cpus != NULL) {
+		const char *p;
+
+		for (p = cpus; *p != '\0'; p++) {
+			if (*p == ',')
+				tx->nworker++;
+		}
+	}
+
+	if (posix_memalign((void**)&tx->worker, RING_CACHELINE,
+			tx->nworker * sizeof *tx->worker) != 0)
+	{
+		perror("posix_memalign");
 		return -1;
 	}
 
-        rtp_session_send_with_ts(session, packet, z, ts);
-	ts += ts_per_frame;
+	for (n = 0; n < tx->nworker; n++) {
+		struct worker *w = &tx->worker[n];
+
+		w->tx = tx;
+		w->cpu = encode_cpu;
+		w->priority = encode_priority;
+		w->nstream = 0;
+
+		w->stream = calloc(tx->nstream, sizeof *w->stream);
+		if (w->stream == NULL) {
+			perror("calloc");
+			return -1;
+		}
+
+		if (sem_init(&w->ready, 0, 0) == -1) {
+			perror("sem_init");
+			return -1;
+		}
+	}
+
+	if (cpus != NULL) {
+		char *end;
+		const char *p = cpus;
+
+		for (n = 0; n < tx->nworker; n++) {
+			tx->worker[n].cpu = strtol(p, &end, 10);
+			if (end == p || (*end != ',' && *end != '\0')) {
+				fprintf(stderr, "Invalid CPU list '%s'\n", cpus);
+				return -1;
+			}
+			p = end + 1;
+		}
+	}
+
+	for (n = 0; n < tx->nstream; n++) {
+		struct worker *w = &tx->worker[n % tx->nworker];
+
+		tx->stream[n].worker = w;
+		w->stream[w->nstream++] = &tx->stream[n];
+	}
+
+	for (n = 0; n < tx->nworker; n++) {
+		if (create_batches(&tx->worker[n], queue) == -1)
+			return -1;
+	}
 
 	return 0;
 }
 
-static int run_tx(snd_pcm_t *snd,
-		const unsigned int channels,
-		const snd_pcm_uframes_t frame,
-		OpusEncoder *encoder,
-		const size_t bytes_per_frame,
-		const unsigned int ts_per_frame,
-		RtpSession *session,
-                ptt_t *ptt)
+static void destroy_workers(struct tx *tx)
 {
-	for (;;) {
-		int r;
+	size_t n, i;
 
-		r = send_one_frame(snd, channels, frame,
-                                   encoder, bytes_per_frame, ts_per_frame,
-                                   session,
-                                   ptt);
-		if (r == -1)
+	for (n = 0; n < tx->nworker; n++) {
+		struct worker *w = &tx->worker[n];
+
+		for (i = 0; i < w->nbatch; i++)
+			batch_clear(&w->batch[i]);
+		sem_destroy(&w->ready);
+		free(w->stream);
+	}
+
+	free(tx->worker);
+}
+
+/*
+ * Keep a copy of every packet sent; each batch adds to the capture
+ * as a producer of its own
+ */
+
+static int open_tee(struct tx *tx, const char *path)
+{
+	size_t n, i;
+
+	if (pcap_tee_open(&tx->tee, path, tx->nworker * MAX_FAMILIES) == -1)
+		return -1;
+
+	for (n = 0; n < tx->nworker; n++) {
+		struct worker *w = &tx->worker[n];
+
+		for (i = 0; i < w->nbatch; i++) {
+			w->batch[i].tee = &tx->tee;
+			w->batch[i].producer = n * MAX_FAMILIES + i;
+		}
+	}
+
+	tx->teeing = true;
+	return 0;
+}
+
+/*
+ * Make the pipeline's timings and counters available to stats_serve()
+ */
+
+static int register_stats(struct tx *tx)
+{
+	size_t n, i;
+	char name[32];
+
+	hist_init(&tx->capture_wait);
+	hist_init(&tx->encode);
+	hist_init(&tx->send);
+	hist_init(&tx->keying);
+
+	if (stats_add_hist("tx.capture_wait", &tx->capture_wait) == -1
+		|| stats_add_hist("tx.encode", &tx->encode) == -1
+		|| stats_add_hist("tx.send", &tx->send) == -1
+		|| stats_add_hist("tx.keying", &tx->keying) == -1)
+	{
+		return -1;
+	}
+
+	for (n = 0; n < tx->ncapture; n++) {
+		struct capture *c = &tx->capture[n];
+
+		snprintf(name, sizeof name, "capture%zu.xruns", n);
+		if (stats_add_counter(name, &c->xruns) == -1)
+			return -1;
+		snprintf(name, sizeof name, "capture%zu.recovers", n);
+		if (stats_add_counter(name, &c->recovers) == -1)
+			return -1;
+	}
+
+	for (n = 0; n < tx->nstream; n++) {
+		snprintf(name, sizeof name, "stream%zu.overruns", n);
+		if (stats_add_counter(name, &tx->stream[n].ring.overruns) == -1)
 			return -1;
+		snprintf(name, sizeof name, "stream%zu.suppressed", n);
+		if (stats_add_counter(name, &tx->stream[n].suppressed) == -1)
+			return -1;
+		snprintf(name, sizeof name, "stream%zu.reports", n);
+		if (stats_add_counter(name, &tx->stream[n].reports) == -1)
+			return -1;
+		snprintf(name, sizeof name, "stream%zu.kbps", n);
+		if (stats_add_counter(name, &tx->stream[n].kbps) == -1)
+			return -1;
+	}
 
-		if (verbose > 1)
-			fputc('>', stderr);
+	for (n = 0; n < tx->nworker; n++) {
+		struct worker *w = &tx->worker[n];
+
+		for (i = 0; i < w->nbatch; i++) {
+			snprintf(name, sizeof name, "worker%zu.%s.packets", n,
+				w->batch[i].family == AF_INET6 ? "ipv6" : "ipv4");
+			if (stats_add_counter(name, &w->batch[i].packets) == -1)
+				return -1;
+
+			snprintf(name, sizeof name, "worker%zu.%s.dropped", n,
+				w->batch[i].family == AF_INET6 ? "ipv6" : "ipv4");
+			if (stats_add_counter(name, &w->batch[i].dropped) == -1)
+				return -1;
+		}
 	}
+
+	return 0;
 }
 
 static void usage(FILE *fd)
@@ -149,6 +1603,11 @@ static void usage(FILE *fd)
 		DEFAULT_DEVICE);
 	fprintf(fd, "  -m <ms>     Buffer time (default %d milliseconds)\n",
 		DEFAULT_BUFFER);
+	fprintf(fd, "  -z          Access the device buffer directly (mmap)\n");
+	fprintf(fd, "  -F <fmt>    Sample format: S16_LE, S24_3LE, S32_LE or FLOAT_LE\n"
+		"              (default is the device's own)\n");
+	fprintf(fd, "  -i <file>   Read a WAV or raw file ('-' for stdin) instead of a device\n");
+	fprintf(fd, "  -X          Read the file as fast as it can be sent, not in real time\n");
 
 	fprintf(fd, "\nNetwork parameters:\n");
 	fprintf(fd, "  -h <addr>   IP address to send to (default %s)\n",
@@ -161,21 +1620,60 @@ static void usage(FILE *fd)
 		DEFAULT_RATE);
 	fprintf(fd, "  -c <n>      Number of channels (default %d)\n",
 		DEFAULT_CHANNELS);
+	fprintf(fd, "  -u <map>    Layout of channels as Opus streams: pairs, mono or\n"
+		"              <coupled>:<stream channel>,... (default pairs)\n");
 	fprintf(fd, "  -f <n>      Frame size (default %d samples, see below)\n",
 		DEFAULT_FRAME);
 	fprintf(fd, "  -b <kbps>   Bitrate (approx., default %d)\n",
 		DEFAULT_BITRATE);
+	fprintf(fd, "  -l <pct>    Expected packet loss, enables in-band FEC (default %d)\n",
+		DEFAULT_LOSS);
+	fprintf(fd, "  -x <n>      Encoder complexity, 0 to 10 (default %d)\n",
+		DEFAULT_COMPLEXITY);
+	fprintf(fd, "  -R <n>      Redundant copies of earlier frames, RFC 2198 (default %d)\n",
+		DEFAULT_REDUNDANCY);
+	fprintf(fd, "  -s          Suppress silence (DTX)\n");
+	fprintf(fd, "  -a <kbps>   Adapt the bitrate and FEC to receivers' reports,\n"
+		"              down to no less than <kbps>\n");
 
 	fprintf(fd, "\nProgram parameters:\n");
 	fprintf(fd, "  -v <n>      Verbosity level (default %d)\n",
 		DEFAULT_VERBOSE);
 	fprintf(fd, "  -D <file>   Run as a daemon, writing process ID to the given file\n");
+	fprintf(fd, "  -M <path>   Serve latency statistics on a UNIX socket\n");
+	fprintf(fd, "  -K <file>   Write a copy of packets sent to a pcap file\n");
+	fprintf(fd, "  -y <clock>  Stamp packets with the capture time on 'realtime' or\n"
+		"              a PTP clock, eg. /dev/ptp0, for receivers to measure latency\n");
+
+	fprintf(fd, "\nPipeline parameters:\n");
+	fprintf(fd, "  -q <n>      Frames queued between capture and encode (default %d)\n",
+		DEFAULT_QUEUE);
+	fprintf(fd, "  -A <cpu>[:<pri>]  Capture thread CPU and priority (default any:%d)\n",
+		DEFAULT_CAPTURE_PRIORITY);
+	fprintf(fd, "  -E <cpu>[:<pri>]  Encode thread CPU and priority (default any:%d)\n",
+		DEFAULT_ENCODE_PRIORITY);
+	fprintf(fd, "  -W <cpu>,...      Pool of encode workers, one pinned to each CPU\n");
+	fprintf(fd, "  -P <n>      Threads to encode the Opus streams of one link (default 1)\n");
+	fprintf(fd, "  -e <pct>    Use SCHED_DEADLINE, reserving <pct> of each frame period\n");
+	fprintf(fd, "  -w <ms>     Measure wakeup latency at startup (default %d, 0 to skip)\n",
+		DEFAULT_PROBE);
+
+	fprintf(fd, "\nMultiple streams:\n");
+	fprintf(fd, "  -C <file>   Read stream definitions from a file, one per line, eg.\n"
+		"              device=hw:1 channels=2-3 addr=239.0.0.1 port=1350 bitrate=96\n"
+		"              Other keys are frame, loss, redundancy, complexity, dtx,\n"
+		"              adapt, layout and threads;\n"
+		"              parameters given on the command line are the defaults\n");
 
 	fprintf(fd, "\nPush to talk parameters:\n");
         fprintf(fd, "  -t          Enable push-to-talk mode (default: %s)\n",
                 DEFAULT_PTT_ENABLED ? "enabled" : "disabled");
 	fprintf(fd, "  -k <n>      Keycode in hex to use as the PTT key (default %04x)\n",
                 DEFAULT_PTT_DEV_INPUT_KEYCODE);
+	fprintf(fd, "  -G <n>      Use GPIO line <n> of %s as the PTT key\n",
+		DEFAULT_PTT_GPIO_DEVICE);
+	fprintf(fd, "  -T <ms>     Audio kept while the key is up, sent when pressed (default %d)\n",
+		DEFAULT_PREROLL);
 
 	fprintf(fd, "\nAllowed frame sizes (-f) are defined by the Opus codec. For example,\n"
 		"at 48000Hz the permitted values are 120, 240, 480 or 960.\n");
@@ -183,33 +1681,57 @@ static void usage(FILE *fd)
 
 int main(int argc, char *argv[])
 {
-	int r, error;
-	size_t bytes_per_frame;
-	unsigned int ts_per_frame;
-	snd_pcm_t *snd;
-	OpusEncoder *encoder;
-	RtpSession *session;
+	int r;
+	size_t n, nconfig;
+	double period;
+	struct tx tx;
+	struct stream_config defaults, *config;
         ptt_t *ptt = NULL;
 
 	/* command-line options */
 	const char *device = DEFAULT_DEVICE,
 		*addr = DEFAULT_ADDR,
-		*pid = NULL;
+		*pid = NULL,
+		*streams = NULL,
+		*workers = NULL,
+		*metrics = NULL,
+		*map = NULL,
+		*input = NULL,
+		*capture = NULL,
+		*stamp = NULL;
 	unsigned int buffer = DEFAULT_BUFFER,
 		rate = DEFAULT_RATE,
 		channels = DEFAULT_CHANNELS,
 		frame = DEFAULT_FRAME,
 		kbps = DEFAULT_BITRATE,
-		port = DEFAULT_PORT;
+		port = DEFAULT_PORT,
+		queue = DEFAULT_QUEUE,
+		loss = DEFAULT_LOSS,
+		complexity = DEFAULT_COMPLEXITY,
+		redundancy = DEFAULT_REDUNDANCY,
+		preroll = DEFAULT_PREROLL,
+		dtx = 0,
+		adapt = 0,
+		threads = 1,
+		deadline = 0,
+		probe = DEFAULT_PROBE;
+	int keycode = DEFAULT_PTT_DEV_INPUT_KEYCODE, gpio = -1;
+	int capture_cpu = -1, capture_priority = DEFAULT_CAPTURE_PRIORITY,
+		encode_cpu = -1, encode_priority = DEFAULT_ENCODE_PRIORITY;
+	bool mmap = false, unpaced = false;
+	snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
 
 	for (;;) {
 		int c;
 
-		c = getopt(argc, argv, "b:c:d:f:h:m:p:r:tv:D:");
+		c = getopt(argc, argv, "a:b:c:d:e:f:h:i:k:l:m:p:q:r:stu:v:w:x:y:zA:C:D:E:F:G:K:M:P:R:T:W:X");
 		if (c == -1)
 			break;
 
 		switch (c) {
+		case 'a':
+			adapt = atoi(optarg);
+			break;
 		case 'b':
 			kbps = atoi(optarg);
 			break;
@@ -219,30 +1741,113 @@ int main(int argc, char *argv[])
 		case 'd':
 			device = optarg;
 			break;
+		case 'e':
+			deadline = atoi(optarg);
+			break;
 		case 'f':
 			frame = atol(optarg);
 			break;
 		case 'h':
 			addr = optarg;
 			break;
+		case 'i':
+			input = optarg;
+			break;
+		case 'k':
+			keycode = strtol(optarg, NULL, 16);
+			break;
+		case 'l':
+			loss = atoi(optarg);
+			break;
 		case 'm':
 			buffer = atoi(optarg);
 			break;
 		case 'p':
 			port = atoi(optarg);
 			break;
+		case 'q':
+			queue = atoi(optarg);
+			break;
 		case 'r':
 			rate = atoi(optarg);
 			break;
+		case 's':
+			dtx = 1;
+			break;
                 case 't':
 			ptt_is_enabled = true;
 			break;
+		case 'u':
+			map = optarg;
+			break;
 		case 'v':
 			verbose = atoi(optarg);
 			break;
+		case 'w':
+			probe = atoi(optarg);
+			break;
+		case 'x':
+			complexity = atoi(optarg);
+			break;
+		case 'y':
+			stamp = optarg;
+			break;
+		case 'z':
+			mmap = true;
+			break;
+		case 'A':
+			if (parse_thread_opt(optarg, &capture_cpu,
+					&capture_priority) == -1)
+			{
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'C':
+			streams = optarg;
+			break;
 		case 'D':
 			pid = optarg;
 			break;
+		case 'E':
+			if (parse_thread_opt(optarg, &encode_cpu,
+					&encode_priority) == -1)
+			{
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'F':
+			format = format_parse(optarg);
+			if (format == SND_PCM_FORMAT_UNKNOWN) {
+				usage(stderr);
+				return -1;
+			}
+			break;
+		case 'G':
+			gpio = atoi(optarg);
+			break;
+		case 'K':
+			capture = optarg;
+			break;
+		case 'M':
+			metrics = optarg;
+			break;
+		case 'P':
+			threads = atoi(optarg);
+			break;
+		case 'R':
+			redundancy = atoi(optarg);
+			break;
+		case 'T':
+			preroll = atoi(optarg);
+			break;
+		case 'W':
+			workers = optarg;
+			break;
+		case 'X':
+			unpaced = true;
+			break;
 		default:
 			usage(stderr);
 			return -1;
@@ -252,54 +1857,139 @@ int main(int argc, char *argv[])
         if (verbose)
           fputs(COPYRIGHT "\n", stderr);
 
-        if (ptt_is_enabled)
-          ptt = ptt_create_simple();
+	/* The command line describes a single stream, or the defaults
+	 * for those in the file */
 
-	encoder = opus_encoder_create(rate, channels, OPUS_APPLICATION_AUDIO,
-				&error);
-	if (encoder == NULL) {
-		fprintf(stderr, "opus_encoder_create: %s\n",
-			opus_strerror(error));
-		return -1;
+	defaults.device = (char*)device;
+	defaults.first = 0;
+	defaults.channels = channels;
+	defaults.addr = (char*)addr;
+	defaults.port = port;
+	defaults.kbps = kbps;
+	defaults.frame = frame;
+	defaults.loss = loss;
+	defaults.redundancy = redundancy;
+	defaults.complexity = complexity;
+	defaults.dtx = dtx;
+	defaults.adapt = adapt;
+	defaults.layout = (char*)map;
+	defaults.threads = threads;
+
+	if (streams) {
+		if (config_read(streams, &defaults, &config, &nconfig) == -1)
+			return -1;
+	} else {
+		config = &defaults;
+		nconfig = 1;
 	}
 
-	bytes_per_frame = kbps * 1024 * frame / rate / 8;
+	period = (double)config[0].frame / rate;
 
-	/* Follow the RFC, payload 0 has 8kHz reference rate */
+	for (n = 0; n < nconfig; n++) {
+		if (config[n].redundancy >= RED_MAX_BLOCKS) {
+			fprintf(stderr, "Redundancy must be less than %d\n",
+				RED_MAX_BLOCKS);
+			return -1;
+		}
+		if ((double)config[n].frame / rate < period)
+			period = (double)config[n].frame / rate;
+	}
 
-	ts_per_frame = frame * 8000 / rate;
+	/* Threads wake at least once for every frame */
 
-	ortp_init();
-	ortp_scheduler_init();
-	ortp_set_log_level_mask(NULL, ORTP_WARNING|ORTP_ERROR);
-	session = create_rtp_send(addr, port);
-	assert(session != NULL);
+	if (deadline && go_deadline(period, deadline) == -1)
+		return -1;
 
-	r = snd_pcm_open(&snd, device, SND_PCM_STREAM_CAPTURE, 0);
-	if (r < 0) {
-		aerror("snd_pcm_open", r);
+	if (ptt_is_enabled) {
+		if (gpio >= 0)
+			ptt = ptt_create_gpio(DEFAULT_PTT_GPIO_DEVICE, gpio);
+		else
+			ptt = ptt_create_dev_input(DEFAULT_PTT_DEV_INPUT_DEVICE, keycode);
+		if (ptt == NULL)
+			return -1;
+	}
+
+	tx.nstream = nconfig;
+	if (posix_memalign((void**)&tx.stream, RING_CACHELINE,
+			nconfig * sizeof *tx.stream) != 0)
+	{
+		perror("posix_memalign");
 		return -1;
 	}
-	if (set_alsa_hw(snd, rate, channels, buffer * 1000) == -1)
+
+	for (n = 0; n < nconfig; n++) {
+		unsigned int frames;
+
+		/* Pre-roll in whole frames, rounded up */
+
+		frames = (preroll * rate / 1000 + config[n].frame - 1)
+			/ config[n].frame;
+
+		if (start_stream(&tx.stream[n], &config[n], rate, queue,
+				frames) == -1)
+		{
+			return -1;
+		}
+	}
+
+	tx.ptt = ptt;
+	tx.teeing = false;
+
+	tx.stamping = stamp != NULL;
+	if (stamp) {
+		if (wallclock_open(&tx.clock, stamp) == -1)
+			return -1;
+		for (n = 0; n < tx.nstream; n++)
+			tx.stream[n].rtp.stamped = true;
+	}
+	tx.capture_cpu = capture_cpu;
+	tx.capture_priority = capture_priority;
+
+	if (create_workers(&tx, workers, encode_cpu, encode_priority,
+			queue) == -1)
 		return -1;
-	if (set_alsa_sw(snd) == -1)
+	if (open_captures(&tx, config, rate, buffer, format, mmap,
+			input, unpaced) == -1)
+	{
+		return -1;
+	}
+	if (register_stats(&tx) == -1)
 		return -1;
 
 	if (pid)
 		go_daemon(pid);
 
-	go_realtime();
-	r = run_tx(snd, channels, frame, encoder, bytes_per_frame,
-                   ts_per_frame, session, ptt);
+	/* Not before, as memory locks do not pass to a child */
+
+	go_locked();
+
+	if (capture && open_tee(&tx, capture) == -1)
+		return -1;
+	if (metrics && stats_serve(metrics) == -1)
+		return -1;
+
+	if (probe) {
+		probe_wakeup(capture_priority, capture_cpu, period,
+			probe / 1000.0, verbose > 0);
+	}
+
+	r = run_tx(&tx);
+
+	stats_stop();
 
-	if (snd_pcm_close(snd) < 0)
-		abort();
+	if (tx.teeing)
+		pcap_tee_close(&tx.tee);
+	close_captures(&tx);
+	destroy_workers(&tx);
 
-	rtp_session_destroy(session);
-	ortp_exit();
-	ortp_global_stats_display();
+	for (n = 0; n < tx.nstream; n++)
+		stop_stream(&tx.stream[n]);
+	free(tx.stream);
 
-	opus_encoder_destroy(encoder);
+	if (tx.stamping)
+		wallclock_close(&tx.clock);
+	if (streams)
+		config_free(config, nconfig);
 
         ptt_destroy(ptt);
 
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wallclock.h"
+
+#define CLOCKFD 3
+#define FD_TO_CLOCKID(fd) ((~(clockid_t)(fd) << 3) | CLOCKFD)
+
+/*
+ * Open the clock by name: "realtime", or the path of a PTP device
+ * such as /dev/ptp0
+ */
+
+int wallclock_open(struct wallclock *w, const char *name)
+{
+	struct timespec ts;
+
+	w->fd = -1;
+
+	if (name == NULL || !strcmp(name, "realtime")) {
+		w->id = CLOCK_REALTIME;
+		return 0;
+	}
+
+	w->fd = open(name, O_RDONLY);
+	if (w->fd == -1) {
+		perror(name);
+		return -1;
+	}
+
+	w->id = FD_TO_CLOCKID(w->fd);
+
+	if (clock_gettime(w->id, &ts) == -1) {
+		perror(name);
+		close(w->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+void wallclock_close(struct wallclock *w)
+{
+	if (w->fd != -1)
+		close(w->fd);
+}
+
+/*
+ * Seconds to add to CLOCK_MONOTONIC to give this clock, now
+ */
+
+double wallclock_offset(const struct wallclock *w)
+{
+	struct timespec mono, wall;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(w->id, &wall);
+
+	return (wall.tv_sec - mono.tv_sec) + (wall.tv_nsec - mono.tv_nsec) * 1e-9;
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef WALLCLOCK_H
+#define WALLCLOCK_H
+
+#include <time.h>
+
+/*
+ * The clock on which the capture and playout of audio are compared
+ * between hosts: CLOCK_REALTIME (eg. kept by NTP, or by phc2sys from
+ * PTP), or a PTP hardware clock directly
+ */
+
+struct wallclock {
+	clockid_t id;
+	int fd;
+};
+
+int wallclock_open(struct wallclock *w, const char *name);
+void wallclock_close(struct wallclock *w);
+
+double wallclock_offset(const struct wallclock *w);
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "format.h"
+#include "wav.h"
+
+#define WAV_PCM 0x0001
+#define WAV_FLOAT 0x0003
+#define WAV_EXTENSIBLE 0xfffe
+#define WAV_STREAMING 0xffffffff /* length not known */
+#define WAV_HEADER 44
+
+static uint16_t get16(const unsigned char *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put16(unsigned char *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static FILE* open_file(const char *path, const char *mode)
+{
+	FILE *f;
+
+	if (!strcmp(path, "-"))
+		return mode[0] == 'r' ? stdin : stdout;
+
+	f = fopen(path, mode);
+	if (!f)
+		perror(path);
+
+	return f;
+}
+
+static snd_pcm_format_t wav_format(unsigned int tag, unsigned int bits,
+		unsigned int align, unsigned int channels)
+{
+	if (tag == WAV_PCM && bits == 16)
+		return SND_PCM_FORMAT_S16_LE;
+	if (tag == WAV_PCM && bits == 24 && align == 3 * channels)
+		return SND_PCM_FORMAT_S24_3LE;
+	if (tag == WAV_PCM && bits == 32)
+		return SND_PCM_FORMAT_S32_LE;
+	if (tag == WAV_FLOAT && bits == 32)
+		return SND_PCM_FORMAT_FLOAT_LE;
+
+	return SND_PCM_FORMAT_UNKNOWN;
+}
+
+/*
+ * Skip a chunk by reading it, as the file may be a pipe
+ */
+
+static int skip(FILE *f, uint64_t len)
+{
+	unsigned char buf[256];
+	size_t n;
+
+	while (len > 0) {
+		n = len < sizeof buf ? len : sizeof buf;
+		if (fread(buf, 1, n, f) != n)
+			return -1;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Find the format, then stop at the start of the audio
+ */
+
+static int read_header(struct wav *w)
+{
+	unsigned char b[40];
+	uint32_t len;
+	unsigned int tag = 0, bits = 0, align = 0;
+	bool fmt = false;
+
+	for (;;) {
+		if (fread(b, 1, 8, w->f) != 8) {
+			fprintf(stderr, "WAV file has no audio\n");
+			return -1;
+		}
+		len = get32(b + 4);
+
+		if (!memcmp(b, "data", 4))
+			break;
+
+		if (!memcmp(b, "fmt ", 4) && len >= 16 && len <= sizeof b) {
+			if (fread(b, 1, len, w->f) != len
+				|| skip(w->f, len & 1) == -1)
+			{
+				fprintf(stderr, "WAV file is truncated\n");
+				return -1;
+			}
+
+			tag = get16(b);
+			w->channels = get16(b + 2);
+			w->rate = get32(b + 4);
+			align = get16(b + 12);
+			bits = get16(b + 14);
+
+			/* The first two bytes of the sub-format are
+			 * the format tag */
+
+			if (tag == WAV_EXTENSIBLE && len >= 26)
+				tag = get16(b + 24);
+
+			fmt = true;
+			continue;
+		}
+
+		if (skip(w->f, (uint64_t)len + (len & 1)) == -1) {
+			fprintf(stderr, "WAV file is truncated\n");
+			return -1;
+		}
+	}
+
+	if (!fmt) {
+		fprintf(stderr, "WAV file has no format\n");
+		return -1;
+	}
+
+	w->format = wav_format(tag, bits, align, w->channels);
+	if (w->format == SND_PCM_FORMAT_UNKNOWN) {
+		fprintf(stderr, "Unsupported WAV encoding (format %u, "
+			"%u bits)\n", tag, bits);
+		return -1;
+	}
+
+	/* A file being written as it is read has no length yet */
+
+	if (len == 0 || len == WAV_STREAMING)
+		w->left = UINT64_MAX;
+	else
+		w->left = len;
+
+	return 0;
+}
+
+/*
+ * Open a file to read; the rate, channels and format are those of
+ * a raw file, and are replaced by what is in a WAV header
+ */
+
+int wav_open_read(struct wav *w, const char *path, unsigned int rate,
+		unsigned int channels, snd_pcm_format_t format)
+{
+	w->f = open_file(path, "rb");
+	if (!w->f)
+		return -1;
+
+	w->output = false;
+	w->written = 0;
+	w->ppeek = 0;
+	w->npeek = fread(w->peek, 1, sizeof w->peek, w->f);
+
+	if (w->npeek == sizeof w->peek && !memcmp(w->peek, "RIFF", 4)
+		&& !memcmp(w->peek + 8, "WAVE", 4))
+	{
+		w->header = true;
+		w->npeek = 0;
+		if (read_header(w) == -1) {
+			wav_close(w);
+			return -1;
+		}
+	} else {
+		w->header = false;
+		w->rate = rate;
+		w->channels = channels;
+		w->format = format;
+		if (w->format == SND_PCM_FORMAT_UNKNOWN)
+			w->format = SND_PCM_FORMAT_S16_LE;
+		w->left = UINT64_MAX;
+	}
+
+	w->frame_bytes = format_bytes(w->format) * w->channels;
+
+	return 0;
+}
+
+static int write_header(struct wav *w, uint64_t bytes)
+{
+	unsigned char h[WAV_HEADER];
+	uint32_t len;
+
+	if (bytes > UINT32_MAX - WAV_HEADER)
+		len = WAV_STREAMING;
+	else
+		len = bytes;
+
+	memcpy(h, "RIFF", 4);
+	put32(h + 4, len == WAV_STREAMING ? len : len + WAV_HEADER - 8);
+	memcpy(h + 8, "WAVE", 4);
+
+	memcpy(h + 12, "fmt ", 4);
+	put32(h + 16, 16);
+	put16(h + 20, w->format == SND_PCM_FORMAT_FLOAT_LE ? WAV_FLOAT : WAV_PCM);
+	put16(h + 22, w->channels);
+	put32(h + 24, w->rate);
+	put32(h + 28, w->rate * w->frame_bytes);
+	put16(h + 32, w->frame_bytes);
+	put16(h + 34, format_bytes(w->format) * 8);
+
+	memcpy(h + 36, "data", 4);
+	put32(h + 40, len);
+
+	if (fwrite(h, sizeof h, 1, w->f) != 1) {
+		perror("fwrite");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Open a file to write; a WAV header is written as of unknown length
+ * and filled in on closing, if the file can be seeked
+ */
+
+int wav_open_write(struct wav *w, const char *path, unsigned int rate,
+		unsigned int channels, snd_pcm_format_t format)
+{
+	size_t len;
+
+	w->f = open_file(path, "wb");
+	if (!w->f)
+		return -1;
+
+	w->output = true;
+	w->rate = rate;
+	w->channels = channels;
+	w->format = format;
+	if (w->format == SND_PCM_FORMAT_UNKNOWN)
+		w->format = SND_PCM_FORMAT_S16_LE;
+	w->frame_bytes = format_bytes(w->format) * w->channels;
+	w->written = 0;
+	w->npeek = 0;
+
+	len = strlen(path);
+	w->header = len > 4 && !strcasecmp(path + len - 4, ".wav");
+
+	if (w->header && write_header(w, UINT64_MAX) == -1) {
+		wav_close(w);
+		return -1;
+	}
+
+	return 0;
+}
+
+int wav_close(struct wav *w)
+{
+	int r = 0;
+
+	if (w->output && w->header && fseek(w->f, 0, SEEK_SET) == 0)
+		r = write_header(w, w->written * w->frame_bytes);
+
+	if (w->f == stdin || w->f == stdout) {
+		if (fflush(w->f) != 0 && w->output) {
+			perror("fflush");
+			r = -1;
+		}
+	} else if (fclose(w->f) != 0) {
+		perror("fclose");
+		r = -1;
+	}
+
+	return r;
+}
+
+/*
+ * Read up to the given number of frames; fewer means the end of the
+ * file, and any part of a frame there is dropped
+ */
+
+ssize_t wav_read(struct wav *w, void *buf, size_t frames)
+{
+	unsigned char *out = buf;
+	size_t want, n = 0;
+
+	want = frames * w->frame_bytes;
+	if (want > w->left)
+		want = w->left - w->left % w->frame_bytes;
+
+	while (n < want && w->ppeek < w->npeek)
+		out[n++] = w->peek[w->ppeek++];
+
+	n += fread(out + n, 1, want - n, w->f);
+	if (n < want && ferror(w->f)) {
+		perror("fread");
+		return -1;
+	}
+
+	if (w->left != UINT64_MAX)
+		w->left -= n;
+
+	return n / w->frame_bytes;
+}
+
+int wav_write(struct wav *w, const void *buf, size_t frames)
+{
+	if (fwrite(buf, w->frame_bytes, frames, w->f) != frames) {
+		perror("fwrite");
+		return -1;
+	}
+
+	w->written += frames;
+
+	return 0;
+}
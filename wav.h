@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2020 Mark Hills <mark@xwax.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#ifndef WAV_H
+#define WAV_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <alsa/asoundlib.h>
+
+/*
+ * Audio from or to a file in place of a sound device: a WAV file
+ * (read whenever the file has the header, and written when the name
+ * ends ".wav") or raw interleaved samples. "-" is stdin or stdout
+ */
+
+struct wav {
+	FILE *f;
+	bool output, header;
+	unsigned int rate, channels;
+	snd_pcm_format_t format;
+	size_t frame_bytes;
+
+	uint64_t left; /* bytes of data still to read */
+	uint64_t written; /* frames, for the header */
+
+	unsigned char peek[12]; /* read ahead of a raw file */
+	size_t npeek, ppeek;
+};
+
+int wav_open_read(struct wav *w, const char *path, unsigned int rate,
+		unsigned int channels, snd_pcm_format_t format);
+int wav_open_write(struct wav *w, const char *path, unsigned int rate,
+		unsigned int channels, snd_pcm_format_t format);
+int wav_close(struct wav *w);
+
+ssize_t wav_read(struct wav *w, void *buf, size_t frames);
+int wav_write(struct wav *w, const void *buf, size_t frames);
+
+#endif